@@ -4,7 +4,33 @@
 //	Optional ASCII character output
 //	Optional single-line output
 //	Optional raw binary output to file
+//	Optional hexdump-style format strings
+//	Optional C string, C array, base64 and hex string export
+//	Optional replay of raw capture files
+//	Optional runtime control FIFO
+//	Optional per-byte timestamped capture
+//	Optional minimal-footprint build profile (TTYDUMP_MINIMAL)
+//	Optional multiple ports, opened and configured in parallel
+//	Optional Prometheus textfile metrics
+//	Optional line break on idle gaps, driven by coalesced event timers
+//	Optional regex highlighting and line filtering of ASCII output
+//	Optional boot milestone profiler with per-stage percentiles
+//	Optional 4-gram index of capture files, and a query mode which only opens candidate files
+//	Optional device clock drift and transport latency estimation from embedded timestamps
+//	Optional LIN bus frame decoding with schedule timing statistics
+//	Optional EWMA anomaly detection on message gaps, byte rate and error rate
+//	Optional single append-only log of all ports, with a per-port segment index
+//	Optional terminal plot of numeric text fields, decimated to min/max per column
+//	Optional forwarding of text lines to journald or syslog, in batched datagrams
+//	Optional huge page arena for the large buffers, prefaulted at startup
+//	Optional comparison of two redundant links, aligned by content
+//	Optional RTS/CTS or XON/XOFF flow control, throttling the sender while reading falls behind
+//	Optional RS-485 9-bit address decoding, with per-address streams and turnaround times
+//	Optional VT100 screen emulation, drawing only what changed, with text snapshots of the screen
 
+#ifdef __linux__
+#define _GNU_SOURCE	/* sendmmsg() */
+#endif	/* __linux__ */
 #include <fcntl.h>
 #include <stdio.h>
 #include <ctype.h>
@@ -16,14 +42,119 @@
 #include <signal.h>
 #include <unistd.h>
 #include <errno.h>
+#include <math.h>
 #include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#include <linux/serial.h>
+#endif	/* __linux__ */
+#ifndef __linux__
+//	sendmmsg() is Linux only, journal batches are sent one message at a time elsewhere
+struct mmsghdr {
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
+};
+#endif	/* !__linux__ */
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif	/* __SSE2__ */
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#endif	/* __x86_64__ || __i386__ */
+
+//	Build profile, optional features can be excluded at compile time (-DFEATURE_<NAME>=0)
+#ifdef TTYDUMP_MINIMAL
+#define FEATURE_DEFAULT 0
+#else
+#define FEATURE_DEFAULT 1
+#endif	/* TTYDUMP_MINIMAL */
+#ifndef FEATURE_EXPORT
+#define FEATURE_EXPORT FEATURE_DEFAULT
+#endif
+#ifndef FEATURE_CONTROL
+#define FEATURE_CONTROL FEATURE_DEFAULT
+#endif
+#ifndef FEATURE_CAPTURE
+#define FEATURE_CAPTURE 1
+#endif
+#ifndef FEATURE_THREADS
+#define FEATURE_THREADS FEATURE_DEFAULT
+#endif
+#ifndef FEATURE_METRICS
+#define FEATURE_METRICS FEATURE_DEFAULT
+#endif
+#ifndef FEATURE_REGEX
+#define FEATURE_REGEX FEATURE_DEFAULT
+#endif
+#ifndef FEATURE_BOOT
+#define FEATURE_BOOT FEATURE_DEFAULT
+#endif
+#ifndef FEATURE_INDEX
+#define FEATURE_INDEX FEATURE_DEFAULT
+#endif
+#ifndef FEATURE_CLOCK
+#define FEATURE_CLOCK FEATURE_DEFAULT
+#endif
+#ifndef FEATURE_LIN
+#define FEATURE_LIN FEATURE_DEFAULT
+#endif
+#ifndef FEATURE_ANOMALY
+#define FEATURE_ANOMALY FEATURE_DEFAULT
+#endif
+#ifndef FEATURE_LOG
+#define FEATURE_LOG FEATURE_DEFAULT
+#endif
+#ifndef FEATURE_PLOT
+#define FEATURE_PLOT FEATURE_DEFAULT
+#endif
+#ifndef FEATURE_JOURNAL
+#define FEATURE_JOURNAL FEATURE_DEFAULT
+#endif
+#ifndef FEATURE_HUGEPAGES
+#define FEATURE_HUGEPAGES FEATURE_DEFAULT
+#endif
+#ifndef FEATURE_COMPARE
+#define FEATURE_COMPARE FEATURE_DEFAULT
+#endif
+#ifndef FEATURE_FLOW
+#define FEATURE_FLOW FEATURE_DEFAULT
+#endif
+#ifndef FEATURE_RS485
+#define FEATURE_RS485 FEATURE_DEFAULT
+#endif
+#ifndef FEATURE_VT
+#define FEATURE_VT FEATURE_DEFAULT
+#endif
+
+#if FEATURE_THREADS
+#include <pthread.h>
+#endif	/* FEATURE_THREADS */
 
 //	Global constants
 #define RX_BUFFER_SIZE 255
+#define RX_BUFFER_MAX 4096
+#define RX_READ_INTERVAL_MS 10
+#ifdef TTYDUMP_MINIMAL
+#define REPLAY_BUFFER_SIZE RX_BUFFER_MAX
+#define OUT_BUFFER_SIZE 4096
+#else
+#define REPLAY_BUFFER_SIZE 65536
+#define OUT_BUFFER_SIZE 16384
+#endif	/* TTYDUMP_MINIMAL */
 #define DEF_BAUD_RATE 115200
 #define MIN_COLUMN_WIDTH 1
 #define DEF_COLUMN_WIDTH 8
 #define MAX_COLUMN_WIDTH 128
+#define MAX_PORTS 64
+#define MAX_TIMERS (2 * MAX_PORTS + 5)
+#define OPEN_POOL_THREADS 8
 #define EXIT_UNLOCKED 1
 #define EXIT_LOCKED 2
 #define ESC_COLOR_GREEN "\033[32m"
@@ -34,9 +165,182 @@
 #define ESC_COLOR_MIDI_CC "\033[36m"
 #define ESC_COLOR_MIDI_PB "\033[93m"
 #define ESC_COLOR_MIDI_AT "\033[94m"
+#define ESC_COLOR_MATCH "\033[1;31m"
 #define ESC_COLOR_RESET "\033[0m"
 #define ESC_CLEAR_OUTPUT "\e[1;1H\e[2J"
 #define NANOSECONDS_PER_SECOND ((long)(1000000000l))
+#define OUT_BUFFER_RESERVE 64
+#define FMT_MAX_LENGTH 1024
+#define FMT_LUT_WIDTH 16
+#define CONTROL_LINE_SIZE 1024
+#define CAPTURE_MAGIC "TTYD"
+#define CAPTURE_VERSION 1
+#define CAPTURE_HEADER_SIZE 24
+#define CAPTURE_FLAG_INTERPOLATED 0x01
+#define CAPTURE_RESOLUTION_NS 1000
+#define CAPTURE_BITS_PER_CHAR 10
+#define CAPTURE_MAX_RECORD 11
+#define MAX_IDLE_GAP_MS 3600000
+#define IDLE_SLACK_DIVISOR 8
+#define TIMER_SLACK_NS 1000000
+#define REGEX_MAX_NODES 1024
+#define REGEX_MAX_REPEAT 255
+#define REGEX_CACHE_STATES 256
+#define REGEX_CACHE_POOL 16384
+#define REGEX_HOLD_SIZE 4096
+#define REGEX_LITERAL_MAX 32
+#define RE_MARK_START 0x01
+#define RE_MARK_MATCH 0x02
+#define KMP_MAX_LENGTH 64
+#define BOOT_MAX_MILESTONES 16
+#define BOOT_MAX_LENGTH KMP_MAX_LENGTH
+#define BOOT_MAX_SAMPLES 1024
+#define INDEX_MAGIC "TTDX"
+#define INDEX_VERSION 1
+#define INDEX_HEADER_SIZE 32
+#define INDEX_GRAM 4
+#define INDEX_HASHES 3
+#define INDEX_MIN_LOG_BITS 9
+#define INDEX_MAX_LOG_BITS 22
+#define INDEX_MAX_FILL 40
+#define INDEX_QUERY_MAX 256
+#define CLOCK_BUCKETS 19
+#define CLOCK_WARMUP 32
+#define CLOCK_FORGET 0.99999
+#define CLOCK_HUBER 1.5
+#define CLOCK_SCALE_ALPHA 0.05
+#define CLOCK_MIN_SCALE 1e-6
+#define CLOCK_P0 1e6
+#define LIN_IDS 64
+#define LIN_MAX_DATA 8
+#define LIN_SYNC_BYTE 0x55
+#define LIN_DIAG_ID 0x3c
+#define LIN_CHECKSUM_AUTO 0
+#define LIN_CHECKSUM_CLASSIC 1
+#define LIN_CHECKSUM_ENHANCED 2
+#define LIN_IDLE_CHARS 10
+#define RS485_ADDRESSES 256
+#define RS485_SHOW_BYTES 32
+#define RS485_GAP_CHARS 3
+#define RS485_IDLE_CHARS 10
+#define ANOMALY_DETECTORS 3
+#define ANOMALY_GAP 0
+#define ANOMALY_RATE 1
+#define ANOMALY_ERRORS 2
+#define ANOMALY_ALPHA 0.05
+#define ANOMALY_WARMUP 16
+#define ANOMALY_MIN_DEV 0.05
+#define ANOMALY_WINDOW_MS 1000
+#define ANOMALY_GAP_CHARS 10
+#define ANOMALY_MIN_GAP_NS 2000000
+#define ANOMALY_RING_SIZE 65536
+#define LOG_MAGIC "TTDL"
+#define LOG_INDEX_MAGIC "TTDI"
+#define LOG_VERSION 1
+#define LOG_HEADER_SIZE 24
+#define LOG_RECORD_HEADER 12
+#define LOG_TRAILER_SIZE 16
+#define LOG_MAX_RECORD 65535
+#define LOG_ALIGN 4096
+#define LOG_BUFFER_SIZE 262144
+#define LOG_SEGMENT_SIZE 1048576
+#define LOG_FLUSH_MS 1000
+#define LOG_NO_RECORD UINT64_MAX
+#define PLOT_MAX_SERIES 8
+#define PLOT_MAX_FIELDS 64
+#define PLOT_MAX_WIDTH 512
+#define PLOT_DEF_FPS 20
+#define PLOT_MAX_FPS 60
+#define PLOT_DEF_ROWS 24
+#define PLOT_DEF_COLS 80
+#define PLOT_MIN_ROWS 4
+#define PLOT_GUTTER 12
+#define PLOT_TITLE_MAX 64
+#define PLOT_LINE_SIZE (PLOT_MAX_WIDTH * 8 + 128)
+#define PLOT_MAX_DIGITS 19
+#define PLOT_MAX_EXPONENT 1000
+#define PLOT_MIN_RANGE 1e-9
+#define JOURNAL_SOCKET "/run/systemd/journal/socket"
+#ifdef __APPLE__
+#define SYSLOG_SOCKET "/var/run/syslog"
+#else
+#define SYSLOG_SOCKET "/dev/log"
+#endif	/* __APPLE__ */
+#define JOURNAL_IDENTIFIER "ttydump"
+#define JOURNAL_FACILITY 1
+#define JOURNAL_PRIORITY 6
+#define JOURNAL_BATCH 64
+#define JOURNAL_QUEUE 256
+#define JOURNAL_LINE_MAX 2048
+#define JOURNAL_HEAD_MAX 64
+#define JOURNAL_MSG_MAX (JOURNAL_HEAD_MAX + JOURNAL_LINE_MAX + 1)
+#define JOURNAL_PREFIX_MAX 256
+#define JOURNAL_FLUSH_MS 10
+#define JOURNAL_CLOSE_MS 1000
+#define ARENA_ALIGN 64
+#define ARENA_HEADER ARENA_ALIGN
+#define ARENA_HUGE_PAGE (2 * 1024 * 1024)
+#define ARENA_SLACK 65536
+#define ARENA_HEAP 0
+#define ARENA_HUGETLB 1
+#define ARENA_THP 2
+#define ARENA_PAGES 3
+#define COMPARE_CHUNKS 0
+#define COMPARE_LINES 1
+#define COMPARE_PENDING 1024
+#define COMPARE_MIN_CHUNK 16
+#define COMPARE_MAX_CHUNK 1024
+#define COMPARE_CHUNK_MASK 0xfc00000000000000ull
+#define COMPARE_MAX_LINE 4096
+#define COMPARE_DEF_WINDOW_MS 2000
+#define COMPARE_MAX_WINDOW_MS 600000
+#define COMPARE_REPORT_MS 1000
+#define FLOW_RTSCTS 1
+#define FLOW_XONXOFF 2
+#define FLOW_INPUT_SIZE 4096
+#define FLOW_DEF_HIGH 75
+#define FLOW_DEF_LOW 25
+#define FLOW_CHECK_MS 10
+#define VT_DEF_COLS 80
+#define VT_DEF_ROWS 24
+#define VT_MIN_COLS 2
+#define VT_MIN_ROWS 2
+#define VT_MAX_COLS 256
+#define VT_MAX_ROWS 128
+#define VT_MAX_PARAMS 16
+#define VT_MAX_PARAM 65535
+#define VT_FPS 30
+#define VT_TAB_WIDTH 8
+#define VT_TITLE_MAX 64
+#define VT_CELL_MAX 64
+#define VT_LINE_SIZE 4096
+#define VT_STATES 9
+#define VT_GROUND 0
+#define VT_ESCAPE 1
+#define VT_ESCAPE_INTER 2
+#define VT_CSI_ENTRY 3
+#define VT_CSI_PARAM 4
+#define VT_CSI_INTER 5
+#define VT_CSI_IGNORE 6
+#define VT_OSC 7
+#define VT_STRING 8
+#define VT_NONE 0
+#define VT_PRINT 1
+#define VT_EXECUTE 2
+#define VT_CLEAR 3
+#define VT_COLLECT 4
+#define VT_PARAM 5
+#define VT_ESC_DISPATCH 6
+#define VT_CSI_DISPATCH 7
+#define VT_ATTR_BOLD 0x01
+#define VT_ATTR_UNDERLINE 0x02
+#define VT_ATTR_BLINK 0x04
+#define VT_ATTR_REVERSE 0x08
+#define VT_ATTR_FG 0x10
+#define VT_ATTR_BG 0x20
+#define VT_ATTR_CURSOR 0x40
+#define FNV_OFFSET 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
 
 //	Subtract two timespec structures (sec, ms)
 void timespec_sub(struct timespec *start, struct timespec *end,
@@ -106,28 +410,561 @@ int convert_baud_rate(int rate) {
 	}
 }
 
-//	Application context structure type
+//	Buffered terminal output, flushed once per received chunk
+typedef struct {
+	size_t len;
+	char data[OUT_BUFFER_SIZE];
+} out_buffer_t;
+
+//	Format string operation kinds
+typedef enum {
+	FMT_OP_TEXT = 0,
+	FMT_OP_LUT,
+	FMT_OP_INT,
+	FMT_OP_OFFSET,
+	FMT_OP_TIME_ABS,
+	FMT_OP_TIME_NS,
+	FMT_OP_TIME_SEC,
+	FMT_OP_COUNT
+} fmt_op_kind_t;
+
+//	Single compiled format string operation
+typedef struct {
+	uint8_t kind;
+	uint8_t size;
+	uint16_t len;
+	const char *text;
+	char (*lut)[FMT_LUT_WIDTH];
+	char conv;
+	char spec[16];
+} fmt_op_t;
+
+//	Format unit (iteration count applied to a run of operations)
+typedef struct {
+	uint16_t first, count, iter;
+} fmt_unit_t;
+
+//	Compiled format program and its execution state
+typedef struct {
+	fmt_op_t *ops;
+	fmt_unit_t *units;
+	char *text;
+	uint16_t nops, nunits;
+	//	Execution state, preserved across read() chunks
+	uint8_t active;
+	uint16_t unit, iter, op;
+	uint8_t acc[4], acc_len;
+	uint64_t offset;
+	long time_abs, time_delta;
+} fmt_program_t;
+
+//	Export encodings
+typedef enum {
+	EXPORT_NONE = 0,
+	EXPORT_CSTR,
+	EXPORT_CARRAY,
+	EXPORT_BASE64,
+	EXPORT_HEX,
+	EXPORT_COUNT
+} export_kind_t;
+
+//	Export encoding description, 'ratio' bounds output characters per input byte
+typedef struct {
+	const char *name, *prefix, *suffix;
+	size_t ratio;
+	size_t (*encode)(const uint8_t *, size_t, char *);
+} export_encoding_t;
+
+//	Export state, buffers a partial line across read() chunks
+typedef struct {
+	uint8_t kind, frame;
+	size_t len;
+	uint8_t line[MAX_COLUMN_WIDTH];
+} export_state_t;
+
+//	Regex NFA node kinds
+typedef enum {
+	RE_NODE_CHAR = 0,
+	RE_NODE_SPLIT,
+	RE_NODE_EMPTY,
+	RE_NODE_MATCH
+} re_node_kind_t;
+
+//	Regex NFA node, a CHAR node consumes one byte of its set, 'out' holds the next node(s)
+typedef struct {
+	uint8_t kind;
+	uint16_t set;
+	int32_t out[2];
+} re_node_t;
+
+//	Compiled regex, Thompson NFAs for the pattern and for its reverse, sharing byte classes
+typedef struct {
+	re_node_t *nodes;
+	uint32_t (*sets)[8];
+	uint16_t nnodes, nsets;
+	uint16_t fwd, rev;
+	uint8_t cls[256];
+	uint16_t ncls;
+	uint8_t bol, eol;
+	char lit[REGEX_LITERAL_MAX];
+	uint8_t litlen;
+} re_program_t;
+
+//	Lazily built DFA over one NFA start node, states are added on first use into a bounded cache
+//	State 0 is the dead state, 'trans' holds -1 for transitions not computed yet
+typedef struct {
+	const re_program_t *re;
+	uint16_t start_node;
+	uint8_t unanchored;
+	int start, nstates;
+	int16_t *trans, *hash;
+	uint8_t *accept;
+	uint32_t *set_off;
+	uint16_t *set_len, *pool, *list;
+	size_t pool_len;
+	uint32_t *seen, gen;
+	uint32_t resets;
+} re_dfa_t;
+
+//	Per-port regex state, holds the part of the current line a match may still reach back into
+typedef struct {
+	re_program_t *re;
+	re_dfa_t scan, extend, rev;
+	int state;
+	uint8_t matched, hit, line_start;
+	size_t len;
+	uint8_t hold[REGEX_HOLD_SIZE], mark[REGEX_HOLD_SIZE];
+} re_match_t;
+
+//	Substring pattern for incremental matching across reads (KMP)
+//	fail[i] is the length of the longest proper prefix of s[0..i] which is also its suffix
+typedef struct {
+	const uint8_t *s;
+	uint8_t len;
+	uint8_t fail[KMP_MAX_LENGTH];
+} kmp_pattern_t;
+
+//	Per-port boot milestone profiler, times are in ns relative to the start of the boot
+//	Milestones are matched in order, the first one is also watched for to detect resets
+//	Samples hold the stage durations of the last BOOT_MAX_SAMPLES complete boots, plus the total
+typedef struct {
+	char **names;
+	int count, next, pos_next, pos_first;
+	kmp_pattern_t match[BOOT_MAX_MILESTONES];
+	uint8_t armed, running, bol;
+	int64_t t0, line_t, last_t, at[BOOT_MAX_MILESTONES];
+	uint32_t boots, complete, nsamples;
+	int64_t sum[BOOT_MAX_MILESTONES + 1];
+	int64_t samples[BOOT_MAX_SAMPLES][BOOT_MAX_MILESTONES + 1];
+} boot_profile_t;
+
+//	Bloom filter over the 4-grams of a capture file's data bytes, folded in half on completion
+//	while it stays below INDEX_MAX_FILL percent full
+typedef struct {
+	char *path;
+	uint8_t log_bits, in_arena;
+	uint32_t gram;
+	uint64_t len;
+	uint8_t bits[1 << (INDEX_MAX_LOG_BITS - 3)];
+} ngram_index_t;
+
+//	Per-port device clock estimator, fed with (host time, device time) pairs from '-D' fields
+//	theta is [ offset, drift ] of host minus device time (s) since the first frame of the fit
+typedef struct {
+	kmp_pattern_t prefix;
+	uint32_t hz;
+	uint8_t width, digits, fitted, have_floor;
+	int pos;
+	uint64_t field, ticks, ticks0;
+	int64_t host0, epoch_ns;
+	uint64_t frames, fit_start;
+	uint32_t resets;
+	double theta[2], P[3], scale, floor;
+	uint64_t buckets[CLOCK_BUCKETS + 1], latency_count;
+	double latency_sum, latency_max;
+} clock_est_t;
+
+//	Unescaped PARMRK events, a mark is a byte received with a parity or framing error
+typedef enum {
+	PARMRK_NONE = 0,
+	PARMRK_DATA,
+	PARMRK_MARK,
+	PARMRK_BREAK
+} parmrk_event_t;
+
+//	LIN frame decoder states, a frame is a BREAK, the 0x55 sync byte, the PID and the response
+typedef enum {
+	LIN_IDLE = 0,
+	LIN_SYNC,
+	LIN_PID,
+	LIN_DATA
+} lin_state_t;
+
+//	Per-ID LIN statistics, the period runs from one header of the ID to its next (ms)
+typedef struct {
+	uint64_t frames, errors, no_response, headers;
+	int64_t last;
+	double mean, m2, min, max;
+	uint8_t model;
+} lin_id_stats_t;
+
+//	Per-port LIN decoder, PARMRK escape state is preserved across read() chunks
+typedef struct {
+	uint8_t state, esc, framing, sync, pid, len;
+	uint8_t data[LIN_MAX_DATA + 1];
+	int64_t t_first, t_break;
+	uint64_t breaks, frames, errors, stray;
+	lin_id_stats_t ids[LIN_IDS];
+} lin_decoder_t;
+
+//	Per-address RS-485 statistics, the turnaround runs from the end of a request to its response (ms)
+//	With 'demux=', the data to and from the address is written to a file of its own
+typedef struct {
+	uint64_t requests, responses, req_bytes, resp_bytes;
+	double mean, m2, min, max;
+	FILE *demux;
+} rs485_node_t;
+
+//	Per-port RS-485 9-bit decoder, a segment is an address byte with the data after it (request),
+//	or the data after an idle gap (the addressed node's response)
+//	PARMRK escape state is preserved across read() chunks
+typedef struct {
+	uint8_t esc, addr, active, response, addressed;
+	uint8_t data[RS485_SHOW_BYTES];
+	uint32_t len;
+	int port;
+	int64_t t_first, t_start, t_last, turnaround;
+	uint64_t segments, stray;
+	rs485_node_t nodes[RS485_ADDRESSES];
+} rs485_decoder_t;
+
+//	Runtime control FIFO
+typedef struct {
+	int fd;
+	uint8_t created;
+	size_t len;
+	char line[CONTROL_LINE_SIZE];
+} control_t;
+
+//	Timestamped capture encoder/decoder state, times are in units of res_ns
+typedef struct {
+	uint32_t char_ns, res_ns;
+	int64_t start_ns, last, time_ns;
+	uint64_t nominal;
+	uint64_t bytes_in, bytes_out;
+	//	Decoder state, preserved across read() chunks
+	uint8_t active, have_byte, byte, shift;
+	uint64_t acc;
+	size_t len;
+} capture_state_t;
+
+//	Port states
+typedef enum {
+	PORT_IDLE = 0,
+	PORT_OPENING,
+	PORT_READY,
+	PORT_CLOSED
+} port_state_t;
+
+//	Command line options
+typedef struct {
+	uint8_t opt_p, opt_o, opt_w, opt_x, opt_c, opt_d, opt_z,
+			opt_t, opt_n, opt_s, opt_a, opt_m, opt_h, opt_b, opt_e,
+			opt_f, opt_F, opt_r, opt_C, opt_T, opt_V, opt_M, opt_g,
+			opt_E, opt_L, opt_B, opt_I, opt_Q, opt_D, opt_l, opt_A, opt_O, opt_P,
+			opt_G, opt_J, opt_K, opt_H, opt_N, opt_U;
+	char *val_p, *val_o, *val_e, *val_f, *val_r, *val_C, *val_M, *val_E, *val_Q, *val_A_capture,
+		*val_O, *val_J, *val_N_demux, *val_U_snap;
+	double val_A_z[ANOMALY_DETECTORS];
+	char **val_files;
+	int nfiles;
+	uint32_t val_D_hz;
+	uint8_t val_D_width, val_D_len;
+	uint8_t val_D_prefix[KMP_MAX_LENGTH];
+	char *val_ports[MAX_PORTS];
+	char *val_milestones[BOOT_MAX_MILESTONES];
+	uint8_t nports, nmilestones;
+	uint8_t val_w, val_l, val_P, val_J_syslog, val_g_default;
+	uint8_t val_G_fields[PLOT_MAX_SERIES], nplot, val_G_fps;
+	uint8_t val_K, val_H, val_H_high, val_H_low;
+	uint8_t val_N_show[RS485_ADDRESSES / 8];
+	uint8_t val_U_on[KMP_MAX_LENGTH], val_U_on_len, val_U_idle;
+	uint16_t val_U_cols, val_U_rows;
+	uint32_t val_b, val_rate, val_g, val_K_window;
+} cmd_options_t;
+
+//	Event timer, fired from the main loop once its deadline (clock_mono_ns()) has passed
+//	Firing may be deferred by up to 'slack' so that nearby timers share one wakeup
+typedef struct {
+	int64_t deadline, slack;
+	void (*fire)(void *, cmd_options_t *);
+	void *arg;
+} ev_timer_t;
+
+//	EWMA mean and variance of one detector's observations, 'out' while outside its bounds
+typedef struct {
+	double mean, var, z;
+	uint64_t n, alerts;
+	uint8_t out;
+} ewma_detector_t;
+
+//	Per-port anomaly detectors, the rate and error detectors observe fixed windows
+//	With 'capture=', the last ANOMALY_RING_SIZE bytes are kept for writing out on an alert
+typedef struct {
+	ewma_detector_t det[ANOMALY_DETECTORS];
+	int64_t last_t, win_end;
+	uint64_t win_bytes, errors;
+	uint8_t alerted;
+	int port;
+	uint8_t *ring;
+	uint64_t ring_len;
+	uint32_t captures;
+	ev_timer_t timer;
+} anomaly_t;
+
+//	Per-port plot, a ring of columns with the minimum and maximum of each series per time slice
+//	series[] maps a field of a line to its series, or -1. Number parsing state is kept across chunks
+//	last_col is the column of the latest sample, the frame timer runs while it is on screen
+typedef struct {
+	int8_t series[PLOT_MAX_FIELDS];
+	uint8_t fields[PLOT_MAX_SERIES], nseries;
+	uint8_t in_num, neg, frac, exp, exp_neg, digits;
+	uint64_t mant;
+	int ndig, exp10, exp_val, field;
+	int top, height, width;
+	int64_t col_ns, cur, last_col;
+	ev_timer_t *frame;
+	uint64_t lines, values;
+	float last[PLOT_MAX_SERIES];
+	float lo[PLOT_MAX_WIDTH][PLOT_MAX_SERIES], hi[PLOT_MAX_WIDTH][PLOT_MAX_SERIES];
+} plot_t;
+
+//	Screen cell, the character (a code point) and its colors and attributes
+typedef struct {
+	uint32_t ch;
+	uint8_t fg, bg, attr, pad;
+} vt_cell_t;
+
+//	Per-port emulated screen, with the parser state preserved across read() chunks
+//	Damage is kept as one dmin..dmax column span per row (clean when dmin > dmax), 'shown' holds
+//	the cells as last drawn. Both cell arrays follow the structure in the arena
+typedef struct {
+	uint8_t state, ninter, nparams, u8need;
+	uint8_t inter[4];
+	uint16_t params[VT_MAX_PARAMS];
+	uint32_t u8cp, last_ch;
+	int cols, rows, top;
+	int x, y, stop, sbot, save_x, save_y;
+	uint8_t wrap, autowrap, origin, cursor_on, save_origin;
+	uint8_t g[2], gl, save_g[2], save_gl;
+	vt_cell_t pen, save_pen;
+	int cur_x, cur_y;
+	uint8_t cur_on, titled, pending, changed;
+	kmp_pattern_t trigger;
+	int trig_pos;
+	FILE *snap;
+	ev_timer_t *frame;
+	int64_t changed_ns;
+	uint64_t bytes, sequences, frames, cells_drawn, damage;
+	uint32_t snapshots;
+	uint16_t dmin[VT_MAX_ROWS], dmax[VT_MAX_ROWS];
+	uint8_t tabs[VT_MAX_COLS];
+	vt_cell_t *cells, *shown;
+} vt_screen_t;
+
+//	Multi-port log writer, shared by all ports
+//	index holds [ first record offset, port mask ] per LOG_SEGMENT_SIZE segment of the file
+typedef struct {
+	int fd;
+	const char *path;
+	uint8_t *buf;
+	size_t len;
+	uint64_t base;
+	int64_t t0;
+	uint64_t *index;
+	size_t cap;
+	uint32_t nsegs;
+	uint8_t noindex, failed;
+	uint64_t records, bytes, writes;
+	ev_timer_t timer;
+} log_writer_t;
+
+//	Multi-port log reader, record parsing state is preserved across read() chunks
+typedef struct {
+	uint8_t port, rport;
+	uint8_t header[LOG_RECORD_HEADER];
+	int hlen;
+	uint32_t rlen, got;
+	int64_t rtime, start_ns;
+	uint64_t pos, end, seg_size, seg_checked, skipped;
+	uint64_t *index;
+	uint32_t nsegs;
+} log_reader_t;
+
+//	Per-port line being framed for the '-J' sink, timed by its first byte (realtime ns)
+typedef struct {
+	char prefix[JOURNAL_PREFIX_MAX];
+	int prefix_len;
+	char line[JOURNAL_LINE_MAX];
+	int len;
+	uint8_t open;
+	int64_t t;
+	uint64_t lines, dropped;
+} journal_port_t;
+
+//	Journal or syslog sink shared by all ports, a ring of queued messages sent in batches
+//	Each message is sent as its head (arrival time), the port's constant prefix and its body
+//	Replays wait for the daemon when its queue is full, live ports drop lines instead
+typedef struct {
+	int fd;
+	const char *path;
+	uint8_t syslog, failed, blocked, retried, wait;
+	struct sockaddr_un addr;
+	int64_t real_offset;
+	journal_port_t *ports;
+	char msg[JOURNAL_QUEUE][JOURNAL_MSG_MAX];
+	int head[JOURNAL_QUEUE], len[JOURNAL_QUEUE];
+	uint8_t port[JOURNAL_QUEUE];
+	int first, n;
+	uint64_t sent, calls;
+	ev_timer_t timer;
+} journal_t;
+
+//	Unit (content-defined chunk or line) of one link, fingerprinted and timed by its last byte
+typedef struct {
+	uint64_t fp;
+	int64_t t;
+	uint32_t len;
+} compare_unit_t;
+
+//	One link of a '-K' comparison, with the unit being cut and the units not yet seen on the
+//	other link, a ring of at most COMPARE_PENDING
+typedef struct {
+	compare_unit_t pending[COMPARE_PENDING];
+	int first, n;
+	uint64_t h, fp;
+	uint32_t len;
+	uint64_t units, unmatched, unmatched_bytes, losses;
+} compare_side_t;
+
+//	Comparison of two redundant links, units of one are matched against the pending units of
+//	the other, and the latency of a match is the time on B less the time on A
+typedef struct {
+	compare_side_t side[2];
+	const char *path[2];
+	out_buffer_t *out[2];
+	uint64_t matched, divergences, reported;
+	int64_t lat_min, lat_max, lat_last;
+	double lat_mean;
+	ev_timer_t timer;
+} compare_t;
+
+//	Flow control state of a port, throttled from the '-H' high watermark until the low one
+typedef struct {
+	uint8_t throttled, failed, peak;
+	uint32_t throttles;
+	int64_t since, ns;
+} flow_state_t;
+
+//	Block of the arena, with this header at its start (within ARENA_HEADER bytes)
+typedef struct arena_block {
+	struct arena_block *next;
+	size_t size, used;
+	uint8_t kind;
+} arena_block_t;
+
+//	Arena for the large buffers which live as long as the session (port contexts, rings, filters,
+//	plots), so they share a few prefaulted blocks of huge pages instead of many small mappings
+typedef struct {
+	arena_block_t *head;
+	size_t mapped, huge;
+	uint32_t blocks;
+} arena_t;
+
+//	Application context structure type, one per port
 typedef struct {
 	FILE *fd;
 	int tty;
+	const char *path;
+	uint8_t state, locked;
+	int config_rc;
+	int64_t config_ns;
+	uint8_t ascii_last, ascii_count;
 	struct timespec ts;
+	uint64_t offset;
+	size_t rx_size;
+	fmt_program_t *fmt;
+	export_state_t exp;
+	capture_state_t cap_out, cap_in;
+	re_match_t *re;
+	boot_profile_t *boot;
+	ngram_index_t *index;
+	clock_est_t *clock;
+	lin_decoder_t *lin;
+	rs485_decoder_t *rs485;
+	vt_screen_t *vt;
+	anomaly_t *anomaly;
+	log_writer_t *log;
+	log_reader_t *log_in;
+	int log_port;
+	plot_t *plot;
+	journal_t *journal;
+	int journal_port;
+	compare_t *compare;
+	int compare_side;
+	flow_state_t flow;
+	ev_timer_t idle;
+	out_buffer_t out;
 } app_context_t;
 
-//	Command line options
+#if FEATURE_THREADS
+//	Thread pool opening and configuring ports concurrently
 typedef struct {
-	uint8_t opt_p, opt_o, opt_w, opt_x, opt_c, opt_d, opt_z,
-			opt_t, opt_n, opt_s, opt_a, opt_m, opt_h, opt_b;
-	char *val_p, *val_o;
-	uint8_t val_w;
-	uint32_t val_b;
-} cmd_options_t;
+	pthread_mutex_t lock;
+	pthread_t threads[OPEN_POOL_THREADS];
+	cmd_options_t *opt;
+	int nthreads, next;
+} open_pool_t;
+#endif	/* FEATURE_THREADS */
+
+//	All ports and the state shared between them
+typedef struct {
+	app_context_t *ports;
+	int nports, pending;
+	int notify[2];
+	struct timespec start;
+	control_t ctl;
+	ev_timer_t *timers[MAX_TIMERS];
+	int ntimers;
+	uint64_t wakeups, timer_wakeups;
+	log_writer_t *log;
+	journal_t *journal;
+	compare_t *compare;
+	ev_timer_t frame, flow;
+	uint8_t drawing;
+	arena_t arena;
+	long faults;
+#if FEATURE_THREADS
+	open_pool_t pool;
+#endif	/* FEATURE_THREADS */
+} session_t;
+
+//	Clock driven by a timestamped replay, 'now' is the recorded time (ns) of the latest chunk
+typedef struct {
+	uint8_t active;
+	int64_t now;
+	session_t *ses;
+	cmd_options_t *opt;
+} virtual_clock_t;
 
 void print_usage(void) {
 	printf(
 		"Usage:\n"
-		"-p  Device path            (required, example: /dev/cu.usbserial*)\n"
+		"-p  Device path            (required unless -r, repeat for up to %d ports, example: /dev/cu.usbserial*)\n"
+		"-r  Replay filename        (optional, read a raw capture file instead of a device)\n"
 		"-b  Baud rate              (optional, default: %d)\n"
 		"-o  Output filename        (optional, binary output file path)\n"
+		"-T  Timestamped capture    (optional, per-byte arrival times in '-o' output file)\n"
 		"-w  Column width           (optional, %d-%d, default: %d bytes)\n"
 		"-x  Single line output     (optional, default: off)\n"
 		"-c  Color output           (optional, default: on)\n"
@@ -138,11 +975,42 @@ void print_usage(void) {
 		"-s  Show time delta (sec)  (optional, default: off)\n"
 		"-a  ASCII output format\n"
 		"-m  MIDI output format\n"
+		"-e  Format string          (optional, hexdump-style, example: '16/1 \"%%02x \" \"\\n\"')\n"
+		"-f  Export encoding        (optional, cstr, carray, base64 or hex)\n"
+		"-F  Export per frame       (optional, one export line per received chunk)\n"
+		"-E  Regex                  (optional, highlight matches in '-a' output, example: 'ERR[0-9]+')\n"
+		"-L  Matching lines only    (optional, with '-E', only show lines containing a match)\n"
+		"-C  Control FIFO path      (optional, runtime mode/width/timestamp/baud commands)\n"
+		"-V  Footprint report       (optional, peak RSS and buffer sizes on exit)\n"
+		"-M  Metrics filename       (optional, Prometheus textfile written at startup and exit)\n"
+		"-g  Idle gap (ms)          (optional, %d-%d, end the output line when a port is idle)\n"
+		"-B  Boot milestone         (optional, repeat in boot order for up to %d, example: 'Starting kernel')\n"
+		"-I  Index captures         (optional, with '-o' write '<file>.idx' on close, or index the files given)\n"
+		"-Q  Query captures         (optional, list the files given which contain a byte sequence)\n"
+		"-D  Device clock field     (optional, '<hz>[/<bytes>]:<prefix>', fit drift and latency, example: '1000:T=')\n"
+		"-l  LIN checksum model     (optional, classic, enhanced or auto, decode LIN frames)\n"
+		"-A  Anomaly detection      (optional, '<z>' or 'gap|rate|errors=<z>[,capture=<prefix>]', example: '4,capture=anomaly')\n"
+		"-O  Log filename           (optional, one append-only log of all ports, with a per-port index)\n"
+		"-P  Log port               (optional, with '-r', the port to replay from a '-O' log, default: 0)\n"
+		"-G  Plot fields            (optional, 'all' or 1-based fields of numeric lines, '@<fps>', example: '1,3@25')\n"
+		"-J  Forward lines          (optional, 'journal' or 'syslog', ':<socket>', send received text lines to the log daemon)\n"
+		"-K  Compare links          (optional, 'chunks' or 'lines', ',<window ms>', with two '-p' ports, example: 'lines,500')\n"
+		"-H  Flow control           (optional, 'rtscts' or 'xonxoff', ',<high>%%,<low>%%', throttle the sender while behind, default: %d,%d)\n"
+		"-N  RS-485 addresses       (optional, 'all' or addresses to show, ',demux=<prefix>', decode 9-bit address bytes, example: '0x10,0x11')\n"
+		"-U  Screen emulation       (optional, '<cols>x<rows>', ',snap=<file>', ',on=<string>', ',idle', VT100 screen, default: %dx%d)\n"
 		"-h  Show command help\n",
+		MAX_PORTS,
 		DEF_BAUD_RATE,
 		MIN_COLUMN_WIDTH,
 		MAX_COLUMN_WIDTH,
-		DEF_COLUMN_WIDTH
+		DEF_COLUMN_WIDTH,
+		1,
+		MAX_IDLE_GAP_MS,
+		BOOT_MAX_MILESTONES,
+		FLOW_DEF_HIGH,
+		FLOW_DEF_LOW,
+		VT_DEF_COLS,
+		VT_DEF_ROWS
 	);
 }
 
@@ -161,7 +1029,32 @@ void print_options(cmd_options_t *opt) {
 		"-n: %d\n"
 		"-s: %d\n"
 		"-a: %d\n"
-		"-m: %d\n",
+		"-m: %d\n"
+		"-e: %d, %s\n"
+		"-f: %d, %s\n"
+		"-F: %d\n"
+		"-E: %d, %s\n"
+		"-L: %d\n"
+		"-r: %d, %s\n"
+		"-C: %d, %s\n"
+		"-T: %d\n"
+		"-V: %d\n"
+		"-M: %d, %s\n"
+		"-g: %d, %u\n"
+		"-B: %d, %d\n"
+		"-I: %d\n"
+		"-Q: %d, %s\n"
+		"-D: %d, %u/%d\n"
+		"-l: %d, %d\n"
+		"-A: %d, %s\n"
+		"-O: %d, %s\n"
+		"-P: %d, %d\n"
+		"-G: %d, %d@%d\n"
+		"-J: %d, %s\n"
+		"-K: %d, %d/%u\n"
+		"-H: %d, %d %d/%d\n"
+		"-N: %d, %s\n"
+		"-U: %d, %ux%u %s\n",
 		opt->opt_p, (opt->opt_p) ? opt->val_p : "(null)",
 		opt->opt_b, opt->val_b,
 		opt->opt_o, (opt->opt_o) ? opt->val_o : "(null)",
@@ -174,19 +1067,98 @@ void print_options(cmd_options_t *opt) {
 		opt->opt_n,
 		opt->opt_s,
 		opt->opt_a,
-		opt->opt_m
+		opt->opt_m,
+		opt->opt_e, (opt->opt_e) ? opt->val_e : "(null)",
+		opt->opt_f, (opt->opt_f) ? opt->val_f : "(null)",
+		opt->opt_F,
+		opt->opt_E, (opt->opt_E) ? opt->val_E : "(null)",
+		opt->opt_L,
+		opt->opt_r, (opt->opt_r) ? opt->val_r : "(null)",
+		opt->opt_C, (opt->opt_C) ? opt->val_C : "(null)",
+		opt->opt_T,
+		opt->opt_V,
+		opt->opt_M, (opt->opt_M) ? opt->val_M : "(null)",
+		opt->opt_g, opt->val_g,
+		opt->opt_B, opt->nmilestones,
+		opt->opt_I,
+		opt->opt_Q, (opt->opt_Q) ? opt->val_Q : "(null)",
+		opt->opt_D, opt->val_D_hz, opt->val_D_width,
+		opt->opt_l, opt->val_l,
+		opt->opt_A, (opt->val_A_capture) ? opt->val_A_capture : "(null)",
+		opt->opt_O, (opt->opt_O) ? opt->val_O : "(null)",
+		opt->opt_P, opt->val_P,
+		opt->opt_G, opt->nplot, opt->val_G_fps,
+		opt->opt_J, (opt->val_J) ? opt->val_J : "",
+		opt->opt_K, opt->val_K, opt->val_K_window,
+		opt->opt_H, opt->val_H, opt->val_H_high, opt->val_H_low,
+		opt->opt_N, (opt->val_N_demux) ? opt->val_N_demux : "(null)",
+		opt->opt_U, opt->val_U_cols, opt->val_U_rows, (opt->val_U_snap) ? opt->val_U_snap : "(null)"
 	);
 }
 
-void print_timestamp(app_context_t *app, cmd_options_t *opt) {
+//	Write buffered terminal output to stderr
+void out_flush(out_buffer_t *out) {
+	if (out->len) {
+		fwrite(out->data, sizeof(char), out->len, stderr);
+		out->len = 0;
+	}
+}
+
+//	Append bytes to the terminal output buffer, flushing as it fills
+void out_write(out_buffer_t *out, const char *s, size_t len) {
+	size_t n;
+	while (len) {
+		if (out->len == OUT_BUFFER_SIZE) {
+			out_flush(out);
+		}
+		n = OUT_BUFFER_SIZE - out->len;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(out->data + out->len, s, n);
+		out->len += n;
+		s += n;
+		len -= n;
+	}
+}
+
+//	Virtual clock of a timestamped replay, which follows the recorded arrival times (ns) so that
+//	timers, timestamps and timing features see the times they saw live, however fast it is read
+static virtual_clock_t vclock;
+
+//	Read the monotonic clock in nanoseconds, or the virtual clock during a timestamped replay
+int64_t clock_mono_ns(void) {
+	struct timespec ts;
+	if (vclock.active) {
+		return vclock.now;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * NANOSECONDS_PER_SECOND + ts.tv_nsec;
+}
+
+//	Read the realtime clock, or the virtual clock during a timestamped replay
+//	Captures record realtime arrival times, so both clocks read the same virtual time
+void clock_real(struct timespec *ts) {
+	if (vclock.active) {
+		ts->tv_sec = vclock.now / NANOSECONDS_PER_SECOND;
+		ts->tv_nsec = vclock.now % NANOSECONDS_PER_SECOND;
+	} else {
+		clock_gettime(CLOCK_REALTIME, ts);
+	}
+}
+
+//	Format the timestamp and/or time differences selected by options, returns the length
+int format_timestamp(app_context_t *app, cmd_options_t *opt, char *buf, size_t size) {
 	//	Read the current system time
 	struct timespec ts, td;
-	clock_gettime(CLOCK_REALTIME, &ts);
-	//	Print the current timestamp
+	int len = 0;
+	clock_real(&ts);
+	buf[0] = '\0';
+	//	Format the current timestamp
 	if (opt->opt_t) {
-		fprintf(stderr, "%ld: ", ts.tv_sec * NANOSECONDS_PER_SECOND + ts.tv_nsec);
+		len += snprintf(buf + len, size - len, "%ld: ", ts.tv_sec * NANOSECONDS_PER_SECOND + ts.tv_nsec);
 	}
-	//	Print the time in seconds difference since the last timestamp
+	//	Format the time in seconds difference since the last timestamp
 	if (opt->opt_n || opt->opt_s) {
 		if (app->ts.tv_sec == 0 && app->ts.tv_nsec == 0) {
 			app->ts.tv_sec = ts.tv_sec;
@@ -194,15 +1166,22 @@ void print_timestamp(app_context_t *app, cmd_options_t *opt) {
 		}
 		timespec_sub(&app->ts, &ts, &td);
 		if (opt->opt_n) {
-			fprintf(stderr, "+%012ld: ", td.tv_sec * NANOSECONDS_PER_SECOND + td.tv_nsec);
+			len += snprintf(buf + len, size - len, "+%012ld: ", td.tv_sec * NANOSECONDS_PER_SECOND + td.tv_nsec);
 		}
 		if (opt->opt_s) {
-			fprintf(stderr, "%.6f: ", timespec_dec(&td));
+			len += snprintf(buf + len, size - len, "%.6f: ", timespec_dec(&td));
 		}
 	}
 	//	Store the current timestamp back to the application context
 	app->ts.tv_sec = ts.tv_sec;
 	app->ts.tv_nsec = ts.tv_nsec;
+	return len;
+}
+
+void print_timestamp(app_context_t *app, cmd_options_t *opt) {
+	char buf[OUT_BUFFER_RESERVE];
+	format_timestamp(app, opt, buf, sizeof(buf));
+	fputs(buf, stderr);
 }
 
 void print_byte_midi(uint8_t *p, app_context_t *app, cmd_options_t *opt) {
@@ -272,71 +1251,69 @@ void print_byte_midi(uint8_t *p, app_context_t *app, cmd_options_t *opt) {
 	}
 }
 
+//	Append a timestamp and/or time difference to the terminal output buffer
+void out_timestamp(app_context_t *app, cmd_options_t *opt) {
+	out_buffer_t *out = &app->out;
+	if (out->len + OUT_BUFFER_RESERVE > OUT_BUFFER_SIZE) {
+		out_flush(out);
+	}
+	out->len += format_timestamp(app, opt, out->data + out->len, OUT_BUFFER_RESERVE);
+}
+
+//	Start a new line or clear the screen, followed by a timestamp if enabled
+void out_line_start(app_context_t *app, cmd_options_t *opt) {
+	if (opt->opt_x) {
+		out_write(&app->out, ESC_CLEAR_OUTPUT, sizeof(ESC_CLEAR_OUTPUT) - 1);
+	} else {
+		out_write(&app->out, "\n", 1);
+	}
+	if (opt->opt_t || opt->opt_n || opt->opt_s) {
+		out_timestamp(app, opt);
+	}
+}
+
+//	Render one byte of ASCII output into the terminal output buffer
 void print_byte_ascii(uint8_t *p, app_context_t *app, cmd_options_t *opt) {
-	static uint8_t last_char = 0;
-	static uint8_t byte_count = 0;
+	out_buffer_t *out = &app->out;
+	uint8_t last_char = app->ascii_last;
+	uint8_t byte_count = app->ascii_count;
 	
 	//	Clear screen after newline if single line mode is enabled
 	if (opt->opt_x && last_char == '\n') {
-		fprintf(stderr, ESC_CLEAR_OUTPUT);
+		out_write(out, ESC_CLEAR_OUTPUT, sizeof(ESC_CLEAR_OUTPUT) - 1);
 	}
 	
 	//	Print a timestamp and/or time difference if either option is enabled
 	if ((opt->opt_t || opt->opt_n || opt->opt_s) && (last_char == '\n' || last_char == 0)) {
-		print_timestamp(app, opt);
+		out_timestamp(app, opt);
 	}
 	
 	//	If printable, print character, otherwise print escaped
 	if ((isprint(*p) || iscntrl(*p)) && *p != '\\') {
 		//	If last character was non-printable, start a new line or clear the screen
 		if ((!isprint(last_char) && !iscntrl(last_char)) || last_char == '\\') {
-			if (opt->opt_x) {
-				fprintf(stderr, ESC_CLEAR_OUTPUT);
-			} else {
-				fprintf(stderr, "\n");
-			}
-			//	Print a timestamp and/or time difference if option is selected
-			if (opt->opt_t || opt->opt_n || opt->opt_s) {
-				print_timestamp(app, opt);
-			}
+			out_line_start(app, opt);
 		}
 		//	Print the printable character
-		fprintf(stderr, "%c", *p);
+		if (out->len == OUT_BUFFER_SIZE) {
+			out_flush(out);
+		}
+		out->data[out->len++] = *p;
 		//	Reset non-printable byte count if we get a printable character
 		byte_count = 0;
 	} else {
 		//	Print newline or clear screen at the start of a non-printable character sequence
 		if (byte_count == 0) {
-			if (opt->opt_x) {
-				fprintf(stderr, ESC_CLEAR_OUTPUT);
-			} else {
-				fprintf(stderr, "\n");
-			}
-			//	Print a timestamp and/or time difference if option is selected
-			if (opt->opt_t || opt->opt_n || opt->opt_s) {
-				print_timestamp(app, opt);
-			}
+			out_line_start(app, opt);
 		}
-		//	Print non-printable byte based on options
-		if (opt->opt_c) {
-			//	Color output
-			if (opt->opt_d) {
-				//	Color, decimal format
-				fprintf(stderr,"%s\\%03d%s", ESC_COLOR_GREEN, *p, ESC_COLOR_RESET);
-			} else {
-				//	Color, hexadecimal format
-				fprintf(stderr,"%s\\x%02x%s", ESC_COLOR_GREEN, *p, ESC_COLOR_RESET);
-			}
-		} else {
-			//	Non-color output
-			if (opt->opt_d) {
-				//	Decimal format
-				fprintf(stderr, "\\%03d", *p);
-			} else {
-				//	Hexadecimal format
-				fprintf(stderr, "\\x%02x", *p);
-			}
+		//	Print non-printable byte based on options (color, decimal or hexadecimal)
+		if (out->len + OUT_BUFFER_RESERVE > OUT_BUFFER_SIZE) {
+			out_flush(out);
 		}
+		out->len += snprintf(out->data + out->len, OUT_BUFFER_RESERVE,
+			(opt->opt_d) ? "%s\\%03d%s" : "%s\\x%02x%s",
+			(opt->opt_c) ? ESC_COLOR_GREEN : "", *p,
+			(opt->opt_c) ? ESC_COLOR_RESET : "");
 		
 		//	Increment byte count for non-printable characters
 		byte_count++;
@@ -345,303 +1322,8243 @@ void print_byte_ascii(uint8_t *p, app_context_t *app, cmd_options_t *opt) {
 		}
 	}
 	
-	//	Save character for comparison next function call
-	last_char = *p;
+	//	Save character and count for comparison next function call
+	app->ascii_last = *p;
+	app->ascii_count = byte_count;
 }
 
-void print_byte_raw(uint8_t *p, app_context_t *app, cmd_options_t *opt) {
-	static uint8_t byte_count = 0;
-	
-	//	Determine if this is a new line
-	if (byte_count == 0) {
-		//	If so, start a new line or clear output
-		if (opt->opt_x) {
-			fprintf(stderr, ESC_CLEAR_OUTPUT);
-		} else {
-			fprintf(stderr, "\n");
+//	Characters printed as-is which never start a new line (everything but escapes and newlines)
+uint8_t ascii_plain[256];
+
+void ascii_plain_init(void) {
+	int c;
+	for (c = 0; c < 256; c++) {
+		ascii_plain[c] = (isprint(c) || iscntrl(c)) && c != '\\' && c != '\n';
+	}
+}
+
+//	Render a run of ASCII output, copying plain characters which follow a plain character in bulk
+void print_ascii_run(uint8_t *buf, size_t len, app_context_t *app, cmd_options_t *opt) {
+	size_t i = 0, j;
+	while (i < len) {
+		print_byte_ascii(&buf[i++], app, opt);
+		if (!ascii_plain[app->ascii_last]) {
+			continue;
 		}
-		//	Print a timestamp and/or time difference if option is selected
-		if (opt->opt_t || opt->opt_n || opt->opt_s) {
-			print_timestamp(app, opt);
+		for (j = i; j < len && ascii_plain[buf[j]]; j++);
+		if (j > i) {
+			out_write(&app->out, (const char *)buf + i, j - i);
+			app->ascii_last = buf[j - 1];
+			i = j;
 		}
 	}
+}
+
+//	Return the first option which needs a feature excluded from this build
+char feature_missing(cmd_options_t *opt) {
+	if (!FEATURE_EXPORT && (opt->opt_f || opt->opt_F)) return 'f';
+	if (!FEATURE_CONTROL && opt->opt_C) return 'C';
+	if (!FEATURE_CAPTURE && opt->opt_T) return 'T';
+	if (!FEATURE_METRICS && opt->opt_M) return 'M';
+	if (!FEATURE_REGEX && (opt->opt_E || opt->opt_L)) return 'E';
+	if (!FEATURE_BOOT && opt->opt_B) return 'B';
+	if (!FEATURE_INDEX && (opt->opt_I || opt->opt_Q)) return (opt->opt_Q) ? 'Q' : 'I';
+	if (!FEATURE_CLOCK && opt->opt_D) return 'D';
+	if (!FEATURE_LIN && opt->opt_l) return 'l';
+	if (!FEATURE_ANOMALY && opt->opt_A) return 'A';
+	if (!FEATURE_LOG && (opt->opt_O || opt->opt_P)) return (opt->opt_O) ? 'O' : 'P';
+	if (!FEATURE_PLOT && opt->opt_G) return 'G';
+	if (!FEATURE_JOURNAL && opt->opt_J) return 'J';
+	if (!FEATURE_COMPARE && opt->opt_K) return 'K';
+	if (!FEATURE_FLOW && opt->opt_H) return 'H';
+	if (!FEATURE_RS485 && opt->opt_N) return 'N';
+	if (!FEATURE_VT && opt->opt_U) return 'U';
+	return 0;
+}
+
+//	Size tty reads from the baud rate, to cover RX_READ_INTERVAL_MS of input
+size_t rx_read_size(uint32_t rate) {
+	size_t size = (size_t)rate / CAPTURE_BITS_PER_CHAR * RX_READ_INTERVAL_MS / 1000;
+	if (size < RX_BUFFER_SIZE - 1) {
+		size = RX_BUFFER_SIZE - 1;
+	}
+	if (size > RX_BUFFER_MAX) {
+		size = RX_BUFFER_MAX;
+	}
+	return size;
+}
+
+#if FEATURE_HUGEPAGES
+//	Back every page of a block before the hot path touches it
+void arena_prefault(uint8_t *p, size_t size) {
+	size_t step = (size_t)sysconf(_SC_PAGESIZE), i;
+#ifdef MADV_POPULATE_WRITE
+	if (!madvise(p, size, MADV_POPULATE_WRITE)) {
+		return;
+	}
+#endif	/* MADV_POPULATE_WRITE */
+	for (i = 0; i < size; i += step) {
+		((volatile uint8_t *)p)[i] = 0;
+	}
+}
+
+//	Blocks of a huge page or more come from the hugetlb pool, else from transparent huge pages
+//	(aligned, so the kernel can use them), smaller ones and fallbacks from base pages
+arena_block_t *arena_map(size_t size) {
+	size_t page = (size_t)sysconf(_SC_PAGESIZE), len = 0;
+	uint8_t *p = MAP_FAILED, *aligned;
+	uint8_t kind = ARENA_PAGES;
+	arena_block_t *b;
 	
-	//	Print byte to terminal based on format options
-	if (opt->opt_z) {
-		//	Right aligned, zero prefixed
-		if (opt->opt_d) {
-			//	Decimal, right aligned, zero prefixed
-			fprintf(stderr, "%03d ", *p);
-		} else {
-			//	Hexadecimal, right aligned, zero prefixed
-			fprintf(stderr, "%02x ", *p);
+	if (size >= ARENA_HUGE_PAGE) {
+		len = (size + ARENA_HUGE_PAGE - 1) & ~(size_t)(ARENA_HUGE_PAGE - 1);
+#ifdef MAP_HUGETLB
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		kind = ARENA_HUGETLB;
+#endif	/* MAP_HUGETLB */
+#ifdef MADV_HUGEPAGE
+		if (p == MAP_FAILED) {
+			p = mmap(NULL, len + ARENA_HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (p != MAP_FAILED) {
+				aligned = (uint8_t *)(((uintptr_t)p + ARENA_HUGE_PAGE - 1) & ~(uintptr_t)(ARENA_HUGE_PAGE - 1));
+				if (aligned > p) {
+					munmap(p, aligned - p);
+				}
+				munmap(aligned + len, p + ARENA_HUGE_PAGE - aligned);
+				p = aligned;
+				kind = (madvise(p, len, MADV_HUGEPAGE)) ? ARENA_PAGES : ARENA_THP;
+			}
 		}
-	} else {
-		//	Right aligned
-		if (opt->opt_d) {
-			//	Decimal, right aligned
-			fprintf(stderr, "%3d ", *p);
-		} else {
-			//	Hexadecimal, right aligned
-			fprintf(stderr, "%2x ", *p);
+#endif	/* MADV_HUGEPAGE */
+	}
+	if (p == MAP_FAILED) {
+		len = (size + page - 1) & ~(page - 1);
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		kind = ARENA_PAGES;
+		if (p == MAP_FAILED) {
+			return NULL;
 		}
 	}
+	arena_prefault(p, len);
+	b = (arena_block_t *)p;
+	b->size = len;
+	b->kind = kind;
+	return b;
+}
+
+void arena_unmap(arena_block_t *b) {
+	munmap(b, b->size);
+}
+
+#else
+
+//	Huge pages excluded from this build, blocks come from the heap
+arena_block_t *arena_map(size_t size) {
+	arena_block_t *b = calloc(1, size);
+	if (b) {
+		b->size = size;
+		b->kind = ARENA_HEAP;
+	}
+	return b;
+}
+
+void arena_unmap(arena_block_t *b) {
+	free(b);
+}
+
+#endif	/* FEATURE_HUGEPAGES */
+
+//	Add a newly mapped block, which further allocations are carved from
+void arena_link(arena_t *a, arena_block_t *b) {
+	b->used = ARENA_HEADER;
+	b->next = a->head;
+	a->head = b;
+	a->blocks++;
+	a->mapped += b->size;
+	if (b->kind == ARENA_HUGETLB || b->kind == ARENA_THP) {
+		a->huge += b->size;
+	}
+}
+
+//	Map the first block up front, for the buffers the session is about to allocate
+int arena_reserve(arena_t *a, size_t size) {
+	arena_block_t *b = arena_map(ARENA_HEADER + size);
+	if (!b) {
+		return -1;
+	}
+	arena_link(a, b);
+	return 0;
+}
+
+//	Allocate zeroed memory from the arena, for buffers which live as long as the session
+//	Allocations which do not fit in the current block get a new one
+void *arena_alloc(arena_t *a, size_t size, size_t align) {
+	arena_block_t *b = a->head;
+	uintptr_t at;
 	
-	//	Increment byte count and reset if count = column width
-	byte_count++;
-	if (byte_count >= opt->val_w) {
-		byte_count = 0;
+	if (b) {
+		at = ((uintptr_t)b + b->used + align - 1) & ~(uintptr_t)(align - 1);
+		if (at + size <= (uintptr_t)b + b->size) {
+			b->used = at + size - (uintptr_t)b;
+			return (void *)at;
+		}
 	}
+	if (!(b = arena_map(ARENA_HEADER + size + align))) {
+		return NULL;
+	}
+	arena_link(a, b);
+	return arena_alloc(a, size, align);
 }
 
-//	Configure options
-int config_opt(int argc, char **argv, app_context_t *app, cmd_options_t *opt) {
+//	Release every block at the end of the session
+void arena_free(arena_t *a) {
+	arena_block_t *b;
+	while ((b = a->head)) {
+		a->head = b->next;
+		arena_unmap(b);
+	}
+}
+
+//	Read the peak resident set size in KiB
+//	Linux keeps ru_maxrss across execve(), so the process' own high water mark is preferred
+long peak_rss_kib(void) {
+	struct rusage ru;
+	char line[128];
+	long rss = -1;
+	FILE *f = fopen("/proc/self/status", "r");
+	if (f) {
+		while (fgets(line, sizeof(line), f)) {
+			if (sscanf(line, "VmHWM: %ld kB", &rss) == 1) {
+				break;
+			}
+		}
+		fclose(f);
+	}
+	if (rss < 0) {
+		getrusage(RUSAGE_SELF, &ru);
+#if defined(__APPLE__)
+		rss = ru.ru_maxrss / 1024;
+#else
+		rss = ru.ru_maxrss;
+#endif	/* __APPLE__ */
+	}
+	return rss;
+}
+
+//	Read the anonymous memory backed by transparent huge pages in KiB, -1 where unknown
+long anon_huge_kib(void) {
+	char line[128];
+	long kib = -1;
+	FILE *f = fopen("/proc/self/smaps_rollup", "r");
+	if (f) {
+		while (fgets(line, sizeof(line), f)) {
+			if (sscanf(line, "AnonHugePages: %ld kB", &kib) == 1) {
+				break;
+			}
+		}
+		fclose(f);
+	}
+	return kib;
+}
+
+//	Minor page faults taken by the process so far
+long minor_faults(void) {
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_minflt;
+}
+
+//	Print peak memory use, buffer sizes and build features
+void print_footprint(session_t *ses) {
+	re_match_t *m;
+	fprintf(stderr, "\nFootprint: peak RSS %ld KiB, context %zu bytes x %d ports, read size %zu bytes, "
+		"output buffer %d bytes, replay buffer %d bytes\n"
+		"Features: export %d, control %d, capture %d, threads %d, metrics %d, regex %d, boot %d, index %d, clock %d, lin %d, anomaly %d, log %d, plot %d, journal %d, hugepages %d, compare %d, flow %d, rs485 %d, vt %d\n"
+		"Wakeups: %llu (%llu by timers)\n"
+		"Arena: %zu KiB in %u blocks, %zu KiB of huge pages (%ld KiB transparent in use), %ld page faults since startup\n",
+		peak_rss_kib(), sizeof(app_context_t), ses->nports,
+		(ses->nports) ? ses->ports[0].rx_size : 0, OUT_BUFFER_SIZE, REPLAY_BUFFER_SIZE,
+		FEATURE_EXPORT, FEATURE_CONTROL, FEATURE_CAPTURE, FEATURE_THREADS, FEATURE_METRICS, FEATURE_REGEX,
+		FEATURE_BOOT, FEATURE_INDEX, FEATURE_CLOCK, FEATURE_LIN, FEATURE_ANOMALY, FEATURE_LOG, FEATURE_PLOT, FEATURE_JOURNAL,
+		FEATURE_HUGEPAGES, FEATURE_COMPARE, FEATURE_FLOW, FEATURE_RS485, FEATURE_VT,
+		(unsigned long long)ses->wakeups, (unsigned long long)ses->timer_wakeups,
+		ses->arena.mapped / 1024, ses->arena.blocks, ses->arena.huge / 1024, anon_huge_kib(),
+		(ses->faults) ? minor_faults() - ses->faults : 0);
+	if (ses->nports && ses->ports[0].re) {
+		m = ses->ports[0].re;
+		fprintf(stderr, "Regex: %d byte classes, %d + %d + %d DFA states cached (max %d each), %u cache resets\n",
+			m->re->ncls, m->scan.nstates, m->extend.nstates, m->rev.nstates, REGEX_CACHE_STATES,
+			m->scan.resets + m->extend.resets + m->rev.resets);
+	}
+}
+
+//	Nominal time on the wire for one character (start + 8 data + stop bits)
+uint32_t char_time_ns(uint32_t rate) {
+	return (rate) ? (uint32_t)(CAPTURE_BITS_PER_CHAR * NANOSECONDS_PER_SECOND / rate) : 0;
+}
+
+//	Register a timer with the main loop, it stays disarmed until timer_arm()
+int timer_add(session_t *ses, ev_timer_t *t, void (*fire)(void *, cmd_options_t *), void *arg) {
+	if (ses->ntimers == MAX_TIMERS) {
+		return -1;
+	}
+	t->deadline = 0;
+	t->fire = fire;
+	t->arg = arg;
+	ses->timers[ses->ntimers++] = t;
+	return 0;
+}
+
+//	Arm or re-arm a timer, this only records the deadline
+void timer_arm(ev_timer_t *t, int64_t deadline, int64_t slack) {
+	t->deadline = deadline;
+	t->slack = slack;
+}
+
+void timer_cancel(ev_timer_t *t) {
+	t->deadline = 0;
+}
+
+//	poll() timeout in ms until the earliest latest-allowed expiry, or -1 with no timers armed
+//	Waking at the end of the earliest slack window lets every timer due by then fire together
+//	On the virtual clock, timers fire as a replay moves it, so poll() waits only for input
+int timer_timeout(session_t *ses) {
+	int64_t wake = INT64_MAX, now;
+	ev_timer_t *t;
 	int i;
 	
-	if (argc < 2) {
-		print_usage();
+	for (i = 0; i < ses->ntimers; i++) {
+		t = ses->timers[i];
+		if (t->deadline && t->deadline + t->slack < wake) {
+			wake = t->deadline + t->slack;
+		}
+	}
+	if (wake == INT64_MAX || vclock.active) {
 		return -1;
 	}
+	now = clock_mono_ns();
+	if (wake <= now) {
+		return 0;
+	}
+	wake = (wake - now + 999999) / 1000000;
+	return (wake > MAX_IDLE_GAP_MS) ? MAX_IDLE_GAP_MS : (int)wake;
+}
+
+//	Fire every timer whose deadline has passed
+void timer_run(session_t *ses, cmd_options_t *opt) {
+	int64_t now = clock_mono_ns();
+	ev_timer_t *t;
+	int i;
 	
-	//	Initialize data structures
-	memset((void*)app, 0, sizeof(app_context_t));
-	memset((void*)opt, 0, sizeof(cmd_options_t));
+	for (i = 0; i < ses->ntimers; i++) {
+		t = ses->timers[i];
+		if (t->deadline && t->deadline <= now) {
+			t->deadline = 0;
+			t->fire(t->arg, opt);
+		}
+	}
+}
+
+//	Drive the timers from a timestamped replay, starting at its recorded start time (ns)
+//	Timers armed before the replay started keep their remaining time on the virtual clock
+void clock_start(session_t *ses, cmd_options_t *opt, int64_t start) {
+	int64_t shift = start - clock_mono_ns();
+	int i;
 	
-	//	Parse command line options
-	while ((i = getopt(argc, argv, "xcdztnsamhp:b:o:w:")) != -1) {
-		switch (i) {
-			case 'x':
-				opt->opt_x = 1;
-				break;
-			case 'c':
-				opt->opt_c = 1;
-				break;
+	for (i = 0; i < ses->ntimers; i++) {
+		if (ses->timers[i]->deadline) {
+			ses->timers[i]->deadline += shift;
+		}
+	}
+	vclock.ses = ses;
+	vclock.opt = opt;
+	vclock.now = start;
+	vclock.active = 1;
+}
+
+//	Move the virtual clock forward to 't', firing the timers due by then in deadline order,
+//	each with the clock at its deadline, as they would have fired live between reads
+void clock_advance(int64_t t) {
+	ev_timer_t *next;
+	int i;
+	
+	if (!vclock.active) {
+		return;
+	}
+	while (1) {
+		next = NULL;
+		for (i = 0; i < vclock.ses->ntimers; i++) {
+			if (vclock.ses->timers[i]->deadline && vclock.ses->timers[i]->deadline <= t &&
+				(!next || vclock.ses->timers[i]->deadline < next->deadline)) {
+				next = vclock.ses->timers[i];
+			}
+		}
+		if (!next) {
+			break;
+		}
+		if (next->deadline > vclock.now) {
+			vclock.now = next->deadline;
+		}
+		next->deadline = 0;
+		next->fire(next->arg, vclock.opt);
+	}
+	if (t > vclock.now) {
+		vclock.now = t;
+	}
+}
+
+//	Prepare a pattern of up to KMP_MAX_LENGTH bytes for kmp_step(), 's' must outlive it
+void kmp_init(kmp_pattern_t *k, const uint8_t *s, size_t len) {
+	int i, n = 0;
+	k->s = s;
+	k->len = (uint8_t)len;
+	k->fail[0] = 0;
+	for (i = 1; i < k->len; i++) {
+		while (n && s[i] != s[n]) {
+			n = k->fail[n - 1];
+		}
+		n += (s[i] == s[n]);
+		k->fail[i] = (uint8_t)n;
+	}
+}
+
+//	Advance a match by one byte, returns the matched length (len on a complete match)
+static inline int kmp_step(const kmp_pattern_t *k, int pos, uint8_t c) {
+	if (pos && pos == k->len) {
+		pos = k->fail[pos - 1];
+	}
+	while (pos && k->s[pos] != c) {
+		pos = k->fail[pos - 1];
+	}
+	return pos + (k->s[pos] == c);
+}
+
+//	Arrival time (ns) of the first byte of a chunk and the time between its bytes
+//	read() only reports when the chunk arrived, so bytes are placed back at the character time;
+//	a timestamped replay has the recorded time of the chunk's last byte instead
+int64_t chunk_time(app_context_t *app, cmd_options_t *opt, int len, int64_t *step) {
+	if (app->cap_in.active) {
+		*step = app->cap_in.char_ns;
+		return app->cap_in.time_ns - (int64_t)(len - 1) * *step;
+	}
+	*step = char_time_ns(opt->val_rate);
+	return clock_mono_ns() - (int64_t)(len - 1) * *step;
+}
+
+//	Unescape one byte of a PARMRK stream, 'esc' is the escape state kept across read() chunks
+//	\377 \377 is a \377 data byte, \377 \0 <byte> a marked byte and \377 \0 \0 a BREAK;
+//	\377 before any other byte is not an escape and both are data, so up to 2 bytes go to 'out'
+int parmrk_unescape(uint8_t *esc, uint8_t c, uint8_t out[2], int *n) {
+	*n = 0;
+	if (*esc == 0) {
+		if (c == 0xff) {
+			*esc = 1;
+			return PARMRK_NONE;
+		}
+		out[(*n)++] = c;
+		return PARMRK_DATA;
+	}
+	if (*esc == 1) {
+		*esc = (c == 0) ? 2 : 0;
+		if (c == 0) {
+			return PARMRK_NONE;
+		}
+		out[(*n)++] = 0xff;
+		if (c != 0xff) {
+			out[(*n)++] = c;
+		}
+		return PARMRK_DATA;
+	}
+	*esc = 0;
+	out[(*n)++] = c;
+	return (c) ? PARMRK_MARK : PARMRK_BREAK;
+}
+
+//	Print a format string parsing error
+void fmt_error(const char *src, const char *at, const char *msg) {
+	fprintf(stderr, "%sError%s: Format string '-e': %s at offset %d\n",
+		ESC_COLOR_MAGENTA,
+		ESC_COLOR_RESET,
+		msg, (int)(at - src));
+}
+
+//	Decode a backslash escape inside a quoted format string
+const char *fmt_parse_escape(const char *s, char *c) {
+	switch (*s) {
+		case 'a':	*c = '\a'; break;
+		case 'b':	*c = '\b'; break;
+		case 'e':	*c = '\033'; break;
+		case 'f':	*c = '\f'; break;
+		case 'n':	*c = '\n'; break;
+		case 'r':	*c = '\r'; break;
+		case 't':	*c = '\t'; break;
+		case 'v':	*c = '\v'; break;
+		case '0':	*c = '\0'; break;
+		case '\0':	*c = '\\'; return s;
+		default:	*c = *s; break;
+	}
+	return s + 1;
+}
+
+//	Parse a byte sequence with '\xHH' and the format string escapes, returns its length
+//	or -1 if it is longer than 'max'
+int parse_bytes(const char *s, uint8_t *out, int max) {
+	char hex[3] = { 0 }, c;
+	int n = 0;
+	while (*s) {
+		if (n == max) {
+			return -1;
+		}
+		if (s[0] == '\\' && s[1] == 'x' && isxdigit((uint8_t)s[2]) && isxdigit((uint8_t)s[3])) {
+			memcpy(hex, s + 2, 2);
+			out[n++] = (uint8_t)strtol(hex, NULL, 16);
+			s += 4;
+		} else if (*s == '\\') {
+			s = fmt_parse_escape(s + 1, &c);
+			out[n++] = (uint8_t)c;
+		} else {
+			out[n++] = (uint8_t)*s++;
+		}
+	}
+	return n;
+}
+
+//	Render a byte the way hexdump's %_c conversion does
+const char *fmt_char_name(uint8_t v, char *buf, size_t len) {
+	switch (v) {
+		case '\0':	return "\\0";
+		case '\a':	return "\\a";
+		case '\b':	return "\\b";
+		case '\f':	return "\\f";
+		case '\n':	return "\\n";
+		case '\r':	return "\\r";
+		case '\t':	return "\\t";
+		case '\v':	return "\\v";
+	}
+	if (isprint(v)) {
+		snprintf(buf, len, "%c", v);
+	} else {
+		snprintf(buf, len, "%03o", v);
+	}
+	return buf;
+}
+
+//	Pre-render all 256 values of a single byte conversion into a lookup table
+int fmt_build_lut(fmt_op_t *op) {
+	int v, n;
+	char name[8];
+	op->lut = malloc(256 * FMT_LUT_WIDTH);
+	if (!op->lut) {
+		return -1;
+	}
+	for (v = 0; v < 256; v++) {
+		switch (op->conv) {
 			case 'd':
-				opt->opt_d = 1;
-				break;
-			case 'z':
-				opt->opt_z = 1;
+			case 'i':
+				n = snprintf(op->lut[v], FMT_LUT_WIDTH, op->spec, (int)(int8_t)v);
 				break;
-			case 't':
-				opt->opt_t = 1;
+			case 'p':
+				n = snprintf(op->lut[v], FMT_LUT_WIDTH, op->spec, isprint(v) ? v : '.');
 				break;
-			case 'n':
-				opt->opt_n = 1;
+			case 'C':
+				n = snprintf(op->lut[v], FMT_LUT_WIDTH, op->spec,
+					fmt_char_name(v, name, sizeof(name)));
 				break;
-			case 's':
-				opt->opt_s = 1;
+			default:
+				n = snprintf(op->lut[v], FMT_LUT_WIDTH, op->spec, v);
 				break;
+		}
+		//	The last table column holds the rendered length
+		if (n < 0 || n >= FMT_LUT_WIDTH - 1) {
+			return -1;
+		}
+		op->lut[v][FMT_LUT_WIDTH - 1] = (char)n;
+	}
+	return 0;
+}
+
+//	Parse a single '%' conversion into an operation, returns the next input position
+const char *fmt_parse_conv(const char *src, const char *s, fmt_op_t *op, uint8_t size) {
+	const char *c = s + 1;
+	size_t k = 1;
+	
+	//	Copy flags, width and precision into the printf specification
+	op->spec[0] = '%';
+	while (*c && strchr("-+ #0", *c) && k < 6) {
+		op->spec[k++] = *c++;
+	}
+	while (isdigit((uint8_t)*c) && k < 8) {
+		op->spec[k++] = *c++;
+	}
+	if (*c == '.') {
+		op->spec[k++] = *c++;
+		while (isdigit((uint8_t)*c) && k < 11) {
+			op->spec[k++] = *c++;
+		}
+	}
+	if (isdigit((uint8_t)*c)) {
+		fmt_error(src, c, "conversion width too large");
+		return NULL;
+	}
+	
+	if (*c == '_') {
+		switch (*++c) {
+			//	Input offset (%_ad, %_ao, %_ax)
 			case 'a':
-				opt->opt_a = 1;
-				break;
-			case 'm':
-				opt->opt_m = 1;
-				break;
-			case 'h':
-				print_usage();
-				return 0;
+				if (!c[1] || !strchr("dox", c[1])) {
+					fmt_error(src, c, "expected 'd', 'o' or 'x' after '%_a'");
+					return NULL;
+				}
+				op->kind = FMT_OP_OFFSET;
+				op->spec[k++] = 'l';
+				op->spec[k++] = 'l';
+				op->spec[k++] = (c[1] == 'd') ? 'u' : c[1];
+				op->spec[k] = '\0';
+				return c + 2;
+			//	Printable character or '.'
 			case 'p':
-				opt->opt_p = 1;
-				opt->val_p = strdup(optarg);
+				op->conv = 'p';
+				op->spec[k++] = 'c';
 				break;
-			case 'b':
-				opt->opt_b = 1;
-				opt->val_b = (uint32_t) strtol(optarg, NULL, 10);
+			//	Character or C escape / octal
+			case 'c':
+				op->conv = 'C';
+				op->spec[k++] = 's';
 				break;
-			case 'o':
-				opt->opt_o = 1;
-				opt->val_o = strdup(optarg);
+			//	Timestamps, rendered the same as '-t', '-n' and '-s'
+			case 't':
+				op->kind = FMT_OP_TIME_ABS;
+				return c + 1;
+			case 'n':
+				op->kind = FMT_OP_TIME_NS;
+				return c + 1;
+			case 's':
+				op->kind = FMT_OP_TIME_SEC;
+				return c + 1;
+			default:
+				fmt_error(src, c, "unknown '%_' conversion");
+				return NULL;
+		}
+	} else if (*c && strchr("diouxXc", *c)) {
+		op->conv = *c;
+		op->spec[k++] = *c;
+	} else {
+		fmt_error(src, c, "unknown conversion");
+		return NULL;
+	}
+	op->spec[k] = '\0';
+	op->size = size;
+	
+	//	Single byte conversions are table-driven, wider integers use snprintf()
+	if (size == 1) {
+		op->kind = FMT_OP_LUT;
+		if (fmt_build_lut(op)) {
+			fmt_error(src, c, "conversion output too wide");
+			return NULL;
+		}
+	} else if (strchr("pCc", op->conv)) {
+		fmt_error(src, c, "character conversions require a byte count of 1");
+		return NULL;
+	} else {
+		op->kind = FMT_OP_INT;
+	}
+	return c + 1;
+}
+
+//	Release a compiled format program
+void fmt_free(fmt_program_t *prog) {
+	uint16_t i;
+	if (!prog) {
+		return;
+	}
+	if (prog->ops) {
+		for (i = 0; i < prog->nops; i++) {
+			free(prog->ops[i].lut);
+		}
+	}
+	free(prog->ops);
+	free(prog->units);
+	free(prog->text);
+	free(prog);
+}
+
+//	Compile a hexdump-style format string into a list of operations
+//	Syntax: [iterations][/byte_count] "format" ..., byte counts 1, 2 or 4
+fmt_program_t *fmt_compile(const char *src) {
+	fmt_program_t *prog;
+	fmt_unit_t *unit;
+	fmt_op_t *op;
+	const char *s = src;
+	char *t, *end;
+	unsigned long iter, size;
+	size_t n = strlen(src);
+	int consumes = 0;
+	
+	if (n > FMT_MAX_LENGTH) {
+		fmt_error(src, src + FMT_MAX_LENGTH, "format string too long");
+		return NULL;
+	}
+	
+	//	Every source character produces at most one operation or unit
+	prog = calloc(1, sizeof(fmt_program_t));
+	if (!prog) {
+		return NULL;
+	}
+	prog->ops = calloc(n + 1, sizeof(fmt_op_t));
+	prog->units = calloc(n + 1, sizeof(fmt_unit_t));
+	prog->text = malloc(n + 1);
+	if (!prog->ops || !prog->units || !prog->text) {
+		goto error;
+	}
+	t = prog->text;
+	
+	while (*s) {
+		if (isspace((uint8_t)*s)) {
+			s++;
+			continue;
+		}
+		
+		//	Optional iteration and byte counts
+		iter = 1;
+		size = 1;
+		if (isdigit((uint8_t)*s)) {
+			iter = strtoul(s, &end, 10);
+			s = end;
+		}
+		if (*s == '/') {
+			size = strtoul(s + 1, &end, 10);
+			if (end == s + 1) {
+				fmt_error(src, s, "expected byte count after '/'");
+				goto error;
+			}
+			s = end;
+		}
+		if (iter < 1 || iter > UINT16_MAX) {
+			fmt_error(src, s, "invalid iteration count");
+			goto error;
+		}
+		if (size != 1 && size != 2 && size != 4) {
+			fmt_error(src, s, "byte count must be 1, 2 or 4");
+			goto error;
+		}
+		while (isspace((uint8_t)*s)) {
+			s++;
+		}
+		if (*s != '"') {
+			fmt_error(src, s, "expected '\"'");
+			goto error;
+		}
+		s++;
+		
+		//	Split the quoted string into literal text and conversions
+		unit = &prog->units[prog->nunits++];
+		unit->first = prog->nops;
+		unit->iter = (uint16_t)iter;
+		while (*s && *s != '"') {
+			op = &prog->ops[prog->nops++];
+			if (*s == '%' && s[1] != '%') {
+				s = fmt_parse_conv(src, s, op, (uint8_t)size);
+				if (!s) {
+					goto error;
+				}
+				consumes |= op->size;
+				continue;
+			}
+			op->kind = FMT_OP_TEXT;
+			op->text = t;
+			while (*s && *s != '"' && !(*s == '%' && s[1] != '%')) {
+				if (*s == '%') {
+					*t++ = '%';
+					s += 2;
+				} else if (*s == '\\') {
+					s = fmt_parse_escape(s + 1, t++);
+				} else {
+					*t++ = *s++;
+				}
+			}
+			op->len = (uint16_t)(t - op->text);
+		}
+		if (*s != '"') {
+			fmt_error(src, s, "unterminated '\"'");
+			goto error;
+		}
+		s++;
+		unit->count = prog->nops - unit->first;
+		if (!unit->count) {
+			prog->nunits--;
+		}
+	}
+	
+	if (!consumes) {
+		fmt_error(src, s, "format string does not consume any input");
+		goto error;
+	}
+	return prog;
+	
+	error:
+	fmt_free(prog);
+	return NULL;
+}
+
+//	Compile the built-in hexadecimal/decimal output format from command line options
+fmt_program_t *fmt_compile_builtin(cmd_options_t *opt) {
+	char src[FMT_MAX_LENGTH];
+	const char *conv;
+	
+	if (opt->opt_z) {
+		conv = (opt->opt_d) ? "%03u " : "%02x ";
+	} else {
+		conv = (opt->opt_d) ? "%3u " : "%2x ";
+	}
+	snprintf(src, sizeof(src), "\"%s\" %s %s %s %d/1 \"%s\"",
+		(opt->opt_x) ? "\\e[1;1H\\e[2J" : "\\n",
+		(opt->opt_t) ? "\"%_t: \"" : "",
+		(opt->opt_n) ? "\"%_n: \"" : "",
+		(opt->opt_s) ? "\"%_s: \"" : "",
+		opt->val_w,
+		conv);
+	return fmt_compile(src);
+}
+
+//	Sample the clock once at the start of each format cycle
+void fmt_sample_time(app_context_t *app, fmt_program_t *prog) {
+	struct timespec ts, td;
+	clock_real(&ts);
+	if (app->ts.tv_sec == 0 && app->ts.tv_nsec == 0) {
+		app->ts = ts;
+	}
+	timespec_sub(&app->ts, &ts, &td);
+	prog->time_abs = ts.tv_sec * NANOSECONDS_PER_SECOND + ts.tv_nsec;
+	prog->time_delta = td.tv_sec * NANOSECONDS_PER_SECOND + td.tv_nsec;
+	app->ts = ts;
+}
+
+//	Format operation handlers, indexed by fmt_op_kind_t
+void fmt_exec_text(fmt_program_t *prog, fmt_op_t *op, out_buffer_t *out, uint32_t v) {
+	out_write(out, op->text, op->len);
+}
+
+void fmt_exec_lut(fmt_program_t *prog, fmt_op_t *op, out_buffer_t *out, uint32_t v) {
+	const char *s = op->lut[v];
+	memcpy(out->data + out->len, s, FMT_LUT_WIDTH - 1);
+	out->len += (uint8_t)s[FMT_LUT_WIDTH - 1];
+}
+
+void fmt_exec_int(fmt_program_t *prog, fmt_op_t *op, out_buffer_t *out, uint32_t v) {
+	int n;
+	if (op->conv == 'd' || op->conv == 'i') {
+		n = snprintf(out->data + out->len, OUT_BUFFER_RESERVE, op->spec,
+			(op->size == 2) ? (int)(int16_t)v : (int)(int32_t)v);
+	} else {
+		n = snprintf(out->data + out->len, OUT_BUFFER_RESERVE, op->spec, (unsigned)v);
+	}
+	out->len += (n < OUT_BUFFER_RESERVE) ? n : OUT_BUFFER_RESERVE - 1;
+}
+
+void fmt_exec_offset(fmt_program_t *prog, fmt_op_t *op, out_buffer_t *out, uint32_t v) {
+	int n = snprintf(out->data + out->len, OUT_BUFFER_RESERVE, op->spec,
+		(unsigned long long)prog->offset);
+	out->len += (n < OUT_BUFFER_RESERVE) ? n : OUT_BUFFER_RESERVE - 1;
+}
+
+void fmt_exec_time_abs(fmt_program_t *prog, fmt_op_t *op, out_buffer_t *out, uint32_t v) {
+	out->len += snprintf(out->data + out->len, OUT_BUFFER_RESERVE, "%ld", prog->time_abs);
+}
+
+void fmt_exec_time_ns(fmt_program_t *prog, fmt_op_t *op, out_buffer_t *out, uint32_t v) {
+	out->len += snprintf(out->data + out->len, OUT_BUFFER_RESERVE, "+%012ld", prog->time_delta);
+}
+
+void fmt_exec_time_sec(fmt_program_t *prog, fmt_op_t *op, out_buffer_t *out, uint32_t v) {
+	out->len += snprintf(out->data + out->len, OUT_BUFFER_RESERVE, "%.6f",
+		(double)prog->time_delta / (double)NANOSECONDS_PER_SECOND);
+}
+
+void (*const fmt_exec_table[FMT_OP_COUNT])(fmt_program_t *, fmt_op_t *, out_buffer_t *, uint32_t) = {
+	[FMT_OP_TEXT] = fmt_exec_text,
+	[FMT_OP_LUT] = fmt_exec_lut,
+	[FMT_OP_INT] = fmt_exec_int,
+	[FMT_OP_OFFSET] = fmt_exec_offset,
+	[FMT_OP_TIME_ABS] = fmt_exec_time_abs,
+	[FMT_OP_TIME_NS] = fmt_exec_time_ns,
+	[FMT_OP_TIME_SEC] = fmt_exec_time_sec,
+};
+
+//	Run the compiled format program over a received chunk
+//	A new format cycle is only started once the first byte for it is available
+void fmt_run(app_context_t *app, uint8_t *buf, int len) {
+	fmt_program_t *prog = app->fmt;
+	out_buffer_t *out = &app->out;
+	fmt_unit_t *unit;
+	fmt_op_t *op;
+	uint32_t v = 0;
+	int i = 0;
+	
+	while (1) {
+		if (!prog->active) {
+			if (i >= len) {
 				break;
-			case 'w':
-				opt->opt_w = 1;
-				opt->val_w = (uint8_t) strtol(optarg, NULL, 10);
+			}
+			prog->active = 1;
+			prog->unit = prog->iter = prog->op = 0;
+			prog->offset = app->offset + i;
+			fmt_sample_time(app, prog);
+		}
+		unit = &prog->units[prog->unit];
+		op = &prog->ops[unit->first + prog->op];
+		
+		//	Gather input bytes for conversions, suspending at the end of the chunk
+		if (op->size == 1) {
+			if (i >= len) {
 				break;
-			case '?':
-				switch (optopt) {
-					case 'p':
-					case 'b':
-					case 'o':
-					case 'w':
-						fprintf(stderr, "%sError%s: Option '%c' requires a value\n",
-							ESC_COLOR_MAGENTA,
-							ESC_COLOR_RESET,
-							optopt);
-						break;
-					default:
-						fprintf(stderr, "%sError%s: Unknown option '%c'\n",
-							ESC_COLOR_MAGENTA,
-							ESC_COLOR_RESET,
-							optopt);
-						break;
+			}
+			v = buf[i++];
+		} else if (op->size) {
+			while (prog->acc_len < op->size) {
+				if (i >= len) {
+					goto done;
 				}
-				return -1;
-			default:
-				fprintf(stderr, "Error parsing command line options\n");
-				print_usage();
-				return -1;
+				prog->acc[prog->acc_len++] = buf[i++];
+			}
+			v = prog->acc[0] | (prog->acc[1] << 8);
+			if (op->size == 4) {
+				v |= ((uint32_t)prog->acc[2] << 16) | ((uint32_t)prog->acc[3] << 24);
+			}
+			prog->acc_len = 0;
+		}
+		
+		if (out->len + OUT_BUFFER_RESERVE > OUT_BUFFER_SIZE) {
+			out_flush(out);
+		}
+		fmt_exec_table[op->kind](prog, op, out, v);
+		
+		//	Advance to the next operation, iteration and unit
+		if (++prog->op < unit->count) {
+			continue;
+		}
+		prog->op = 0;
+		if (++prog->iter < unit->iter) {
+			continue;
+		}
+		prog->iter = 0;
+		if (++prog->unit == prog->nunits) {
+			prog->active = 0;
+		}
+	}
+	
+	done:
+	return;
+}
+
+#if FEATURE_EXPORT
+//	Export encodings for pasting captured bytes into code and tests
+#define EXPORT_PIECE_SIZE 1536
+
+//	Two-character lowercase hex pairs for every byte value
+static char hex_pairs[256][2];
+
+void hex_pairs_init(void) {
+	static const char digits[] = "0123456789abcdef";
+	int v;
+	for (v = 0; v < 256; v++) {
+		hex_pairs[v][0] = digits[v >> 4];
+		hex_pairs[v][1] = digits[v & 0x0f];
+	}
+}
+
+#if defined(__SSE2__)
+//	Convert the nibbles of 16 bytes to lowercase hex digits (high nibbles, low nibbles)
+static inline void hex_nibbles_sse2(__m128i v, __m128i *hi, __m128i *lo) {
+	const __m128i mask = _mm_set1_epi8(0x0f);
+	const __m128i nine = _mm_set1_epi8(9);
+	const __m128i zero = _mm_set1_epi8('0');
+	const __m128i alpha = _mm_set1_epi8('a' - '0' - 10);
+	__m128i h = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+	__m128i l = _mm_and_si128(v, mask);
+	*hi = _mm_add_epi8(_mm_add_epi8(h, zero), _mm_and_si128(_mm_cmpgt_epi8(h, nine), alpha));
+	*lo = _mm_add_epi8(_mm_add_epi8(l, zero), _mm_and_si128(_mm_cmpgt_epi8(l, nine), alpha));
+}
+#endif	/* __SSE2__ */
+
+//	Encode bytes as a contiguous hex string, returns the number of characters written
+size_t export_hex(const uint8_t *src, size_t n, char *dst) {
+	char *d = dst;
+	size_t i = 0;
+#if defined(__SSE2__)
+	__m128i hi, lo;
+	for (; i + 16 <= n; i += 16, d += 32) {
+		hex_nibbles_sse2(_mm_loadu_si128((const __m128i *)(src + i)), &hi, &lo);
+		_mm_storeu_si128((__m128i *)d, _mm_unpacklo_epi8(hi, lo));
+		_mm_storeu_si128((__m128i *)(d + 16), _mm_unpackhi_epi8(hi, lo));
+	}
+#endif	/* __SSE2__ */
+	for (; i < n; i++, d += 2) {
+		memcpy(d, hex_pairs[src[i]], 2);
+	}
+	return d - dst;
+}
+
+//	Encode bytes as C string hex escapes ("\x02\x10")
+size_t export_cstr(const uint8_t *src, size_t n, char *dst) {
+	char *d = dst;
+	size_t i = 0;
+#if defined(__SSE2__)
+	const __m128i prefix = _mm_set1_epi16('\\' | ('x' << 8));
+	__m128i hi, lo, pairs;
+	for (; i + 16 <= n; i += 16, d += 64) {
+		hex_nibbles_sse2(_mm_loadu_si128((const __m128i *)(src + i)), &hi, &lo);
+		pairs = _mm_unpacklo_epi8(hi, lo);
+		_mm_storeu_si128((__m128i *)d, _mm_unpacklo_epi16(prefix, pairs));
+		_mm_storeu_si128((__m128i *)(d + 16), _mm_unpackhi_epi16(prefix, pairs));
+		pairs = _mm_unpackhi_epi8(hi, lo);
+		_mm_storeu_si128((__m128i *)(d + 32), _mm_unpacklo_epi16(prefix, pairs));
+		_mm_storeu_si128((__m128i *)(d + 48), _mm_unpackhi_epi16(prefix, pairs));
+	}
+#endif	/* __SSE2__ */
+	for (; i < n; i++, d += 4) {
+		d[0] = '\\';
+		d[1] = 'x';
+		memcpy(d + 2, hex_pairs[src[i]], 2);
+	}
+	return d - dst;
+}
+
+//	Encode bytes as C array initializer elements ("0x02, 0x10, ")
+size_t export_carray(const uint8_t *src, size_t n, char *dst) {
+	char *d = dst;
+	size_t i;
+	for (i = 0; i < n; i++, d += 6) {
+		memcpy(d, "0x", 2);
+		memcpy(d + 2, hex_pairs[src[i]], 2);
+		memcpy(d + 4, ", ", 2);
+	}
+	return d - dst;
+}
+
+//	Base64 alphabet and 12-bit pair table (two output characters per lookup)
+static const char base64_chars[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static char base64_pairs[4096][2];
+
+void base64_pairs_init(void) {
+	int v;
+	for (v = 0; v < 4096; v++) {
+		base64_pairs[v][0] = base64_chars[v >> 6];
+		base64_pairs[v][1] = base64_chars[v & 0x3f];
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//	Encode 12 bytes of each 16 byte load into 16 base64 characters (pshufb lookup)
+__attribute__((target("ssse3")))
+size_t export_base64_ssse3(const uint8_t *src, size_t n, char *dst) {
+	const __m128i shuf = _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+	const __m128i shift_lut = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'+' - 62, '/' - 63, 'A', 0, 0);
+	__m128i in, t0, t1, t2, t3, idx, res, less;
+	size_t i;
+	for (i = 0; i + 16 <= n; i += 12, dst += 16) {
+		in = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + i)), shuf);
+		t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+		t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+		t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+		t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+		idx = _mm_or_si128(t1, t3);
+		res = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+		less = _mm_cmpgt_epi8(_mm_set1_epi8(26), idx);
+		res = _mm_or_si128(res, _mm_and_si128(less, _mm_set1_epi8(13)));
+		res = _mm_add_epi8(_mm_shuffle_epi8(shift_lut, res), idx);
+		_mm_storeu_si128((__m128i *)dst, res);
+	}
+	return i;
+}
+#endif	/* __x86_64__ || __i386__ */
+
+//	Encode bytes as base64 with padding, returns the number of characters written
+size_t export_base64(const uint8_t *src, size_t n, char *dst) {
+	char *d = dst;
+	size_t i = 0;
+	uint32_t v;
+#if defined(__x86_64__) || defined(__i386__)
+	static int ssse3 = -1;
+	if (ssse3 < 0) {
+		ssse3 = __builtin_cpu_supports("ssse3");
+	}
+	if (ssse3) {
+		i = export_base64_ssse3(src, n, d);
+		d += i / 3 * 4;
+	}
+#endif	/* __x86_64__ || __i386__ */
+	for (; i + 3 <= n; i += 3, d += 4) {
+		v = (src[i] << 16) | (src[i + 1] << 8) | src[i + 2];
+		memcpy(d, base64_pairs[v >> 12], 2);
+		memcpy(d + 2, base64_pairs[v & 0xfff], 2);
+	}
+	if (n - i == 1) {
+		v = src[i] << 16;
+		memcpy(d, base64_pairs[v >> 12], 2);
+		memcpy(d + 2, "==", 2);
+		d += 4;
+	} else if (n - i == 2) {
+		v = (src[i] << 16) | (src[i + 1] << 8);
+		memcpy(d, base64_pairs[v >> 12], 2);
+		d[2] = base64_chars[(v >> 6) & 0x3f];
+		d[3] = '=';
+		d += 4;
+	}
+	return d - dst;
+}
+
+//	Export encoding table, indexed by export_kind_t
+const export_encoding_t export_encodings[EXPORT_COUNT] = {
+	[EXPORT_CSTR] = { "cstr", "\"", "\"", 4, export_cstr },
+	[EXPORT_CARRAY] = { "carray", "{", "},", 6, export_carray },
+	[EXPORT_BASE64] = { "base64", "", "", 2, export_base64 },
+	[EXPORT_HEX] = { "hex", "", "", 2, export_hex },
+};
+
+//	Look up an export encoding by name
+int export_lookup(const char *name) {
+	int i;
+	for (i = 1; i < EXPORT_COUNT; i++) {
+		if (!strcmp(name, export_encodings[i].name)) {
+			return i;
+		}
+	}
+	return EXPORT_NONE;
+}
+
+//	Encode one line (or frame) of bytes, with its prefix and suffix
+void export_line(app_context_t *app, cmd_options_t *opt, const uint8_t *src, size_t n) {
+	const export_encoding_t *enc = &export_encodings[app->exp.kind];
+	out_buffer_t *out = &app->out;
+	size_t piece;
+	
+	if (opt->opt_t || opt->opt_n || opt->opt_s) {
+		if (out->len + OUT_BUFFER_RESERVE > OUT_BUFFER_SIZE) {
+			out_flush(out);
+		}
+		out->len += format_timestamp(app, opt, out->data + out->len, OUT_BUFFER_RESERVE);
+	}
+	out_write(out, enc->prefix, strlen(enc->prefix));
+	
+	//	Encode in pieces which fit the output buffer (multiple of 3 for base64)
+	while (n) {
+		piece = (n > EXPORT_PIECE_SIZE) ? EXPORT_PIECE_SIZE : n;
+		if (out->len + piece * enc->ratio + OUT_BUFFER_RESERVE > OUT_BUFFER_SIZE) {
+			out_flush(out);
 		}
+		out->len += enc->encode(src, piece, out->data + out->len);
+		src += piece;
+		n -= piece;
+	}
+	
+	//	Drop the trailing separator of C array elements
+	if (app->exp.kind == EXPORT_CARRAY && out->len >= 2 &&
+		!memcmp(out->data + out->len - 2, ", ", 2)) {
+		out->len -= 2;
+	}
+	out_write(out, enc->suffix, strlen(enc->suffix));
+	out_write(out, "\n", 1);
+}
+
+//	Export a received chunk, one line per '-w' bytes or one line per chunk
+void export_run(app_context_t *app, cmd_options_t *opt, uint8_t *buf, int len) {
+	export_state_t *exp = &app->exp;
+	size_t n;
+	
+	if (exp->frame) {
+		export_line(app, opt, buf, len);
+		return;
+	}
+	while (len) {
+		n = opt->val_w - exp->len;
+		if (n > (size_t)len) {
+			n = len;
+		}
+		//	Encode whole lines straight from the chunk, buffer partial lines
+		if (!exp->len && n == opt->val_w) {
+			export_line(app, opt, buf, n);
+		} else {
+			memcpy(exp->line + exp->len, buf, n);
+			exp->len += n;
+			if (exp->len == opt->val_w) {
+				export_line(app, opt, exp->line, exp->len);
+				exp->len = 0;
+			}
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+//	Export any partial line left at the end of input
+void export_finish(app_context_t *app, cmd_options_t *opt) {
+	if (app->exp.kind && app->exp.len) {
+		export_line(app, opt, app->exp.line, app->exp.len);
+		app->exp.len = 0;
+	}
+	out_flush(&app->out);
+}
+
+#else
+
+//	Export encodings excluded from this build
+void hex_pairs_init(void) {
+}
+
+void base64_pairs_init(void) {
+}
+
+int export_lookup(const char *name) {
+	return EXPORT_NONE;
+}
+
+void export_run(app_context_t *app, cmd_options_t *opt, uint8_t *buf, int len) {
+}
+
+void export_finish(app_context_t *app, cmd_options_t *opt) {
+	out_flush(&app->out);
+}
+
+#endif	/* FEATURE_EXPORT */
+
+#if FEATURE_REGEX
+//	Regex parser state, fragments are built in reverse order for the reverse NFA
+typedef struct {
+	re_program_t *re;
+	const char *src, *p, *end;
+	uint8_t reverse;
+	const char *err;
+} re_parser_t;
+
+//	NFA fragment, 'out' is a list of unconnected exits threaded through the nodes (node * 2 + slot)
+typedef struct {
+	int32_t start, out;
+} re_frag_t;
+
+//	Print a regex parsing error
+void re_error(const char *src, const char *at, const char *msg) {
+	fprintf(stderr, "%sError%s: Regex '-E': %s at offset %d\n",
+		ESC_COLOR_MAGENTA,
+		ESC_COLOR_RESET,
+		msg, (int)(at - src));
+}
+
+int re_node(re_parser_t *ps, uint8_t kind, int32_t out0, int32_t out1) {
+	re_program_t *re = ps->re;
+	re_node_t *n;
+	if (re->nnodes == REGEX_MAX_NODES) {
+		ps->err = "pattern too large";
+		return -1;
+	}
+	n = &re->nodes[re->nnodes];
+	n->kind = kind;
+	n->set = 0;
+	n->out[0] = out0;
+	n->out[1] = out1;
+	return re->nnodes++;
+}
+
+//	Connect every exit in a list to a node
+void re_patch(re_program_t *re, int32_t list, int32_t target) {
+	int32_t next;
+	while (list >= 0) {
+		next = re->nodes[list >> 1].out[list & 1];
+		re->nodes[list >> 1].out[list & 1] = target;
+		list = next;
+	}
+}
+
+int32_t re_append(re_program_t *re, int32_t a, int32_t b) {
+	int32_t list = a;
+	if (a < 0) {
+		return b;
+	}
+	while (re->nodes[list >> 1].out[list & 1] >= 0) {
+		list = re->nodes[list >> 1].out[list & 1];
+	}
+	re->nodes[list >> 1].out[list & 1] = b;
+	return a;
+}
+
+re_frag_t re_concat(re_parser_t *ps, re_frag_t a, re_frag_t b) {
+	re_frag_t f;
+	if (ps->reverse) {
+		f = a;
+		a = b;
+		b = f;
+	}
+	re_patch(ps->re, a.out, b.start);
+	f.start = a.start;
+	f.out = b.out;
+	return f;
+}
+
+//	Single node fragments (character set or empty string)
+re_frag_t re_leaf(re_parser_t *ps, uint8_t kind, int set) {
+	re_frag_t f = { -1, -1 };
+	int n = re_node(ps, kind, -1, -1);
+	if (n >= 0) {
+		ps->re->nodes[n].set = set;
+		f.start = n;
+		f.out = n * 2;
+	}
+	return f;
+}
+
+//	Repetition: '*' zero or more, '+' one or more, '?' zero or one
+re_frag_t re_repeat(re_parser_t *ps, re_frag_t a, char op) {
+	re_frag_t f = { -1, -1 };
+	int n = re_node(ps, RE_NODE_SPLIT, a.start, -1);
+	if (n < 0) {
+		return f;
+	}
+	if (op == '?') {
+		f.start = n;
+		f.out = re_append(ps->re, a.out, n * 2 + 1);
+	} else {
+		re_patch(ps->re, a.out, n);
+		f.start = (op == '*') ? n : a.start;
+		f.out = n * 2 + 1;
+	}
+	return f;
+}
+
+//	Allocate an empty byte set
+int re_set(re_parser_t *ps) {
+	re_program_t *re = ps->re;
+	if (re->nsets == REGEX_MAX_NODES) {
+		ps->err = "pattern too large";
+		return -1;
+	}
+	memset(re->sets[re->nsets], 0, sizeof(re->sets[0]));
+	return re->nsets++;
+}
+
+void re_set_range(uint32_t *set, int lo, int hi) {
+	for (; lo <= hi; lo++) {
+		set[lo >> 5] |= 1u << (lo & 31);
+	}
+}
+
+//	Add a backslash class (\d, \w, \s and their negations) to a set, returns 0 if 'c' is no class
+int re_set_class(uint32_t *set, char c) {
+	uint32_t tmp[8] = { 0 };
+	int i;
+	switch (tolower((uint8_t)c)) {
+		case 'd':
+			re_set_range(tmp, '0', '9');
+			break;
+		case 'w':
+			re_set_range(tmp, '0', '9');
+			re_set_range(tmp, 'A', 'Z');
+			re_set_range(tmp, 'a', 'z');
+			re_set_range(tmp, '_', '_');
+			break;
+		case 's':
+			re_set_range(tmp, '\t', '\r');
+			re_set_range(tmp, ' ', ' ');
+			break;
+		default:
+			return 0;
+	}
+	for (i = 0; i < 8; i++) {
+		set[i] |= isupper((uint8_t)c) ? ~tmp[i] : tmp[i];
+	}
+	return 1;
+}
+
+//	Decode a single-character escape after a backslash, returns -1 if unknown
+int re_parse_escape(re_parser_t *ps) {
+	char c = *ps->p++;
+	char hex[3];
+	switch (c) {
+		case 'n': return '\n';
+		case 'r': return '\r';
+		case 't': return '\t';
+		case 'e': return '\033';
+		case '0': return '\0';
+		case 'x':
+			if (ps->end - ps->p < 2 || !isxdigit((uint8_t)ps->p[0]) || !isxdigit((uint8_t)ps->p[1])) {
+				return -1;
+			}
+			hex[0] = *ps->p++;
+			hex[1] = *ps->p++;
+			hex[2] = '\0';
+			return (int)strtol(hex, NULL, 16);
+		default:
+			return (isalnum((uint8_t)c) || !c) ? -1 : (uint8_t)c;
+	}
+}
+
+//	Parse a bracket expression into a set, after the opening '['
+int re_parse_bracket(re_parser_t *ps) {
+	int set = re_set(ps), lo, hi, i, negate = 0;
+	uint32_t *bits;
+	if (set < 0) {
+		return -1;
+	}
+	bits = ps->re->sets[set];
+	if (ps->p < ps->end && *ps->p == '^') {
+		negate = 1;
+		ps->p++;
+	}
+	do {
+		if (ps->p >= ps->end) {
+			ps->err = "missing ']'";
+			return -1;
+		}
+		if (*ps->p == '\\' && ps->p + 1 < ps->end && re_set_class(bits, ps->p[1])) {
+			ps->p += 2;
+			continue;
+		}
+		lo = (*ps->p == '\\') ? (ps->p++, re_parse_escape(ps)) : (uint8_t)*ps->p++;
+		hi = lo;
+		if (ps->p + 1 < ps->end && *ps->p == '-' && ps->p[1] != ']') {
+			ps->p++;
+			hi = (*ps->p == '\\') ? (ps->p++, re_parse_escape(ps)) : (uint8_t)*ps->p++;
+		}
+		if (lo < 0 || hi < 0) {
+			ps->err = "invalid escape";
+			return -1;
+		}
+		if (hi < lo) {
+			ps->err = "invalid range";
+			return -1;
+		}
+		re_set_range(bits, lo, hi);
+	} while (ps->p >= ps->end || *ps->p != ']');
+	ps->p++;
+	if (negate) {
+		for (i = 0; i < 8; i++) {
+			bits[i] = ~bits[i];
+		}
+	}
+	return set;
+}
+
+re_frag_t re_parse_alt(re_parser_t *ps);
+
+//	Parse a single atom: group, bracket expression, '.', escape or literal byte
+re_frag_t re_parse_atom(re_parser_t *ps) {
+	re_frag_t f = { -1, -1 };
+	int set, c;
+	
+	if (*ps->p == '(') {
+		ps->p++;
+		f = re_parse_alt(ps);
+		if (ps->err) {
+			return f;
+		}
+		if (ps->p >= ps->end || *ps->p != ')') {
+			ps->err = "missing ')'";
+			return f;
+		}
+		ps->p++;
+		return f;
+	}
+	if (strchr("*+?{", *ps->p)) {
+		ps->err = "nothing to repeat";
+		return f;
+	}
+	if (*ps->p == '[') {
+		ps->p++;
+		set = re_parse_bracket(ps);
+		return (set < 0) ? f : re_leaf(ps, RE_NODE_CHAR, set);
+	}
+	set = re_set(ps);
+	if (set < 0) {
+		return f;
+	}
+	if (*ps->p == '.') {
+		ps->p++;
+		re_set_range(ps->re->sets[set], 0, 255);
+	} else if (*ps->p == '\\' && ps->p + 1 < ps->end && re_set_class(ps->re->sets[set], ps->p[1])) {
+		ps->p += 2;
+	} else {
+		c = (*ps->p == '\\') ? (ps->p++, re_parse_escape(ps)) : (uint8_t)*ps->p++;
+		if (c < 0) {
+			ps->err = "invalid escape";
+			return f;
+		}
+		re_set_range(ps->re->sets[set], c, c);
+	}
+	return re_leaf(ps, RE_NODE_CHAR, set);
+}
+
+//	Parse an atom and its repetition operators, '{m,n}' re-parses the atom for every extra copy
+re_frag_t re_parse_repeat(re_parser_t *ps) {
+	const char *atom = ps->p, *after;
+	re_frag_t f = re_parse_atom(ps);
+	long min, max, i;
+	char *e;
+	
+	while (!ps->err && ps->p < ps->end && strchr("*+?{", *ps->p)) {
+		if (*ps->p != '{') {
+			f = re_repeat(ps, f, *ps->p++);
+			continue;
+		}
+		min = strtol(ps->p + 1, &e, 10);
+		max = min;
+		if (e == ps->p + 1) {
+			ps->err = "invalid repetition";
+			break;
+		}
+		if (*e == ',') {
+			e++;
+			max = (isdigit((uint8_t)*e)) ? strtol(e, &e, 10) : -1;
+		}
+		if (*e != '}' || min > REGEX_MAX_REPEAT || max > REGEX_MAX_REPEAT || (max >= 0 && max < min)) {
+			ps->err = "invalid repetition";
+			break;
+		}
+		after = e + 1;
+		
+		//	The copy already parsed is the first mandatory one, or optional with no minimum
+		if (!max) {
+			f = re_leaf(ps, RE_NODE_EMPTY, 0);
+		} else if (!min) {
+			f = re_repeat(ps, f, (max < 0) ? '*' : '?');
+		}
+		for (i = 1; i < min && !ps->err; i++) {
+			ps->p = atom;
+			f = re_concat(ps, f, re_parse_atom(ps));
+		}
+		if (max < 0 && min) {
+			ps->p = atom;
+			f = re_concat(ps, f, re_repeat(ps, re_parse_atom(ps), '*'));
+		}
+		for (i = (min) ? min : 1; i < max && !ps->err; i++) {
+			ps->p = atom;
+			f = re_concat(ps, f, re_repeat(ps, re_parse_atom(ps), '?'));
+		}
+		ps->p = after;
+	}
+	return f;
+}
+
+//	Parse a sequence of atoms up to '|', ')' or the end of the pattern
+re_frag_t re_parse_concat(re_parser_t *ps) {
+	re_frag_t f = re_leaf(ps, RE_NODE_EMPTY, 0);
+	while (!ps->err && ps->p < ps->end && *ps->p != '|' && *ps->p != ')') {
+		f = re_concat(ps, f, re_parse_repeat(ps));
+	}
+	return f;
+}
+
+//	Parse alternatives separated by '|'
+re_frag_t re_parse_alt(re_parser_t *ps) {
+	re_frag_t f = re_parse_concat(ps), g;
+	int n;
+	while (!ps->err && ps->p < ps->end && *ps->p == '|') {
+		ps->p++;
+		g = re_parse_concat(ps);
+		n = re_node(ps, RE_NODE_SPLIT, f.start, g.start);
+		if (ps->err) {
+			break;
+		}
+		f.start = n;
+		f.out = re_append(ps->re, f.out, g.out);
+	}
+	return f;
+}
+
+//	Find the longest literal every match must contain, so lines without it can skip the DFA
+//	Conservative: no literal with top-level alternation, nothing inside groups or before '*', '?', '{'
+void re_literal(re_program_t *re, const char *p, const char *end) {
+	char run[REGEX_LITERAL_MAX];
+	int n = 0, depth = 0, lit;
+	re_parser_t ps;
+	
+	ps.end = end;
+	re->litlen = 0;
+	while (p < end) {
+		lit = -1;
+		if (*p == '\\' && p + 1 < end) {
+			//	Escapes decode to the byte they match, class escapes like \d are not literals
+			ps.p = p + 1;
+			lit = re_parse_escape(&ps);
+			p = ps.p;
+		} else if (*p == '[') {
+			p += (p + 1 < end && p[1] == '^') ? 2 : 1;
+			p += (p < end && *p == ']');
+			for (; p < end && *p != ']'; p++) {
+				p += (*p == '\\');
+			}
+			p++;
+		} else if (*p == '|' && !depth) {
+			//	A literal of one alternative is not required by the others
+			re->litlen = 0;
+			return;
+		} else if (*p == '{') {
+			for (; p < end && *p != '}'; p++);
+			p++;
+		} else if (strchr("()|.*+?", *p)) {
+			depth += (*p == '(') - (*p == ')');
+			p++;
+		} else {
+			lit = (uint8_t)*p++;
+		}
+		
+		//	Extend the run with a literal that must appear, otherwise end it
+		if (lit >= 0 && !depth && (p >= end || !strchr("*?{", *p))) {
+			run[n++] = lit;
+			if (p < end && *p != '+' && n < REGEX_LITERAL_MAX) {
+				continue;
+			}
+		}
+		if (n > re->litlen) {
+			memcpy(re->lit, run, n);
+			re->litlen = n;
+		}
+		n = 0;
+	}
+	if (n > re->litlen) {
+		memcpy(re->lit, run, n);
+		re->litlen = n;
+	}
+}
+
+//	Find the next occurrence of the required literal
+const uint8_t *re_find_literal(const re_program_t *re, const uint8_t *p, const uint8_t *end) {
+	while ((size_t)(end - p) >= re->litlen) {
+		p = memchr(p, (uint8_t)re->lit[0], end - p - re->litlen + 1);
+		if (!p || !memcmp(p, re->lit, re->litlen)) {
+			return p;
+		}
+		p++;
+	}
+	return NULL;
+}
+
+void re_free(re_program_t *re) {
+	if (re) {
+		free(re->nodes);
+		free(re->sets);
+		free(re);
+	}
+}
+
+//	Compile a pattern to forward and reverse NFAs, and split bytes into classes no set tells apart
+re_program_t *re_compile(const char *src) {
+	re_parser_t ps;
+	re_program_t *re;
+	re_frag_t f;
+	uint8_t next[256];
+	int16_t map[2][256];
+	int i, k, b, in, pass;
+	size_t n = strlen(src);
+	
+	re = calloc(1, sizeof(re_program_t));
+	if (!re) {
+		return NULL;
+	}
+	re->nodes = calloc(REGEX_MAX_NODES, sizeof(re_node_t));
+	re->sets = calloc(REGEX_MAX_NODES, sizeof(re->sets[0]));
+	if (!re->nodes || !re->sets) {
+		re_free(re);
+		return NULL;
+	}
+	
+	//	Line anchors are only recognized at the very start and end of the pattern
+	memset(&ps, 0, sizeof(ps));
+	ps.re = re;
+	ps.src = src;
+	ps.end = src + n;
+	if (n && src[0] == '^') {
+		re->bol = 1;
+	}
+	for (i = n - 1, k = 0; i > 0 && src[i - 1] == '\\'; i--) {
+		k++;
+	}
+	if (n > re->bol && src[n - 1] == '$' && !(k & 1)) {
+		re->eol = 1;
+		ps.end--;
+	}
+	if (ps.end == src + re->bol) {
+		re_error(src, src, "empty pattern");
+		re_free(re);
+		return NULL;
+	}
+	
+	for (pass = 0; pass < 2; pass++) {
+		ps.p = src + re->bol;
+		ps.reverse = pass;
+		f = re_parse_alt(&ps);
+		if (!ps.err && ps.p < ps.end) {
+			ps.err = "unmatched ')'";
+		}
+		k = re_node(&ps, RE_NODE_MATCH, -1, -1);
+		if (ps.err) {
+			re_error(src, ps.p, ps.err);
+			re_free(re);
+			return NULL;
+		}
+		re_patch(re, f.out, k);
+		if (pass) {
+			re->rev = f.start;
+		} else {
+			re->fwd = f.start;
+		}
+	}
+	
+	re_literal(re, src + re->bol, ps.end);
+	
+	//	Refine byte classes by every set in turn
+	re->ncls = 1;
+	for (k = 0; k < re->nsets; k++) {
+		memset(map, 0xff, sizeof(map));
+		n = 0;
+		for (b = 0; b < 256; b++) {
+			in = (re->sets[k][b >> 5] >> (b & 31)) & 1;
+			if (map[in][re->cls[b]] < 0) {
+				map[in][re->cls[b]] = n++;
+			}
+			next[b] = map[in][re->cls[b]];
+		}
+		memcpy(re->cls, next, sizeof(next));
+		re->ncls = n;
+	}
+	return re;
+}
+
+
+//	Mark a node and everything reachable from it without consuming input
+void re_closure(re_dfa_t *d, int32_t start) {
+	const re_node_t *nodes = d->re->nodes;
+	uint16_t *stack = d->list + d->re->nnodes;
+	int sp = 0, n, i;
+	
+	if (start < 0 || d->seen[start] == d->gen) {
+		return;
+	}
+	d->seen[start] = d->gen;
+	stack[sp++] = start;
+	while (sp) {
+		n = stack[--sp];
+		if (nodes[n].kind != RE_NODE_SPLIT && nodes[n].kind != RE_NODE_EMPTY) {
+			continue;
+		}
+		for (i = 0; i < 2; i++) {
+			if (nodes[n].out[i] >= 0 && d->seen[nodes[n].out[i]] != d->gen) {
+				d->seen[nodes[n].out[i]] = d->gen;
+				stack[sp++] = nodes[n].out[i];
+			}
+		}
+	}
+}
+
+//	Collect the marked byte-consuming and match nodes into d->list, in node order
+int re_collect(re_dfa_t *d) {
+	const re_node_t *nodes = d->re->nodes;
+	int n, len = 0;
+	for (n = 0; n < d->re->nnodes; n++) {
+		if (d->seen[n] == d->gen && (nodes[n].kind == RE_NODE_CHAR || nodes[n].kind == RE_NODE_MATCH)) {
+			d->list[len++] = n;
+		}
+	}
+	return len;
+}
+
+//	Find or add the DFA state for a node set, returns -1 when the cache is full
+int re_dfa_add(re_dfa_t *d, const uint16_t *list, int len) {
+	uint32_t h = 2166136261u;
+	int i, s, slot;
+	
+	for (i = 0; i < len; i++) {
+		h = (h ^ list[i]) * 16777619u;
+	}
+	for (slot = h & (REGEX_CACHE_STATES * 2 - 1); d->hash[slot] >= 0; slot = (slot + 1) & (REGEX_CACHE_STATES * 2 - 1)) {
+		s = d->hash[slot];
+		if (d->set_len[s] == len && !memcmp(d->pool + d->set_off[s], list, len * sizeof(uint16_t))) {
+			return s;
+		}
+	}
+	if (d->nstates == REGEX_CACHE_STATES || d->pool_len + len > REGEX_CACHE_POOL) {
+		return -1;
+	}
+	s = d->nstates++;
+	d->hash[slot] = s;
+	d->set_off[s] = d->pool_len;
+	d->set_len[s] = len;
+	memcpy(d->pool + d->pool_len, list, len * sizeof(uint16_t));
+	d->pool_len += len;
+	memset(d->trans + (size_t)s * d->re->ncls, 0xff, d->re->ncls * sizeof(int16_t));
+	d->accept[s] = 0;
+	for (i = 0; i < len; i++) {
+		d->accept[s] |= (d->re->nodes[list[i]].kind == RE_NODE_MATCH);
+	}
+	return s;
+}
+
+//	Empty the state cache, leaving only the dead and start states
+void re_dfa_reset(re_dfa_t *d) {
+	d->nstates = 0;
+	d->pool_len = 0;
+	memset(d->hash, 0xff, REGEX_CACHE_STATES * 2 * sizeof(int16_t));
+	re_dfa_add(d, d->list, 0);
+	d->gen++;
+	re_closure(d, d->start_node);
+	d->start = re_dfa_add(d, d->list, re_collect(d));
+}
+
+void re_dfa_free(re_dfa_t *d) {
+	free(d->trans);
+	free(d->hash);
+	free(d->accept);
+	free(d->set_off);
+	free(d->set_len);
+	free(d->pool);
+	free(d->list);
+	free(d->seen);
+}
+
+int re_dfa_init(re_dfa_t *d, const re_program_t *re, uint16_t start_node, uint8_t unanchored) {
+	memset(d, 0, sizeof(re_dfa_t));
+	d->re = re;
+	d->start_node = start_node;
+	d->unanchored = unanchored;
+	d->trans = malloc((size_t)REGEX_CACHE_STATES * re->ncls * sizeof(int16_t));
+	d->hash = malloc(REGEX_CACHE_STATES * 2 * sizeof(int16_t));
+	d->accept = malloc(REGEX_CACHE_STATES);
+	d->set_off = malloc(REGEX_CACHE_STATES * sizeof(uint32_t));
+	d->set_len = malloc(REGEX_CACHE_STATES * sizeof(uint16_t));
+	d->pool = malloc(REGEX_CACHE_POOL * sizeof(uint16_t));
+	d->list = malloc(re->nnodes * 2 * sizeof(uint16_t));
+	d->seen = calloc(re->nnodes, sizeof(uint32_t));
+	if (!d->trans || !d->hash || !d->accept || !d->set_off || !d->set_len ||
+		!d->pool || !d->list || !d->seen) {
+		re_dfa_free(d);
+		return -1;
+	}
+	re_dfa_reset(d);
+	return 0;
+}
+
+//	Compute a transition missing from the cache, emptying the cache first if it is full
+int re_dfa_miss(re_dfa_t *d, int s, uint8_t c) {
+	const re_node_t *nodes = d->re->nodes;
+	const uint16_t *set = d->pool + d->set_off[s];
+	uint16_t list[REGEX_MAX_NODES];
+	int i, len, t;
+	
+	d->gen++;
+	for (i = 0; i < d->set_len[s]; i++) {
+		if (nodes[set[i]].kind == RE_NODE_CHAR &&
+			(d->re->sets[nodes[set[i]].set][c >> 5] >> (c & 31)) & 1) {
+			re_closure(d, nodes[set[i]].out[0]);
+		}
+	}
+	if (d->unanchored) {
+		re_closure(d, d->start_node);
+	}
+	len = re_collect(d);
+	t = re_dfa_add(d, d->list, len);
+	if (t >= 0) {
+		d->trans[(size_t)s * d->re->ncls + d->re->cls[c]] = t;
+		return t;
+	}
+	
+	//	Cache full: start over from the dead, start and next states (state 's' is gone)
+	memcpy(list, d->list, len * sizeof(uint16_t));
+	re_dfa_reset(d);
+	d->resets++;
+	return re_dfa_add(d, list, len);
+}
+
+//	Advance a DFA by one byte, computing the transition on a cache miss
+static inline int re_dfa_step(re_dfa_t *d, int s, uint8_t c) {
+	int t = d->trans[(size_t)s * d->re->ncls + d->re->cls[c]];
+	return (t >= 0) ? t : re_dfa_miss(d, s, c);
+}
+
+void re_match_free(re_match_t *m) {
+	if (m) {
+		re_dfa_free(&m->scan);
+		re_dfa_free(&m->extend);
+		re_dfa_free(&m->rev);
+		re_free(m->re);
+		free(m);
+	}
+}
+
+//	Compile a pattern and set up the matching state of one port
+re_match_t *re_match_new(const char *pattern) {
+	re_match_t *m = calloc(1, sizeof(re_match_t));
+	if (!m) {
+		return NULL;
+	}
+	m->re = re_compile(pattern);
+	if (!m->re ||
+		re_dfa_init(&m->scan, m->re, m->re->fwd, !m->re->bol) ||
+		re_dfa_init(&m->extend, m->re, m->re->fwd, 0) ||
+		re_dfa_init(&m->rev, m->re, m->re->rev, !m->re->eol)) {
+		re_match_free(m);
+		return NULL;
+	}
+	m->state = m->scan.start;
+	m->line_start = 1;
+	return m;
+}
+
+//	Mark the leftmost-longest, non-overlapping matches within the first 'n' held bytes
+//	A reverse pass marks every position a match can start at, then matches are extended forward
+void re_highlight(re_match_t *m, size_t n, int line_end) {
+	size_t i, j, end;
+	int s;
+	
+	memset(m->mark, 0, n);
+	if ((m->re->eol && !line_end) || (m->re->bol && !m->line_start)) {
+		return;
+	}
+	s = m->rev.start;
+	for (i = n; i-- > 0;) {
+		s = re_dfa_step(&m->rev, s, m->hold[i]);
+		if (!s) {
+			break;
+		}
+		m->mark[i] = m->rev.accept[s] ? RE_MARK_START : 0;
+	}
+	for (i = 0; i < n;) {
+		if (!(m->mark[i] & RE_MARK_START) || (m->re->bol && i)) {
+			i++;
+			continue;
+		}
+		s = m->extend.start;
+		end = i;
+		for (j = i; j < n; j++) {
+			s = re_dfa_step(&m->extend, s, m->hold[j]);
+			if (!s) {
+				break;
+			}
+			if (m->extend.accept[s] && (!m->re->eol || j + 1 == n)) {
+				end = j + 1;
+			}
+		}
+		if (end == i) {
+			i++;
+			continue;
+		}
+		for (; i < end; i++) {
+			m->mark[i] |= RE_MARK_MATCH;
+		}
+	}
+}
+
+//	Check whether a match may still be in progress at the end of the held text
+//	(a DFA state alone can't tell, as a pattern like 'x?z' loops back into its start state)
+int re_pending(re_match_t *m) {
+	size_t p, j;
+	int s;
+	for (p = 0; p < m->len; p++) {
+		if (m->re->bol && (p || !m->line_start)) {
+			return 0;
+		}
+		s = m->extend.start;
+		for (j = p; j < m->len && s; j++) {
+			s = re_dfa_step(&m->extend, s, m->hold[j]);
+		}
+		if (s) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+//	Render held bytes as ASCII output, wrapping matches in the highlight color
+void re_render(app_context_t *app, cmd_options_t *opt, size_t n) {
+	re_match_t *m = app->re;
+	uint8_t c;
+	size_t i, j;
+	
+	for (i = 0; i < n; i = j) {
+		for (j = i; j < n && !(m->mark[j] & RE_MARK_MATCH); j++);
+		print_ascii_run(m->hold + i, j - i, app, opt);
+		if (j == n) {
+			break;
+		}
+		//	Colored escapes of non-printable bytes reset the color, so it is restored per byte
+		out_write(&app->out, ESC_COLOR_MATCH, sizeof(ESC_COLOR_MATCH) - 1);
+		for (; j < n && (m->mark[j] & RE_MARK_MATCH); j++) {
+			c = m->hold[j];
+			print_byte_ascii(&m->hold[j], app, opt);
+			if (opt->opt_c && ((!isprint(c) && !iscntrl(c)) || c == '\\') &&
+				j + 1 < n && (m->mark[j + 1] & RE_MARK_MATCH)) {
+				out_write(&app->out, ESC_COLOR_MATCH, sizeof(ESC_COLOR_MATCH) - 1);
+			}
+		}
+		out_write(&app->out, ESC_COLOR_RESET, sizeof(ESC_COLOR_RESET) - 1);
+	}
+}
+
+//	Release the held text: print it, or drop it if filtering and nothing matched yet
+//	Highlighting is skipped when the scan DFA saw no match end within the text
+void re_release(app_context_t *app, cmd_options_t *opt, int line_end) {
+	re_match_t *m = app->re;
+	if (!opt->opt_L || m->matched) {
+		if (m->hit) {
+			re_highlight(m, m->len, line_end);
+			re_render(app, opt, m->len);
+		} else {
+			print_ascii_run(m->hold, m->len, app, opt);
+		}
+	}
+	m->len = 0;
+	m->hit = 0;
+	m->line_start = 0;
+}
+
+//	Match a chunk of ASCII output, the scan DFA decides whether a line matches at all
+void re_feed(app_context_t *app, cmd_options_t *opt, uint8_t *buf, int len) {
+	re_match_t *m = app->re;
+	re_dfa_t *d = &m->scan;
+	uint8_t *nl, *end = buf + len, hit = 0;
+	const uint8_t *lim;
+	const int16_t *trans = d->trans;
+	const uint8_t *cls = m->re->cls, *accept = d->accept;
+	size_t n, i;
+	int s = m->state, t, ncls = m->re->ncls;
+	
+	while (buf < end) {
+		//	At a line start, pass whole lines without the required literal straight through
+		if (m->re->litlen && m->line_start && !m->len) {
+			lim = re_find_literal(m->re, buf, end);
+			for (nl = (lim) ? (uint8_t *)lim : end; nl > buf && nl[-1] != '\n'; nl--);
+			if (nl > buf) {
+				if (!opt->opt_L) {
+					print_ascii_run(buf, nl - buf, app, opt);
+				}
+				buf = nl;
+				continue;
+			}
+		}
+		
+		//	Scan up to the end of the line, or as much as fits the hold buffer
+		nl = memchr(buf, '\n', end - buf);
+		n = ((nl) ? nl : end) - buf;
+		if (n > REGEX_HOLD_SIZE - m->len) {
+			n = REGEX_HOLD_SIZE - m->len;
+		}
+		memcpy(m->hold + m->len, buf, n);
+		for (i = 0; i < n; i++) {
+			t = trans[s * ncls + cls[buf[i]]];
+			s = (t >= 0) ? t : re_dfa_miss(d, s, buf[i]);
+			hit |= accept[s];
+		}
+		m->len += n;
+		buf += n;
+		if (!m->re->eol) {
+			m->hit |= hit;
+			m->matched |= hit;
+		}
+		hit = 0;
+		
+		if (buf < end && *buf == '\n') {
+			//	End of line, print or drop it and start over
+			if (m->re->eol && d->accept[s]) {
+				m->hit = m->matched = 1;
+			}
+			re_release(app, opt, 1);
+			if (!opt->opt_L || m->matched) {
+				print_byte_ascii(buf, app, opt);
+			}
+			buf++;
+			m->matched = 0;
+			m->line_start = 1;
+			s = d->start;
+		} else if (m->len == REGEX_HOLD_SIZE) {
+			//	Long lines are matched in pieces
+			re_release(app, opt, 0);
+		}
+	}
+	m->state = s;
+	
+	//	Release the text unless a match in progress may still reach back into it
+	if ((!opt->opt_L || m->matched) && m->len && !re_pending(m)) {
+		re_release(app, opt, 0);
+	}
+}
+
+//	Release held text on an idle gap or at the end of input, unless filtering and nothing matched yet
+void re_finish(app_context_t *app, cmd_options_t *opt) {
+	if (app->re && app->re->len && (!opt->opt_L || app->re->matched)) {
+		re_release(app, opt, 0);
+	}
+}
+
+#else
+
+//	Regex matching excluded from this build
+re_match_t *re_match_new(const char *pattern) {
+	return NULL;
+}
+
+void re_match_free(re_match_t *m) {
+}
+
+void re_feed(app_context_t *app, cmd_options_t *opt, uint8_t *buf, int len) {
+}
+
+void re_finish(app_context_t *app, cmd_options_t *opt) {
+}
+
+#endif	/* FEATURE_REGEX */
+
+#if FEATURE_BOOT
+//	Allocate a boot profiler for the '-B' milestones
+boot_profile_t *boot_new(cmd_options_t *opt, arena_t *arena) {
+	boot_profile_t *b = arena_alloc(arena, sizeof(boot_profile_t), ARENA_ALIGN);
+	int i;
+	
+	if (!b) {
+		fprintf(stderr, "%sError%s: Couldn't allocate boot profiler\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET);
+		return NULL;
+	}
+	b->names = opt->val_milestones;
+	b->count = opt->nmilestones;
+	for (i = 0; i < b->count; i++) {
+		kmp_init(&b->match[i], (const uint8_t *)b->names[i], strlen(b->names[i]));
+	}
+	b->armed = 1;
+	b->bol = 1;
+	return b;
+}
+
+int boot_compare(const void *a, const void *b) {
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+	return (x > y) - (x < y);
+}
+
+//	Nearest-rank percentile of a stage duration over the retained complete boots
+//	Stage 'count' is the total boot time
+int64_t boot_percentile(boot_profile_t *b, int stage, double p) {
+	static int64_t sorted[BOOT_MAX_SAMPLES];
+	uint32_t i, rank;
+	
+	if (!b->nsamples) {
+		return 0;
+	}
+	for (i = 0; i < b->nsamples; i++) {
+		sorted[i] = b->samples[i][stage];
+	}
+	qsort(sorted, b->nsamples, sizeof(int64_t), boot_compare);
+	rank = (uint32_t)(p / 100 * b->nsamples + 0.999999);
+	return sorted[(rank) ? rank - 1 : 0];
+}
+
+void boot_start(boot_profile_t *b, int64_t t0) {
+	b->t0 = t0;
+	b->armed = 0;
+	b->running = 1;
+	b->next = 0;
+	b->pos_next = 0;
+}
+
+//	End the current boot, record and print its stage times if it reached the last milestone
+void boot_end(app_context_t *app, int complete) {
+	boot_profile_t *b = app->boot;
+	int64_t stage, *sample;
+	int i;
+	
+	b->boots++;
+	b->running = 0;
+	b->pos_first = 0;
+	out_flush(&app->out);
+	if (!complete) {
+		fprintf(stderr, "\nBoot %u (%s) incomplete: reset before '%s' after %.3f s\n",
+			b->boots, app->path, b->names[b->next],
+			(double)b->at[b->next - 1] / NANOSECONDS_PER_SECOND);
+		return;
+	}
+	
+	sample = b->samples[b->complete % BOOT_MAX_SAMPLES];
+	for (i = 0; i < b->count; i++) {
+		stage = b->at[i] - ((i) ? b->at[i - 1] : 0);
+		sample[i] = stage;
+		b->sum[i] += stage;
+	}
+	sample[b->count] = b->at[b->count - 1];
+	b->sum[b->count] += b->at[b->count - 1];
+	b->complete++;
+	if (b->nsamples < BOOT_MAX_SAMPLES) {
+		b->nsamples++;
+	}
+	
+	fprintf(stderr, "\nBoot %u (%s): %.3f s\n  %-32s %10s %10s %10s %10s\n",
+		b->boots, app->path, (double)b->at[b->count - 1] / NANOSECONDS_PER_SECOND,
+		"Milestone", "At (s)", "Stage (s)", "p50 (s)", "p90 (s)");
+	for (i = 0; i < b->count; i++) {
+		fprintf(stderr, "  %-32.32s %10.3f %10.3f %10.3f %10.3f\n", b->names[i],
+			(double)b->at[i] / NANOSECONDS_PER_SECOND,
+			(double)sample[i] / NANOSECONDS_PER_SECOND,
+			(double)boot_percentile(b, i, 50) / NANOSECONDS_PER_SECOND,
+			(double)boot_percentile(b, i, 90) / NANOSECONDS_PER_SECOND);
+	}
+}
+
+//	Record the time of the next milestone
+void boot_milestone(app_context_t *app, int64_t t) {
+	boot_profile_t *b = app->boot;
+	b->at[b->next++] = t - b->t0;
+	b->pos_next = 0;
+	b->pos_first = 0;
+	if (b->next == b->count) {
+		boot_end(app, 1);
+	}
+}
+
+//	Match a received chunk against the milestones
+//	A boot starts with the first byte received at startup or after an idle gap ('-g') between
+//	boots; the first milestone showing up again after it has been passed is a reset, and the
+//	new boot is timed from the start of the line containing it
+void boot_feed(app_context_t *app, cmd_options_t *opt, const uint8_t *buf, int len) {
+	boot_profile_t *b = app->boot;
+	int64_t step, t = chunk_time(app, opt, len, &step), gap = (int64_t)opt->val_g * 1000000;
+	int i;
+	
+	if (opt->opt_g && !b->running && b->boots && t - b->last_t >= gap) {
+		b->armed = 1;
+	}
+	b->last_t = t + (int64_t)(len - 1) * step;
+	for (i = 0; i < len; i++, t += step) {
+		if (b->bol) {
+			b->line_t = t;
+		}
+		b->bol = (buf[i] == '\n');
+		if (b->armed) {
+			boot_start(b, t);
+		}
+		
+		//	Watch for the first milestone once it has been passed, or between boots
+		if (!b->running || b->next) {
+			b->pos_first = kmp_step(&b->match[0], b->pos_first, buf[i]);
+			if (b->pos_first == b->match[0].len) {
+				if (b->running) {
+					boot_end(app, 0);
+				}
+				boot_start(b, b->line_t);
+				boot_milestone(app, t);
+				continue;
+			}
+		}
+		if (b->running) {
+			b->pos_next = kmp_step(&b->match[b->next], b->pos_next, buf[i]);
+			if (b->pos_next == b->match[b->next].len) {
+				boot_milestone(app, t);
+			}
+		}
+	}
+}
+
+//	Print per-stage percentiles over all complete boots
+void boot_report(app_context_t *app) {
+	boot_profile_t *b = app->boot;
+	int i;
+	
+	if (!b->boots && !b->running) {
+		return;
+	}
+	fprintf(stderr, "Boot profile (%s): %u boots, %u complete%s\n",
+		app->path, b->boots, b->complete, (b->running) ? ", 1 in progress" : "");
+	if (!b->nsamples) {
+		return;
+	}
+	fprintf(stderr, "  %-32s %10s %10s %10s %10s %10s %10s\n",
+		"Stage (s)", "mean", "min", "p50", "p90", "p99", "max");
+	for (i = 0; i <= b->count; i++) {
+		fprintf(stderr, "  %-32.32s %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f\n",
+			(i < b->count) ? b->names[i] : "Total",
+			(double)b->sum[i] / b->complete / NANOSECONDS_PER_SECOND,
+			(double)boot_percentile(b, i, 0) / NANOSECONDS_PER_SECOND,
+			(double)boot_percentile(b, i, 50) / NANOSECONDS_PER_SECOND,
+			(double)boot_percentile(b, i, 90) / NANOSECONDS_PER_SECOND,
+			(double)boot_percentile(b, i, 99) / NANOSECONDS_PER_SECOND,
+			(double)boot_percentile(b, i, 100) / NANOSECONDS_PER_SECOND);
+	}
+}
+
+#else
+
+//	Boot profiler excluded from this build
+boot_profile_t *boot_new(cmd_options_t *opt, arena_t *arena) {
+	return NULL;
+}
+
+int64_t boot_percentile(boot_profile_t *b, int stage, double p) {
+	return 0;
+}
+
+void boot_feed(app_context_t *app, cmd_options_t *opt, const uint8_t *buf, int len) {
+}
+
+void boot_report(app_context_t *app) {
+}
+
+#endif	/* FEATURE_BOOT */
+
+//	Upper bounds (s) of the latency histogram buckets, a last bucket counts everything above
+const double clock_bounds[CLOCK_BUCKETS] = {
+	1e-5, 2e-5, 5e-5, 1e-4, 2e-4, 5e-4, 1e-3, 2e-3, 5e-3, 1e-2,
+	2e-2, 5e-2, 0.1, 0.2, 0.5, 1, 2, 5, 10
+};
+
+#if FEATURE_CLOCK
+
+//	Parse a '-D' device clock field, '<hz>[/<bytes>]:<prefix>'
+//	Without a byte count the field is ASCII decimal, otherwise a little-endian integer
+int clock_parse(cmd_options_t *opt, const char *spec) {
+	char *end;
+	int n;
+	
+	opt->val_D_hz = (uint32_t)strtoul(spec, &end, 10);
+	opt->val_D_width = 0;
+	if (*end == '/') {
+		opt->val_D_width = (uint8_t)strtoul(end + 1, &end, 10);
+		if (opt->val_D_width != 1 && opt->val_D_width != 2 && opt->val_D_width != 4 &&
+			opt->val_D_width != 8) {
+			return -1;
+		}
+	}
+	if (!opt->val_D_hz || *end != ':') {
+		return -1;
+	}
+	n = parse_bytes(end + 1, opt->val_D_prefix, KMP_MAX_LENGTH);
+	if (n <= 0) {
+		return -1;
+	}
+	opt->val_D_len = (uint8_t)n;
+	return 0;
+}
+
+clock_est_t *clock_new(cmd_options_t *opt) {
+	clock_est_t *c = calloc(1, sizeof(clock_est_t));
+	struct timespec real;
+	if (!c) {
+		fprintf(stderr, "%sError%s: Couldn't allocate clock estimator\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET);
+		return NULL;
+	}
+	kmp_init(&c->prefix, opt->val_D_prefix, opt->val_D_len);
+	c->hz = opt->val_D_hz;
+	c->width = opt->val_D_width;
+	
+	//	Offset of the realtime clock, so the latency floor can be compared with device epoch times
+	clock_gettime(CLOCK_REALTIME, &real);
+	c->epoch_ns = (int64_t)real.tv_sec * NANOSECONDS_PER_SECOND + real.tv_nsec - clock_mono_ns();
+	return c;
+}
+
+//	Fit one frame: 'host' (ns) received the device time 'ticks'
+//	With x = d and y = h - d (s, from the first frame), y = offset + drift * x is tracked by
+//	recursive least squares with exponential forgetting. Each frame is weighted with Huber's
+//	function of its residual, so frames delayed in transit barely move the fit
+void clock_frame(clock_est_t *c, int64_t host, uint64_t ticks) {
+	double x, y, e, w, px0, px1, den, k0, k1, lat, lim;
+	int i;
+	
+	if (!c->fitted) {
+		c->fit_start = c->frames;
+		c->have_floor = 0;
+		c->host0 = host;
+		c->ticks0 = ticks;
+		c->theta[0] = c->theta[1] = 0;
+		c->P[0] = c->P[2] = CLOCK_P0;
+		c->P[1] = 0;
+		c->scale = 0;
+		c->fitted = 1;
+	}
+	c->frames++;
+	x = (double)(ticks - c->ticks0) / c->hz;
+	y = (double)(host - c->host0) / NANOSECONDS_PER_SECOND - x;
+	
+	//	A priori residual, and its Huber weight against a running mean absolute residual
+	e = y - c->theta[0] - c->theta[1] * x;
+	lim = CLOCK_HUBER * ((c->scale > CLOCK_MIN_SCALE) ? c->scale : CLOCK_MIN_SCALE);
+	w = (fabs(e) <= lim) ? 1 : lim / fabs(e);
+	c->scale += CLOCK_SCALE_ALPHA * (fabs(e) - c->scale);
+	
+	//	Weighted RLS update, P is symmetric: [ P0 P1 ; P1 P2 ]
+	px0 = c->P[0] + c->P[1] * x;
+	px1 = c->P[1] + c->P[2] * x;
+	den = CLOCK_FORGET + w * (px0 + px1 * x);
+	k0 = w * px0 / den;
+	k1 = w * px1 / den;
+	c->theta[0] += k0 * e;
+	c->theta[1] += k1 * e;
+	c->P[0] = (c->P[0] - k0 * px0) / CLOCK_FORGET;
+	c->P[1] = (c->P[1] - k0 * px1) / CLOCK_FORGET;
+	c->P[2] = (c->P[2] - k1 * px1) / CLOCK_FORGET;
+	
+	//	Latency above the lowest residual seen, once the fit has settled
+	if (c->frames - c->fit_start < CLOCK_WARMUP) {
+		return;
+	}
+	e = y - c->theta[0] - c->theta[1] * x;
+	if (!c->have_floor || e < c->floor) {
+		c->floor = e;
+		c->have_floor = 1;
+	}
+	lat = e - c->floor;
+	for (i = 0; i < CLOCK_BUCKETS && lat > clock_bounds[i]; i++);
+	c->buckets[i]++;
+	c->latency_sum += lat;
+	c->latency_count++;
+	if (lat > c->latency_max) {
+		c->latency_max = lat;
+	}
+}
+
+//	Scan a received chunk for device clock fields
+void clock_feed(app_context_t *app, cmd_options_t *opt, const uint8_t *buf, int len) {
+	clock_est_t *c = app->clock;
+	int64_t step, t = chunk_time(app, opt, len, &step);
+	uint64_t ticks, mask;
+	int i;
+	
+	if (!app->cap_in.active) {
+		t += c->epoch_ns;
+	}
+	for (i = 0; i < len; i++, t += step) {
+		if (c->pos < c->prefix.len) {
+			c->pos = kmp_step(&c->prefix, c->pos, buf[i]);
+			c->field = 0;
+			c->digits = 0;
+			continue;
+		}
+		
+		//	Collect the field after the prefix
+		if (c->width) {
+			c->field |= (uint64_t)buf[i] << (8 * c->digits);
+			if (++c->digits < c->width) {
+				continue;
+			}
+		} else if (isdigit(buf[i]) && c->digits < 19) {
+			c->field = c->field * 10 + (buf[i] - '0');
+			c->digits++;
+			continue;
+		}
+		c->pos = 0;
+		if (!c->digits) {
+			c->pos = kmp_step(&c->prefix, 0, buf[i]);
+			continue;
+		}
+		
+		//	Unwrap binary counters narrower than 64 bits, a decimal field going back is a reset
+		if (c->width && c->width < 8 && c->fitted) {
+			mask = ((uint64_t)1 << (8 * c->width)) - 1;
+			ticks = c->ticks + ((c->field - c->ticks) & mask);
+		} else {
+			ticks = c->field;
+		}
+		if (c->fitted && ticks < c->ticks) {
+			c->resets++;
+			c->fitted = 0;
+		}
+		c->ticks = ticks;
+		clock_frame(c, t, ticks);
+		if (!c->width) {
+			c->pos = kmp_step(&c->prefix, 0, buf[i]);
+		}
+	}
+}
+
+//	Device clock rate against the host clock, the fit has host time = (1 + drift) * device time
+double clock_drift_ppm(clock_est_t *c) {
+	return (1 / (1 + c->theta[1]) - 1) * 1e6;
+}
+
+//	Latency percentile from the histogram, interpolated linearly within its bucket
+double clock_percentile(clock_est_t *c, double p) {
+	double rank = p / 100 * c->latency_count, lo = 0, hi;
+	uint64_t n = 0;
+	int i;
+	for (i = 0; i <= CLOCK_BUCKETS; i++) {
+		hi = (i < CLOCK_BUCKETS && clock_bounds[i] < c->latency_max) ? clock_bounds[i] : c->latency_max;
+		if (c->buckets[i] && n + c->buckets[i] >= rank) {
+			return lo + (hi - lo) * (rank - n) / c->buckets[i];
+		}
+		n += c->buckets[i];
+		lo = hi;
+	}
+	return c->latency_max;
+}
+
+//	Lowest host minus device time seen, drift-corrected, in s
+//	This is the minimum transport latency when the device counts time since the Unix epoch
+double clock_floor(clock_est_t *c) {
+	return (double)(c->host0 - (int64_t)((double)c->ticks0 / c->hz * NANOSECONDS_PER_SECOND)) /
+		NANOSECONDS_PER_SECOND + c->theta[0] + c->floor;
+}
+
+void clock_report(app_context_t *app) {
+	clock_est_t *c = app->clock;
+	if (!c->frames) {
+		return;
+	}
+	fprintf(stderr, "Clock (%s): %llu frames, %u resets, drift %+.3f ppm",
+		app->path, (unsigned long long)c->frames, c->resets, clock_drift_ppm(c));
+	if (c->latency_count) {
+		fprintf(stderr, ", latency floor %.6f s, above it p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms",
+			clock_floor(c), clock_percentile(c, 50) * 1e3, clock_percentile(c, 90) * 1e3,
+			clock_percentile(c, 99) * 1e3, c->latency_max * 1e3);
+	}
+	fputc('\n', stderr);
+}
+
+#else
+
+//	Device clock estimation excluded from this build
+int clock_parse(cmd_options_t *opt, const char *spec) {
+	return 0;
+}
+
+clock_est_t *clock_new(cmd_options_t *opt) {
+	return NULL;
+}
+
+void clock_feed(app_context_t *app, cmd_options_t *opt, const uint8_t *buf, int len) {
+}
+
+double clock_floor(clock_est_t *c) {
+	return 0;
+}
+
+double clock_drift_ppm(clock_est_t *c) {
+	return 0;
+}
+
+void clock_report(app_context_t *app) {
+}
+
+#endif	/* FEATURE_CLOCK */
+
+#if FEATURE_LIN
+//	Protected identifier: 6-bit ID with parity bits P0 = ID0^ID1^ID2^ID4, P1 = !(ID1^ID3^ID4^ID5)
+uint8_t lin_pid(uint8_t id) {
+	uint8_t p0 = ((id >> 0) ^ (id >> 1) ^ (id >> 2) ^ (id >> 4)) & 1;
+	uint8_t p1 = ~((id >> 1) ^ (id >> 3) ^ (id >> 4) ^ (id >> 5)) & 1;
+	return (uint8_t)(id | (p0 << 6) | (p1 << 7));
+}
+
+//	Inverted 8-bit sum with carry, over the data (classic) or the PID and data (enhanced)
+uint8_t lin_checksum(uint8_t pid, const uint8_t *data, int len, int enhanced) {
+	unsigned sum = (enhanced) ? pid : 0;
+	int i;
+	for (i = 0; i < len; i++) {
+		sum += data[i];
+		if (sum > 0xff) {
+			sum -= 0xff;
+		}
+	}
+	return (uint8_t)~sum;
+}
+
+lin_decoder_t *lin_new(void) {
+	lin_decoder_t *lin = calloc(1, sizeof(lin_decoder_t));
+	if (!lin) {
+		fprintf(stderr, "%sError%s: Couldn't allocate LIN decoder\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET);
+	}
+	return lin;
+}
+
+//	Print and account the current frame, if any
+void lin_end(app_context_t *app, cmd_options_t *opt) {
+	lin_decoder_t *lin = app->lin;
+	lin_id_stats_t *st = &lin->ids[lin->pid & 0x3f];
+	const char *err = NULL;
+	char line[256];
+	int n = 0, i, len = (lin->len) ? lin->len - 1 : 0, classic = 0, enhanced = 0;
+	uint8_t id = lin->pid & 0x3f;
+	double period = 0, delta;
+	
+	if (lin->state == LIN_IDLE) {
+		return;
+	}
+	n += snprintf(line + n, sizeof(line) - n, "%12.6f  ",
+		(double)(lin->t_break - lin->t_first) / NANOSECONDS_PER_SECOND);
+	if (lin->state == LIN_SYNC) {
+		err = "no sync";
+	} else if (lin->sync != LIN_SYNC_BYTE) {
+		n += snprintf(line + n, sizeof(line) - n, "sync 0x%02x", lin->sync);
+		err = "sync";
+	} else if (lin->state == LIN_PID) {
+		err = "no PID";
+	} else if (lin->pid != lin_pid(id)) {
+		n += snprintf(line + n, sizeof(line) - n, "PID 0x%02x", lin->pid);
+		err = "PID parity";
+	} else {
+		//	Schedule timing, from one header of this ID to the next (Welford's running variance)
+		if (st->headers++) {
+			period = (double)(lin->t_break - st->last) / 1e6;
+			delta = period - st->mean;
+			st->mean += delta / (st->headers - 1);
+			st->m2 += delta * (period - st->mean);
+			if (st->headers == 2 || period < st->min) {
+				st->min = period;
+			}
+			if (period > st->max) {
+				st->max = period;
+			}
+		}
+		st->last = lin->t_break;
+		
+		n += snprintf(line + n, sizeof(line) - n, "ID 0x%02x  PID 0x%02x  ", id, lin->pid);
+		if (!lin->len) {
+			n += snprintf(line + n, sizeof(line) - n, "no response");
+			st->no_response++;
+		} else {
+			n += snprintf(line + n, sizeof(line) - n, "[%d]", len);
+			for (i = 0; i < len; i++) {
+				n += snprintf(line + n, sizeof(line) - n, " %02x", lin->data[i]);
+			}
+			
+			//	Diagnostic frames always use the classic checksum
+			if (opt->val_l != LIN_CHECKSUM_ENHANCED || id >= LIN_DIAG_ID) {
+				classic = (lin->data[len] == lin_checksum(lin->pid, lin->data, len, 0));
+			}
+			if (opt->val_l != LIN_CHECKSUM_CLASSIC && id < LIN_DIAG_ID) {
+				enhanced = (lin->data[len] == lin_checksum(lin->pid, lin->data, len, 1));
+			}
+			n += snprintf(line + n, sizeof(line) - n, "  chk %02x%s", lin->data[len],
+				(enhanced) ? " enhanced" : (classic) ? " classic" : "");
+			if (!len) {
+				err = "short response";
+			} else if (!classic && !enhanced) {
+				err = "checksum";
+			} else {
+				st->model = (enhanced) ? LIN_CHECKSUM_ENHANCED : LIN_CHECKSUM_CLASSIC;
+			}
+		}
+		if (!err && lin->framing) {
+			err = "framing";
+		}
+		if (period) {
+			n += snprintf(line + n, sizeof(line) - n, "  +%.3f ms", period);
+		}
+		st->frames++;
+		st->errors += (err != NULL);
+	}
+	
+	lin->frames++;
+	lin->errors += (err != NULL);
+	if (n > (int)sizeof(line) - 1) {
+		n = sizeof(line) - 1;
+	}
+	out_write(&app->out, line, n);
+	if (err) {
+		n = snprintf(line, sizeof(line), "  %s%s error%s", (opt->opt_c) ? ESC_COLOR_MAGENTA : "", err,
+			(opt->opt_c) ? ESC_COLOR_RESET : "");
+		out_write(&app->out, line, n);
+	}
+	out_write(&app->out, "\n", 1);
+	lin->state = LIN_IDLE;
+}
+
+//	Feed one received byte, other than a BREAK
+void lin_byte(app_context_t *app, cmd_options_t *opt, uint8_t c) {
+	lin_decoder_t *lin = app->lin;
+	switch (lin->state) {
+		case LIN_SYNC:
+			lin->sync = c;
+			lin->state = LIN_PID;
+			break;
+		case LIN_PID:
+			lin->pid = c;
+			lin->len = 0;
+			lin->state = LIN_DATA;
+			break;
+		case LIN_DATA:
+			lin->data[lin->len++] = c;
+			if (lin->len == LIN_MAX_DATA + 1) {
+				lin_end(app, opt);
+			}
+			break;
+		default:
+			//	Bytes outside of a frame (no BREAK seen)
+			lin->stray++;
+			break;
+	}
+}
+
+//	Decode a received chunk, BREAKs and framing errors are marked by PARMRK
+//	as \377 \0 \0 and \377 \0 <byte>, and a \377 data byte is doubled
+void lin_feed(app_context_t *app, cmd_options_t *opt, const uint8_t *buf, int len) {
+	lin_decoder_t *lin = app->lin;
+	int64_t step, t = chunk_time(app, opt, len, &step);
+	uint8_t out[2];
+	int i, k, n;
+	
+	for (i = 0; i < len; i++, t += step) {
+		switch (parmrk_unescape(&lin->esc, buf[i], out, &n)) {
+			case PARMRK_MARK:
+				lin->framing = 1;
+				//	fall through
+			case PARMRK_DATA:
+				for (k = 0; k < n; k++) {
+					lin_byte(app, opt, out[k]);
+				}
+				break;
+			case PARMRK_BREAK:
+				//	Ends the current frame and starts the next header
+				lin_end(app, opt);
+				if (!lin->breaks++) {
+					lin->t_first = t;
+				}
+				lin->t_break = t;
+				lin->framing = 0;
+				lin->state = LIN_SYNC;
+				break;
+		}
+	}
+}
+
+//	Idle gap, the response of the current frame is over
+void lin_finish(app_context_t *app, cmd_options_t *opt) {
+	lin_end(app, opt);
+	out_flush(&app->out);
+}
+
+//	Print per-ID schedule statistics
+void lin_report(app_context_t *app) {
+	lin_decoder_t *lin = app->lin;
+	lin_id_stats_t *st;
+	int id;
+#if defined(__linux__) && defined(TIOCGICOUNT)
+	struct serial_icounter_struct ic;
+#endif	/* __linux__ && TIOCGICOUNT */
+	
+	fprintf(stderr, "LIN (%s): %llu breaks, %llu frames, %llu errors, %llu bytes outside frames\n",
+		app->path, (unsigned long long)lin->breaks, (unsigned long long)lin->frames,
+		(unsigned long long)lin->errors, (unsigned long long)lin->stray);
+#if defined(__linux__) && defined(TIOCGICOUNT)
+	if (app->tty >= 0 && !ioctl(app->tty, TIOCGICOUNT, &ic)) {
+		fprintf(stderr, "  Driver: %d breaks, %d framing errors, %d overruns\n",
+			ic.brk, ic.frame, ic.overrun + ic.buf_overrun);
+	}
+#endif	/* __linux__ && TIOCGICOUNT */
+	fprintf(stderr, "  %-4s %10s %8s %8s %12s %10s %10s %10s  %s\n", "ID", "Frames", "Errors",
+		"No resp", "Period (ms)", "Min", "Max", "Std dev", "Checksum");
+	for (id = 0; id < LIN_IDS; id++) {
+		st = &lin->ids[id];
+		if (!st->frames) {
+			continue;
+		}
+		fprintf(stderr, "  0x%02x %10llu %8llu %8llu %12.3f %10.3f %10.3f %10.3f  %s\n", id,
+			(unsigned long long)st->frames, (unsigned long long)st->errors,
+			(unsigned long long)st->no_response, st->mean, st->min, st->max,
+			(st->headers > 2) ? sqrt(st->m2 / (st->headers - 2)) : 0.0,
+			(st->model == LIN_CHECKSUM_ENHANCED) ? "enhanced" : (st->model) ? "classic" : "-");
+	}
+}
+
+#else
+
+//	LIN decoder excluded from this build
+lin_decoder_t *lin_new(void) {
+	return NULL;
+}
+
+void lin_feed(app_context_t *app, cmd_options_t *opt, const uint8_t *buf, int len) {
+}
+
+void lin_finish(app_context_t *app, cmd_options_t *opt) {
+}
+
+void lin_report(app_context_t *app) {
+}
+
+#endif	/* FEATURE_LIN */
+
+#if FEATURE_RS485
+//	Parse '-N' RS-485 addresses, a comma-separated list of 'all', addresses to show (decimal or
+//	0x hex) and 'demux=<prefix>'
+int rs485_parse(cmd_options_t *opt, const char *spec) {
+	char *s = strdup(spec), *tok, *rest, *end;
+	long a;
+	int rc = 0;
+	
+	for (tok = strtok_r(s, ",", &rest); tok && !rc; tok = strtok_r(NULL, ",", &rest)) {
+		if (!strncmp(tok, "demux=", 6)) {
+			free(opt->val_N_demux);
+			opt->val_N_demux = strdup(tok + 6);
+			rc = !tok[6];
+		} else if (!strcmp(tok, "all")) {
+			memset(opt->val_N_show, 0xff, sizeof(opt->val_N_show));
+		} else {
+			a = strtol(tok, &end, 0);
+			if (end == tok || *end || a < 0 || a >= RS485_ADDRESSES) {
+				rc = -1;
+				break;
+			}
+			opt->val_N_show[a >> 3] |= (uint8_t)(1 << (a & 7));
+		}
+	}
+	free(s);
+	return rc;
+}
+
+rs485_decoder_t *rs485_new(int port, arena_t *arena) {
+	rs485_decoder_t *d = arena_alloc(arena, sizeof(rs485_decoder_t), ARENA_ALIGN);
+	if (!d) {
+		fprintf(stderr, "%sError%s: Couldn't allocate RS-485 decoder\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET);
+		return NULL;
+	}
+	d->port = port;
+	return d;
+}
+
+//	Write a byte to the address's '<prefix>[.<port>].<address>' stream, opened on first use
+void rs485_demux(app_context_t *app, cmd_options_t *opt, rs485_node_t *node, uint8_t c) {
+	rs485_decoder_t *d = app->rs485;
+	char name[4096];
+	
+	if (!node->demux) {
+		if (opt->nports > 1) {
+			snprintf(name, sizeof(name), "%s.%d.%02x", opt->val_N_demux, d->port, d->addr);
+		} else {
+			snprintf(name, sizeof(name), "%s.%02x", opt->val_N_demux, d->addr);
+		}
+		if (!(node->demux = fopen(name, "wb"))) {
+			fprintf(stderr, "%sError%s: Couldn't open RS-485 stream '%s': %s\n",
+				ESC_COLOR_MAGENTA,
+				ESC_COLOR_RESET,
+				name, strerror(errno));
+			return;
+		}
+	}
+	fputc(c, node->demux);
+}
+
+//	Print the current segment, if any and its address is shown
+void rs485_end(app_context_t *app, cmd_options_t *opt) {
+	rs485_decoder_t *d = app->rs485;
+	char line[256];
+	int n = 0, i, len = (d->len < RS485_SHOW_BYTES) ? (int)d->len : RS485_SHOW_BYTES;
+	
+	if (!d->active) {
+		return;
+	}
+	d->active = 0;
+	
+	//	A node answers once, data after its response is outside any segment
+	if (d->response) {
+		d->addressed = 0;
+	}
+	if (!(opt->val_N_show[d->addr >> 3] & (1 << (d->addr & 7)))) {
+		return;
+	}
+	n += snprintf(line + n, sizeof(line) - n, "%12.6f  0x%02x %s%c%s  [%u]",
+		(double)(d->t_start - d->t_first) / NANOSECONDS_PER_SECOND, d->addr,
+		(opt->opt_c) ? ((d->response) ? ESC_COLOR_YELLOW : ESC_COLOR_GREEN) : "",
+		(d->response) ? '<' : '>', (opt->opt_c) ? ESC_COLOR_RESET : "", d->len);
+	for (i = 0; i < len; i++) {
+		n += snprintf(line + n, sizeof(line) - n, " %02x", d->data[i]);
+	}
+	if (d->len > RS485_SHOW_BYTES) {
+		n += snprintf(line + n, sizeof(line) - n, " ...");
+	}
+	if (d->response) {
+		n += snprintf(line + n, sizeof(line) - n, "  +%.3f ms", (double)d->turnaround / 1e6);
+	}
+	if (n > (int)sizeof(line) - 1) {
+		n = sizeof(line) - 1;
+	}
+	out_write(&app->out, line, n);
+	out_write(&app->out, "\n", 1);
+}
+
+//	Feed one received character, 'addr' when its 9th bit was set, 't' the end of its reception
+void rs485_byte(app_context_t *app, cmd_options_t *opt, uint8_t c, uint8_t addr, int64_t t, int64_t step) {
+	rs485_decoder_t *d = app->rs485;
+	rs485_node_t *node;
+	double ms, delta;
+	
+	//	An idle gap ends the current segment
+	if (d->active && t - step - d->t_last >= step * RS485_GAP_CHARS) {
+		rs485_end(app, opt);
+	}
+	if (addr) {
+		rs485_end(app, opt);
+		if (!d->segments++) {
+			d->t_first = t;
+		}
+		d->addr = c;
+		d->addressed = 1;
+		d->response = 0;
+		d->active = 1;
+		d->t_start = d->t_last = t;
+		d->len = 0;
+		d->nodes[c].requests++;
+		return;
+	}
+	node = &d->nodes[d->addr];
+	if (!d->active) {
+		if (!d->addressed) {
+			d->stray++;
+			d->t_last = t;
+			return;
+		}
+		
+		//	The addressed node's response, timed from the end of the request to the start of
+		//	its first character (Welford's running variance)
+		d->turnaround = t - step - d->t_last;
+		if (d->turnaround < 0) {
+			d->turnaround = 0;
+		}
+		ms = (double)d->turnaround / 1e6;
+		node->responses++;
+		delta = ms - node->mean;
+		node->mean += delta / node->responses;
+		node->m2 += delta * (ms - node->mean);
+		if (node->responses == 1 || ms < node->min) {
+			node->min = ms;
+		}
+		if (ms > node->max) {
+			node->max = ms;
+		}
+		d->segments++;
+		d->response = 1;
+		d->active = 1;
+		d->t_start = t;
+		d->len = 0;
+	}
+	if (d->len < RS485_SHOW_BYTES) {
+		d->data[d->len] = c;
+	}
+	d->len++;
+	if (d->response) {
+		node->resp_bytes++;
+	} else {
+		node->req_bytes++;
+	}
+	if (opt->val_N_demux) {
+		rs485_demux(app, opt, node, c);
+	}
+	d->t_last = t;
+}
+
+//	Decode a received chunk, address bytes fail the space parity check and are marked by PARMRK
+//	as \377 \0 <byte>, and a \377 data byte is doubled
+void rs485_feed(app_context_t *app, cmd_options_t *opt, const uint8_t *buf, int len) {
+	rs485_decoder_t *d = app->rs485;
+	int64_t step, t = chunk_time(app, opt, len, &step);
+	uint8_t out[2];
+	int i, k, n, addr;
+	
+	for (i = 0; i < len; i++, t += step) {
+		//	Address bytes are marked, address 0 is indistinguishable from a BREAK
+		addr = parmrk_unescape(&d->esc, buf[i], out, &n) >= PARMRK_MARK;
+		for (k = 0; k < n; k++) {
+			rs485_byte(app, opt, out[k], addr, t, step);
+		}
+	}
+}
+
+//	Idle gap, the current segment is over
+void rs485_finish(app_context_t *app, cmd_options_t *opt) {
+	rs485_end(app, opt);
+	out_flush(&app->out);
+}
+
+//	Print per-address traffic and turnaround statistics
+void rs485_report(app_context_t *app) {
+	rs485_decoder_t *d = app->rs485;
+	rs485_node_t *node;
+	int a;
+	
+	fprintf(stderr, "RS-485 (%s): %llu segments, %llu bytes outside requests and responses\n",
+		app->path, (unsigned long long)d->segments, (unsigned long long)d->stray);
+	fprintf(stderr, "  %-4s %10s %10s %8s %12s %12s %12s %10s %10s %10s\n", "Addr", "Requests",
+		"Responses", "No resp", "Req bytes", "Resp bytes", "Turn (ms)", "Min", "Max", "Std dev");
+	for (a = 0; a < RS485_ADDRESSES; a++) {
+		node = &d->nodes[a];
+		if (!node->requests) {
+			continue;
+		}
+		fprintf(stderr, "  0x%02x %10llu %10llu %8llu %12llu %12llu %12.3f %10.3f %10.3f %10.3f\n", a,
+			(unsigned long long)node->requests, (unsigned long long)node->responses,
+			(unsigned long long)(node->requests - node->responses),
+			(unsigned long long)node->req_bytes, (unsigned long long)node->resp_bytes,
+			node->mean, node->min, node->max,
+			(node->responses > 1) ? sqrt(node->m2 / (node->responses - 1)) : 0.0);
+	}
+}
+
+//	Close the per-address streams
+void rs485_close(rs485_decoder_t *d) {
+	int a;
+	for (a = 0; a < RS485_ADDRESSES; a++) {
+		if (d->nodes[a].demux) {
+			fclose(d->nodes[a].demux);
+			d->nodes[a].demux = NULL;
+		}
+	}
+}
+
+#else
+
+//	RS-485 decoder excluded from this build
+int rs485_parse(cmd_options_t *opt, const char *spec) {
+	return 0;
+}
+
+rs485_decoder_t *rs485_new(int port, arena_t *arena) {
+	return NULL;
+}
+
+void rs485_feed(app_context_t *app, cmd_options_t *opt, const uint8_t *buf, int len) {
+}
+
+void rs485_finish(app_context_t *app, cmd_options_t *opt) {
+}
+
+void rs485_report(app_context_t *app) {
+}
+
+void rs485_close(rs485_decoder_t *d) {
+}
+
+#endif	/* FEATURE_RS485 */
+
+//	Anomaly detector names, units and the smallest standard deviation a z-score is taken against
+const char *anomaly_names[ANOMALY_DETECTORS] = { "gap", "rate", "errors" };
+const char *anomaly_units[ANOMALY_DETECTORS] = { "s", "B/s", "errors/s" };
+const double anomaly_min_sd[ANOMALY_DETECTORS] = { 1e-3, 1, 0.1 };
+
+#if FEATURE_ANOMALY
+//	Parse an '-A' anomaly spec, a comma-separated list of '<z>' (all detectors),
+//	'<detector>=<z>' and 'capture=<prefix>'
+int anomaly_parse(cmd_options_t *opt, const char *spec) {
+	char *s = strdup(spec), *tok, *rest, *val, *end;
+	double z;
+	int k, rc = 0;
+	
+	for (tok = strtok_r(s, ",", &rest); tok && !rc; tok = strtok_r(NULL, ",", &rest)) {
+		val = strchr(tok, '=');
+		if (val) {
+			*val++ = '\0';
+		}
+		if (val && !strcmp(tok, "capture")) {
+			free(opt->val_A_capture);
+			opt->val_A_capture = strdup(val);
+			rc = !*val;
+			continue;
+		}
+		z = strtod((val) ? val : tok, &end);
+		if (*end || z <= 0) {
+			rc = -1;
+			break;
+		}
+		for (k = 0; k < ANOMALY_DETECTORS; k++) {
+			if (!val || !strcmp(tok, anomaly_names[k])) {
+				opt->val_A_z[k] = z;
+				if (val) {
+					break;
+				}
+			}
+		}
+		rc = (k == ANOMALY_DETECTORS && val) ? -1 : 0;
+	}
+	free(s);
+	return rc;
+}
+
+anomaly_t *anomaly_new(cmd_options_t *opt, int port, arena_t *arena) {
+	anomaly_t *a = arena_alloc(arena, sizeof(anomaly_t), ARENA_ALIGN);
+	if (a && opt->val_A_capture && !(a->ring = arena_alloc(arena, ANOMALY_RING_SIZE, ARENA_ALIGN))) {
+		a = NULL;
+	}
+	if (!a) {
+		fprintf(stderr, "%sError%s: Couldn't allocate anomaly detectors\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET);
+		return NULL;
+	}
+	a->port = port;
+	return a;
+}
+
+//	Errors seen on a port so far, by the LIN decoder and (for devices on Linux) by the driver
+uint64_t anomaly_errors(app_context_t *app) {
+	uint64_t n = (app->lin) ? app->lin->errors : 0;
+#if defined(__linux__) && defined(TIOCGICOUNT)
+	struct serial_icounter_struct ic;
+	if (!app->cap_in.active && app->tty >= 0 && !ioctl(app->tty, TIOCGICOUNT, &ic)) {
+		n += (uint64_t)ic.frame + ic.parity + ic.overrun + ic.buf_overrun;
+	}
+#endif	/* __linux__ && TIOCGICOUNT */
+	return n;
+}
+
+//	Write the bytes received before an alert to '<prefix>[.<port>].<alert>'
+void anomaly_capture(app_context_t *app, cmd_options_t *opt) {
+	anomaly_t *a = app->anomaly;
+	char name[4096];
+	size_t head = a->ring_len % ANOMALY_RING_SIZE;
+	FILE *f;
+	
+	if (opt->nports > 1) {
+		snprintf(name, sizeof(name), "%s.%d.%u", opt->val_A_capture, a->port, a->captures);
+	} else {
+		snprintf(name, sizeof(name), "%s.%u", opt->val_A_capture, a->captures);
+	}
+	f = fopen(name, "wb");
+	if (!f) {
+		fprintf(stderr, "%sError%s: Couldn't open anomaly capture '%s': %s\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET,
+			name, strerror(errno));
+		return;
+	}
+	if (a->ring_len > ANOMALY_RING_SIZE) {
+		fwrite(a->ring + head, sizeof(uint8_t), ANOMALY_RING_SIZE - head, f);
+	}
+	fwrite(a->ring, sizeof(uint8_t), head, f);
+	fclose(f);
+	a->captures++;
+	fprintf(stderr, "  Wrote the last %llu bytes to %s\n", (unsigned long long)((a->ring_len >
+		ANOMALY_RING_SIZE) ? ANOMALY_RING_SIZE : a->ring_len), name);
+}
+
+//	Score one observation against the detector's EWMA mean and variance, then update them
+//	Once warmed up, observations are clamped to the bounds first, so an outlier moves the
+//	estimates no more than one at the bound would
+void anomaly_observe(app_context_t *app, cmd_options_t *opt, int k, double x) {
+	anomaly_t *a = app->anomaly;
+	ewma_detector_t *d = &a->det[k];
+	double lim = opt->val_A_z[k], sd, diff, incr;
+	uint8_t out;
+	
+	if (!lim) {
+		return;
+	}
+	if (d->n >= ANOMALY_WARMUP) {
+		sd = sqrt(d->var);
+		if (sd < ANOMALY_MIN_DEV * fabs(d->mean)) {
+			sd = ANOMALY_MIN_DEV * fabs(d->mean);
+		}
+		if (sd < anomaly_min_sd[k]) {
+			sd = anomaly_min_sd[k];
+		}
+		d->z = (x - d->mean) / sd;
+		
+		//	Gaps and errors only alert when high, the byte rate in both directions
+		out = (d->z > lim || (k == ANOMALY_RATE && d->z < -lim));
+		if (out && !d->out) {
+			d->alerts++;
+			a->alerted = 1;
+			out_flush(&app->out);
+			fprintf(stderr, "\n%sAnomaly%s (%s): %s %.6g %s, z %+.1f against mean %.6g, sd %.6g\n",
+				(opt->opt_c) ? ESC_COLOR_YELLOW : "", (opt->opt_c) ? ESC_COLOR_RESET : "",
+				app->path, anomaly_names[k], x, anomaly_units[k], d->z, d->mean, sd);
+			if (a->ring) {
+				anomaly_capture(app, opt);
+			}
+		}
+		d->out = out;
+		if (x > d->mean + lim * sd) {
+			x = d->mean + lim * sd;
+		} else if (x < d->mean - lim * sd) {
+			x = d->mean - lim * sd;
+		}
+	}
+	if (!d->n++) {
+		d->mean = x;
+		return;
+	}
+	diff = x - d->mean;
+	incr = ANOMALY_ALPHA * diff;
+	d->mean += incr;
+	d->var = (1 - ANOMALY_ALPHA) * (d->var + diff * incr);
+}
+
+//	Close every rate window which has ended by 't'
+void anomaly_tick(app_context_t *app, cmd_options_t *opt, int64_t t) {
+	anomaly_t *a = app->anomaly;
+	uint64_t errors;
+	
+	if (!a->win_end) {
+		return;
+	}
+	while (t >= a->win_end) {
+		errors = anomaly_errors(app);
+		anomaly_observe(app, opt, ANOMALY_RATE, (double)a->win_bytes * 1000 / ANOMALY_WINDOW_MS);
+		anomaly_observe(app, opt, ANOMALY_ERRORS, (double)(errors - a->errors) * 1000 / ANOMALY_WINDOW_MS);
+		a->errors = errors;
+		a->win_bytes = 0;
+		a->win_end += (int64_t)ANOMALY_WINDOW_MS * 1000000;
+	}
+}
+
+//	Arm the window timer for the end of the current window
+void anomaly_arm(app_context_t *app) {
+	anomaly_t *a = app->anomaly;
+	if (a->win_end) {
+		timer_arm(&a->timer, a->win_end, (int64_t)ANOMALY_WINDOW_MS * 1000000 / IDLE_SLACK_DIVISOR);
+	}
+}
+
+//	Observe the gap before a chunk if it starts a new message, and count its bytes
+void anomaly_feed(app_context_t *app, cmd_options_t *opt, const uint8_t *buf, int len) {
+	anomaly_t *a = app->anomaly;
+	int64_t step, t = chunk_time(app, opt, len, &step), gap;
+	size_t head, n;
+	
+	anomaly_tick(app, opt, t);
+	if (!a->win_end) {
+		a->win_end = t + (int64_t)ANOMALY_WINDOW_MS * 1000000;
+		a->errors = anomaly_errors(app);
+	}
+	
+	//	Messages are separated by the '-g' idle gap, or by ANOMALY_GAP_CHARS character times
+	gap = (opt->opt_g) ? (int64_t)opt->val_g * 1000000 : step * ANOMALY_GAP_CHARS;
+	if (gap < ANOMALY_MIN_GAP_NS) {
+		gap = ANOMALY_MIN_GAP_NS;
+	}
+	if (a->last_t && t - a->last_t >= gap) {
+		anomaly_observe(app, opt, ANOMALY_GAP, (double)(t - a->last_t) / NANOSECONDS_PER_SECOND);
+	}
+	a->last_t = t + (int64_t)(len - 1) * step;
+	a->win_bytes += len;
+	
+	//	Keep the most recent bytes for alert captures
+	if (a->ring) {
+		if (len > ANOMALY_RING_SIZE) {
+			a->ring_len += len - ANOMALY_RING_SIZE;
+			buf += len - ANOMALY_RING_SIZE;
+			len = ANOMALY_RING_SIZE;
+		}
+		head = a->ring_len % ANOMALY_RING_SIZE;
+		n = (ANOMALY_RING_SIZE - head < (size_t)len) ? ANOMALY_RING_SIZE - head : (size_t)len;
+		memcpy(a->ring + head, buf, n);
+		memcpy(a->ring, buf + n, len - n);
+		a->ring_len += len;
+	}
+	anomaly_arm(app);
+}
+
+//	Window timer, closes rate windows while a port is silent
+void anomaly_timer(void *arg, cmd_options_t *opt) {
+	app_context_t *app = (app_context_t *)arg;
+	anomaly_t *a = app->anomaly;
+	
+	if (app->state != PORT_READY || !a->win_end) {
+		return;
+	}
+	anomaly_tick(app, opt, clock_mono_ns());
+	fflush(stderr);
+	anomaly_arm(app);
+}
+
+//	Return whether any port raised an alert since the last call
+int anomaly_alerted(session_t *ses) {
+	int i, alerted = 0;
+	for (i = 0; i < ses->nports; i++) {
+		if (ses->ports[i].anomaly && ses->ports[i].anomaly->alerted) {
+			ses->ports[i].anomaly->alerted = 0;
+			alerted = 1;
+		}
+	}
+	return alerted;
+}
+
+void anomaly_report(app_context_t *app, cmd_options_t *opt) {
+	anomaly_t *a = app->anomaly;
+	ewma_detector_t *d;
+	int k;
+	
+	fprintf(stderr, "Anomalies (%s): %u captures\n  %-8s %12s %12s %12s %8s %8s\n", app->path,
+		a->captures, "Detector", "Samples", "Mean", "Std dev", "Limit", "Alerts");
+	for (k = 0; k < ANOMALY_DETECTORS; k++) {
+		d = &a->det[k];
+		if (opt->val_A_z[k]) {
+			fprintf(stderr, "  %-8s %12llu %12.6g %12.6g %8.1f %8llu\n", anomaly_names[k],
+				(unsigned long long)d->n, d->mean, sqrt(d->var), opt->val_A_z[k],
+				(unsigned long long)d->alerts);
+		}
+	}
+}
+
+#else
+
+//	Anomaly detection excluded from this build
+int anomaly_parse(cmd_options_t *opt, const char *spec) {
+	return 0;
+}
+
+anomaly_t *anomaly_new(cmd_options_t *opt, int port, arena_t *arena) {
+	return NULL;
+}
+
+void anomaly_feed(app_context_t *app, cmd_options_t *opt, const uint8_t *buf, int len) {
+}
+
+void anomaly_timer(void *arg, cmd_options_t *opt) {
+}
+
+void anomaly_arm(app_context_t *app) {
+}
+
+int anomaly_alerted(session_t *ses) {
+	return 0;
+}
+
+void anomaly_report(app_context_t *app, cmd_options_t *opt) {
+}
+
+#endif	/* FEATURE_ANOMALY */
+
+#if FEATURE_PLOT
+//	Exact powers of ten, a mantissa below 2^53 scaled by one of these is correctly rounded
+static const double plot_pow10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+static const char plot_glyphs[PLOT_MAX_SERIES] = { '*', '+', 'o', '#', 'x', '%', '@', '=' };
+static const char *plot_colors[PLOT_MAX_SERIES] = {
+	"\033[32m", "\033[35m", "\033[36m", "\033[93m", "\033[94m", "\033[31m", "\033[37m", "\033[33m"
+};
+
+//	Ring slot of a column
+static inline int plot_slot(int64_t col) {
+	return (int)(((col % PLOT_MAX_WIDTH) + PLOT_MAX_WIDTH) % PLOT_MAX_WIDTH);
+}
+
+//	Parse a '-G' plot spec, 'all' or a comma-separated list of 1-based fields, then '@<fps>'
+int plot_parse(cmd_options_t *opt, const char *spec) {
+	const char *p = spec;
+	char *end;
+	long v;
+	
+	opt->nplot = 0;
+	opt->val_G_fps = PLOT_DEF_FPS;
+	if (!strncmp(p, "all", 3)) {
+		for (; opt->nplot < PLOT_MAX_SERIES; opt->nplot++) {
+			opt->val_G_fields[opt->nplot] = opt->nplot;
+		}
+		p += 3;
+	} else {
+		do {
+			v = strtol(p, &end, 10);
+			if (end == p || v < 1 || v > PLOT_MAX_FIELDS || opt->nplot == PLOT_MAX_SERIES) {
+				return -1;
+			}
+			opt->val_G_fields[opt->nplot++] = (uint8_t)(v - 1);
+			p = end;
+		} while (*p == ',' && *++p);
+	}
+	if (*p == '@') {
+		v = strtol(p + 1, &end, 10);
+		if (end == p + 1 || v < 1 || v > PLOT_MAX_FPS) {
+			return -1;
+		}
+		opt->val_G_fps = (uint8_t)v;
+		p = end;
+	}
+	return (*p) ? -1 : 0;
+}
+
+plot_t *plot_new(cmd_options_t *opt, int port, int nports, ev_timer_t *frame, arena_t *arena) {
+	plot_t *pl = arena_alloc(arena, sizeof(plot_t), ARENA_ALIGN);
+	struct winsize ws;
+	int rows = PLOT_DEF_ROWS, cols = PLOT_DEF_COLS, i;
+	
+	if (!pl) {
+		fprintf(stderr, "%sError%s: Couldn't allocate plot\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET);
+		return NULL;
+	}
+	if (!ioctl(STDERR_FILENO, TIOCGWINSZ, &ws) && ws.ws_row && ws.ws_col) {
+		rows = ws.ws_row;
+		cols = ws.ws_col;
+	}
+	
+	//	Each port gets a band of the terminal, a title line above the plot area
+	pl->height = (rows - 1) / nports;
+	if (pl->height < PLOT_MIN_ROWS) {
+		pl->height = PLOT_MIN_ROWS;
+	}
+	pl->top = 1 + port * pl->height;
+	pl->height--;
+	pl->width = cols - PLOT_GUTTER;
+	if (pl->width > PLOT_MAX_WIDTH) {
+		pl->width = PLOT_MAX_WIDTH;
+	}
+	if (pl->width < 1) {
+		pl->width = 1;
+	}
+	memset(pl->series, 0xff, sizeof(pl->series));
+	for (i = 0; i < opt->nplot; i++) {
+		pl->series[opt->val_G_fields[i]] = (int8_t)i;
+		pl->fields[i] = opt->val_G_fields[i];
+	}
+	pl->nseries = opt->nplot;
+	pl->col_ns = NANOSECONDS_PER_SECOND / opt->val_G_fps;
+	pl->cur = -1;
+	pl->last_col = INT64_MIN;
+	pl->frame = frame;
+	return pl;
+}
+
+//	Move to column 'col' (time / col_ns), clearing the columns which were skipped
+void plot_advance(plot_t *pl, int64_t col) {
+	int64_t c = (pl->cur < 0 || col - pl->cur > PLOT_MAX_WIDTH) ? col - PLOT_MAX_WIDTH : pl->cur;
+	int s, k;
+	
+	if (col <= pl->cur) {
+		return;
+	}
+	while (c < col) {
+		k = plot_slot(++c);
+		for (s = 0; s < PLOT_MAX_SERIES; s++) {
+			pl->lo[k][s] = INFINITY;
+			pl->hi[k][s] = -INFINITY;
+		}
+	}
+	pl->cur = col;
+}
+
+//	Finish the number being parsed, as field 'field' of the line, received at 't'
+void plot_number(plot_t *pl, int64_t t) {
+	int e = pl->exp10 + ((pl->exp_neg) ? -pl->exp_val : pl->exp_val), s, k;
+	double v = (double)pl->mant;
+	float f;
+	
+	pl->in_num = 0;
+	if (!pl->digits) {
+		return;
+	}
+	
+	//	Exact in one multiplication or division for up to 15 digits (Clinger's fast path)
+	if (e >= 0 && e <= 22) {
+		v *= plot_pow10[e];
+	} else if (e < 0 && e >= -22) {
+		v /= plot_pow10[-e];
+	} else {
+		v *= pow(10, e);
+	}
+	if (pl->neg) {
+		v = -v;
+	}
+	pl->values++;
+	if (pl->field >= PLOT_MAX_FIELDS || (s = pl->series[pl->field++]) < 0) {
+		return;
+	}
+	plot_advance(pl, t / pl->col_ns);
+	k = plot_slot(t / pl->col_ns);
+	pl->last_col = t / pl->col_ns;
+	f = (float)v;
+	if (f < pl->lo[k][s]) {
+		pl->lo[k][s] = f;
+	}
+	if (f > pl->hi[k][s]) {
+		pl->hi[k][s] = f;
+	}
+	pl->last[s] = f;
+}
+
+//	Parse numbers from a received chunk, fields are the numbers of a line in order, text between
+//	them is ignored. The parser state is kept across chunks
+void plot_feed(app_context_t *app, cmd_options_t *opt, const uint8_t *buf, int len) {
+	plot_t *pl = app->plot;
+	int64_t step, t = chunk_time(app, opt, len, &step);
+	uint8_t c;
+	int i, d;
+	
+	for (i = 0; i < len; i++) {
+		c = buf[i];
+		d = c - '0';
+		if (d >= 0 && d <= 9) {
+			if (!pl->in_num) {
+				pl->in_num = 1;
+				pl->neg = pl->frac = pl->exp = pl->exp_neg = pl->digits = 0;
+				pl->mant = 0;
+				pl->ndig = pl->exp10 = pl->exp_val = 0;
+			}
+			if (pl->exp) {
+				pl->exp = 2;
+				if (pl->exp_val < PLOT_MAX_EXPONENT) {
+					pl->exp_val = pl->exp_val * 10 + d;
+				}
+				continue;
+			}
+			pl->digits = 1;
+			if (pl->ndig < PLOT_MAX_DIGITS) {
+				pl->mant = pl->mant * 10 + d;
+				pl->ndig += (pl->mant != 0);
+				pl->exp10 -= pl->frac;
+			} else {
+				pl->exp10 += !pl->frac;
+			}
+			continue;
+		}
+		if (pl->in_num) {
+			if (c == '.' && !pl->frac && !pl->exp) {
+				pl->frac = 1;
+				continue;
+			}
+			if ((c == 'e' || c == 'E') && pl->digits && !pl->exp) {
+				pl->exp = 1;
+				continue;
+			}
+			if ((c == '-' || c == '+') && pl->exp == 1) {
+				pl->exp_neg = (c == '-');
+				pl->exp = 2;
+				continue;
+			}
+			plot_number(pl, t + i * step);
+		}
+		if (c == '-' || c == '+' || c == '.') {
+			//	Sign or leading decimal point of the next number
+			pl->in_num = 1;
+			pl->neg = (c == '-');
+			pl->frac = (c == '.');
+			pl->exp = pl->exp_neg = pl->digits = 0;
+			pl->mant = 0;
+			pl->ndig = pl->exp10 = pl->exp_val = 0;
+		} else if (c == '\n') {
+			pl->field = 0;
+			pl->lines++;
+		}
+	}
+	
+	//	Restart the frame timer if the plots had come to rest
+	if (!pl->frame->deadline) {
+		timer_arm(pl->frame, clock_mono_ns() + NANOSECONDS_PER_SECOND / opt->val_G_fps, 0);
+	}
+}
+
+//	Draw the columns up to 'now' into the port's band of the terminal, each column is a bar from
+//	the minimum to the maximum of the samples of its time slice (so spikes are never dropped)
+void plot_render(app_context_t *app, cmd_options_t *opt, int64_t now) {
+	plot_t *pl = app->plot;
+	char line[PLOT_LINE_SIZE];
+	double ymin = INFINITY, ymax = -INFINITY, row_hi, row_lo, dy;
+	int64_t first;
+	int r, x, s, k, n, color = -1, hit;
+	
+	if (now >= 0) {
+		plot_advance(pl, now / pl->col_ns);
+	}
+	if (pl->cur < 0) {
+		return;
+	}
+	first = pl->cur - pl->width + 1;
+	for (x = 0; x < pl->width; x++) {
+		k = plot_slot(first + x);
+		for (s = 0; s < pl->nseries; s++) {
+			if (pl->lo[k][s] < ymin) {
+				ymin = pl->lo[k][s];
+			}
+			if (pl->hi[k][s] > ymax) {
+				ymax = pl->hi[k][s];
+			}
+		}
+	}
+	if (ymin > ymax) {
+		ymin = ymax = 0;
+	}
+	if (ymax - ymin < PLOT_MIN_RANGE * (fabs(ymin) + fabs(ymax)) || ymax == ymin) {
+		ymin -= 1;
+		ymax += 1;
+	}
+	dy = (ymax - ymin) / pl->height;
+	
+	//	Title line: port, range and the last value of each series
+	n = snprintf(line, sizeof(line), "\033[%d;1H%.*s:", pl->top, PLOT_TITLE_MAX, app->path);
+	for (s = 0; s < pl->nseries; s++) {
+		n += snprintf(line + n, sizeof(line) - n, "  %s%c%s %d = %.6g", (opt->opt_c) ? plot_colors[s] : "",
+			plot_glyphs[s], (opt->opt_c) ? ESC_COLOR_RESET : "", pl->fields[s] + 1, pl->last[s]);
+	}
+	n += snprintf(line + n, sizeof(line) - n, "\033[K");
+	out_write(&app->out, line, n);
+	
+	for (r = 0; r < pl->height; r++) {
+		row_hi = ymax - r * dy;
+		row_lo = row_hi - dy;
+		
+		//	Axis labels on the top, middle and bottom rows
+		if (r == 0 || r == pl->height / 2 || r == pl->height - 1) {
+			n = snprintf(line, sizeof(line), "\033[%d;1H%*.4g |", pl->top + 1 + r, PLOT_GUTTER - 2,
+				(r == 0) ? ymax : (r == pl->height - 1) ? ymin : (row_hi + row_lo) / 2);
+		} else {
+			n = snprintf(line, sizeof(line), "\033[%d;1H%*s |", pl->top + 1 + r, PLOT_GUTTER - 2, "");
+		}
+		for (x = 0; x < pl->width; x++) {
+			k = plot_slot(first + x);
+			hit = -1;
+			for (s = 0; s < pl->nseries; s++) {
+				if (pl->hi[k][s] >= row_lo && pl->lo[k][s] <= row_hi) {
+					hit = s;
+					break;
+				}
+			}
+			if (opt->opt_c && hit >= 0 && hit != color) {
+				n += snprintf(line + n, sizeof(line) - n, "%s", plot_colors[hit]);
+				color = hit;
+			}
+			line[n++] = (hit >= 0) ? plot_glyphs[hit] : ' ';
+		}
+		if (color >= 0) {
+			n += snprintf(line + n, sizeof(line) - n, "%s", ESC_COLOR_RESET);
+			color = -1;
+		}
+		n += snprintf(line + n, sizeof(line) - n, "\033[K");
+		out_write(&app->out, line, n);
+	}
+	out_flush(&app->out);
+}
+
+//	Frame timer, redraws every plot at the fixed frame rate however fast samples arrive
+//	Live ports and timestamped replays scroll with the clock, raw replays with their last sample
+//	Once every last sample has scrolled off (or a raw replay is drawn) the timer stops until
+//	plot_feed() restarts it, so quiet ports cause no wakeups
+void plot_timer(void *arg, cmd_options_t *opt) {
+	session_t *ses = (session_t *)arg;
+	int64_t now = clock_mono_ns();
+	app_context_t *app;
+	int i, moving = 0;
+	
+	if (!opt->opt_G) {
+		return;
+	}
+	for (i = 0; i < ses->nports; i++) {
+		app = &ses->ports[i];
+		if (app->plot && app->state == PORT_READY) {
+			if (opt->opt_r && !app->cap_in.active) {
+				plot_render(app, opt, -1);
+			} else {
+				plot_render(app, opt, now);
+				moving |= (app->plot->last_col > app->plot->cur - app->plot->width);
+			}
+		}
+	}
+	fflush(stderr);
+	if (moving) {
+		timer_arm(&ses->frame, now + NANOSECONDS_PER_SECOND / opt->val_G_fps, 0);
+	}
+}
+
+//	Clear the screen and hide the cursor for the plots
+void plot_start(session_t *ses, cmd_options_t *opt) {
+	fprintf(stderr, ESC_CLEAR_OUTPUT "\033[?25l");
+	ses->drawing = 1;
+}
+
+//	Move below the plots and show the cursor again
+void plot_end(session_t *ses, cmd_options_t *opt) {
+	int i, bottom = 0;
+	
+	for (i = 0; i < ses->nports; i++) {
+		if (ses->ports[i].plot && ses->ports[i].plot->top + ses->ports[i].plot->height > bottom) {
+			bottom = ses->ports[i].plot->top + ses->ports[i].plot->height;
+		}
+	}
+	if (!ses->drawing || !bottom) {
+		return;
+	}
+	fprintf(stderr, "\033[%d;1H\033[?25h\n", bottom + 1);
+	for (i = 0; i < ses->nports; i++) {
+		if (ses->ports[i].plot) {
+			fprintf(stderr, "Plot (%s): %llu lines, %llu numbers\n", ses->ports[i].path,
+				(unsigned long long)ses->ports[i].plot->lines,
+				(unsigned long long)ses->ports[i].plot->values);
+		}
+	}
+}
+
+#else
+
+//	Plotting excluded from this build
+int plot_parse(cmd_options_t *opt, const char *spec) {
+	return 0;
+}
+
+plot_t *plot_new(cmd_options_t *opt, int port, int nports, ev_timer_t *frame, arena_t *arena) {
+	return NULL;
+}
+
+void plot_feed(app_context_t *app, cmd_options_t *opt, const uint8_t *buf, int len) {
+}
+
+void plot_render(app_context_t *app, cmd_options_t *opt, int64_t now) {
+}
+
+void plot_timer(void *arg, cmd_options_t *opt) {
+}
+
+void plot_start(session_t *ses, cmd_options_t *opt) {
+}
+
+void plot_end(session_t *ses, cmd_options_t *opt) {
+}
+
+#endif	/* FEATURE_PLOT */
+
+#if FEATURE_VT
+//	Parser transitions, per state and byte the action (low nibble) and the next state (high nibble)
+static uint8_t vt_table[VT_STATES][256];
+
+//	DEC special graphics (line drawing) characters for 0x5f-0x7e
+static const uint16_t vt_graphics[32] = {
+	0x0020, 0x25c6, 0x2592, 0x2409, 0x240c, 0x240d, 0x240a, 0x00b0, 0x00b1, 0x2424, 0x240b,
+	0x2518, 0x2510, 0x250c, 0x2514, 0x253c, 0x23ba, 0x23bb, 0x2500, 0x23bc, 0x23bd, 0x251c,
+	0x2524, 0x2534, 0x252c, 0x2502, 0x2264, 0x2265, 0x03c0, 0x2260, 0x00a3, 0x00b7
+};
+
+static void vt_range(int state, int lo, int hi, int action, int next) {
+	int c;
+	for (c = lo; c <= hi; c++) {
+		vt_table[state][c] = (uint8_t)(action | next << 4);
+	}
+}
+
+//	Build the parser table, after the DEC ANSI parser state diagram (without C1 controls, bytes
+//	from 0x80 are UTF-8 text)
+void vt_table_init(void) {
+	int s;
+	
+	//	C0 controls are executed in the middle of sequences, anything unexpected is ignored
+	for (s = 0; s < VT_STATES; s++) {
+		vt_range(s, 0x00, 0xff, VT_NONE, s);
+		vt_range(s, 0x00, 0x1f, VT_EXECUTE, s);
+	}
+	vt_range(VT_GROUND, 0x20, 0x7e, VT_PRINT, VT_GROUND);
+	vt_range(VT_GROUND, 0x80, 0xff, VT_PRINT, VT_GROUND);
+	
+	vt_range(VT_ESCAPE, 0x20, 0x2f, VT_COLLECT, VT_ESCAPE_INTER);
+	vt_range(VT_ESCAPE, 0x30, 0x7e, VT_ESC_DISPATCH, VT_GROUND);
+	vt_range(VT_ESCAPE, '[', '[', VT_NONE, VT_CSI_ENTRY);
+	vt_range(VT_ESCAPE, ']', ']', VT_NONE, VT_OSC);
+	vt_range(VT_ESCAPE, 'P', 'P', VT_NONE, VT_STRING);
+	vt_range(VT_ESCAPE, 'X', 'X', VT_NONE, VT_STRING);
+	vt_range(VT_ESCAPE, '^', '_', VT_NONE, VT_STRING);
+	vt_range(VT_ESCAPE_INTER, 0x20, 0x2f, VT_COLLECT, VT_ESCAPE_INTER);
+	vt_range(VT_ESCAPE_INTER, 0x30, 0x7e, VT_ESC_DISPATCH, VT_GROUND);
+	
+	//	Private markers ('?', '>', ...) are only valid before the parameters
+	vt_range(VT_CSI_ENTRY, 0x20, 0x2f, VT_COLLECT, VT_CSI_INTER);
+	vt_range(VT_CSI_ENTRY, 0x30, 0x3b, VT_PARAM, VT_CSI_PARAM);
+	vt_range(VT_CSI_ENTRY, ':', ':', VT_NONE, VT_CSI_IGNORE);
+	vt_range(VT_CSI_ENTRY, 0x3c, 0x3f, VT_COLLECT, VT_CSI_PARAM);
+	vt_range(VT_CSI_ENTRY, 0x40, 0x7e, VT_CSI_DISPATCH, VT_GROUND);
+	vt_range(VT_CSI_PARAM, 0x20, 0x2f, VT_COLLECT, VT_CSI_INTER);
+	vt_range(VT_CSI_PARAM, 0x30, 0x3b, VT_PARAM, VT_CSI_PARAM);
+	vt_range(VT_CSI_PARAM, ':', ':', VT_NONE, VT_CSI_IGNORE);
+	vt_range(VT_CSI_PARAM, 0x3c, 0x3f, VT_NONE, VT_CSI_IGNORE);
+	vt_range(VT_CSI_PARAM, 0x40, 0x7e, VT_CSI_DISPATCH, VT_GROUND);
+	vt_range(VT_CSI_INTER, 0x20, 0x2f, VT_COLLECT, VT_CSI_INTER);
+	vt_range(VT_CSI_INTER, 0x30, 0x3f, VT_NONE, VT_CSI_IGNORE);
+	vt_range(VT_CSI_INTER, 0x40, 0x7e, VT_CSI_DISPATCH, VT_GROUND);
+	vt_range(VT_CSI_IGNORE, 0x40, 0x7e, VT_NONE, VT_GROUND);
+	
+	//	Strings (OSC, DCS, SOS, PM, APC) are skipped up to ST, or BEL for OSC as xterm does
+	vt_range(VT_OSC, 0x00, 0x1f, VT_NONE, VT_OSC);
+	vt_range(VT_OSC, 0x07, 0x07, VT_NONE, VT_GROUND);
+	vt_range(VT_STRING, 0x00, 0x1f, VT_NONE, VT_STRING);
+	
+	//	From anywhere, CAN and SUB abort a sequence and ESC starts a new one
+	for (s = 0; s < VT_STATES; s++) {
+		vt_range(s, 0x18, 0x18, VT_EXECUTE, VT_GROUND);
+		vt_range(s, 0x1a, 0x1a, VT_EXECUTE, VT_GROUND);
+		vt_range(s, 0x1b, 0x1b, VT_CLEAR, VT_ESCAPE);
+	}
+}
+
+//	Parse a '-U' screen spec, a comma-separated list of '<cols>x<rows>', 'snap=<file>',
+//	'on=<string>' and 'idle'
+int vt_parse(cmd_options_t *opt, const char *spec) {
+	char *s = strdup(spec), *tok, *rest, *end;
+	long cols, rows;
+	size_t len;
+	int rc = 0;
+	
+	opt->val_U_cols = VT_DEF_COLS;
+	opt->val_U_rows = VT_DEF_ROWS;
+	for (tok = strtok_r(s, ",", &rest); tok && !rc; tok = strtok_r(NULL, ",", &rest)) {
+		if (!strncmp(tok, "snap=", 5)) {
+			free(opt->val_U_snap);
+			opt->val_U_snap = strdup(tok + 5);
+			rc = !tok[5];
+		} else if (!strncmp(tok, "on=", 3)) {
+			len = strlen(tok + 3);
+			memcpy(opt->val_U_on, tok + 3, (len < KMP_MAX_LENGTH) ? len : 0);
+			opt->val_U_on_len = (uint8_t)len;
+			rc = (!len || len >= KMP_MAX_LENGTH);
+		} else if (!strcmp(tok, "idle")) {
+			opt->val_U_idle = 1;
+		} else {
+			cols = strtol(tok, &end, 10);
+			rows = (*end == 'x') ? strtol(end + 1, &end, 10) : 0;
+			if (*end || cols < VT_MIN_COLS || cols > VT_MAX_COLS || rows < VT_MIN_ROWS || rows > VT_MAX_ROWS) {
+				rc = -1;
+				break;
+			}
+			opt->val_U_cols = (uint16_t)cols;
+			opt->val_U_rows = (uint16_t)rows;
+		}
+	}
+	free(s);
+	return rc;
+}
+
+//	Size of a screen with its cells and the cells drawn, allocated together from the arena
+size_t vt_size(cmd_options_t *opt) {
+	return sizeof(vt_screen_t) + 2 * (size_t)opt->val_U_cols * opt->val_U_rows * sizeof(vt_cell_t);
+}
+
+static inline void vt_damage(vt_screen_t *vt, int y, int x0, int x1) {
+	if (x0 < vt->dmin[y]) {
+		vt->dmin[y] = (uint16_t)x0;
+	}
+	if (x1 > vt->dmax[y]) {
+		vt->dmax[y] = (uint16_t)x1;
+	}
+	vt->damage++;
+}
+
+//	Blank columns x0..x1 of a row, erased cells keep the current background color
+void vt_erase(vt_screen_t *vt, int y, int x0, int x1) {
+	vt_cell_t blank = { ' ', 0, vt->pen.bg, vt->pen.attr & VT_ATTR_BG, 0 };
+	vt_cell_t *row = vt->cells + y * vt->cols;
+	int x;
+	
+	if (x0 < 0) {
+		x0 = 0;
+	}
+	if (x1 >= vt->cols) {
+		x1 = vt->cols - 1;
+	}
+	for (x = x0; x <= x1; x++) {
+		row[x] = blank;
+	}
+	if (x0 <= x1) {
+		vt_damage(vt, y, x0, x1);
+	}
+}
+
+//	Scroll rows top..bot up by 'n' (down for a negative 'n'), blanking the rows scrolled in
+void vt_scroll(vt_screen_t *vt, int top, int bot, int n) {
+	vt_cell_t *base = vt->cells + top * vt->cols;
+	int h = bot - top + 1, y;
+	
+	if (n > h) {
+		n = h;
+	} else if (n < -h) {
+		n = -h;
+	}
+	if (n > 0) {
+		memmove(base, base + n * vt->cols, (size_t)(h - n) * vt->cols * sizeof(vt_cell_t));
+		for (y = bot - n + 1; y <= bot; y++) {
+			vt_erase(vt, y, 0, vt->cols - 1);
+		}
+	} else if (n < 0) {
+		memmove(base - n * vt->cols, base, (size_t)(h + n) * vt->cols * sizeof(vt_cell_t));
+		for (y = top; y < top - n; y++) {
+			vt_erase(vt, y, 0, vt->cols - 1);
+		}
+	}
+	for (y = top; y <= bot; y++) {
+		vt_damage(vt, y, 0, vt->cols - 1);
+	}
+}
+
+//	Move down a line, scrolling at the bottom of the scroll region
+void vt_linefeed(vt_screen_t *vt) {
+	if (vt->y == vt->sbot) {
+		vt_scroll(vt, vt->stop, vt->sbot, 1);
+	} else if (vt->y < vt->rows - 1) {
+		vt->y++;
+	}
+	vt->wrap = 0;
+}
+
+//	Move the cursor, relative to the scroll region in origin mode
+void vt_goto(vt_screen_t *vt, int x, int y) {
+	int top = 0, bot = vt->rows - 1;
+	if (vt->origin) {
+		top = vt->stop;
+		bot = vt->sbot;
+		y += top;
+	}
+	vt->x = (x < 0) ? 0 : (x >= vt->cols) ? vt->cols - 1 : x;
+	vt->y = (y < top) ? top : (y > bot) ? bot : y;
+	vt->wrap = 0;
+}
+
+//	Move to the next (n > 0) or previous (n < 0) tab stops
+void vt_tab(vt_screen_t *vt, int n) {
+	for (; n > 0 && vt->x < vt->cols - 1; n--) {
+		while (++vt->x < vt->cols - 1 && !vt->tabs[vt->x]);
+	}
+	for (; n < 0 && vt->x > 0; n++) {
+		while (--vt->x > 0 && !vt->tabs[vt->x]);
+	}
+	vt->wrap = 0;
+}
+
+void vt_save(vt_screen_t *vt) {
+	vt->save_x = vt->x;
+	vt->save_y = vt->y;
+	vt->save_pen = vt->pen;
+	vt->save_g[0] = vt->g[0];
+	vt->save_g[1] = vt->g[1];
+	vt->save_gl = vt->gl;
+	vt->save_origin = vt->origin;
+}
+
+void vt_restore(vt_screen_t *vt) {
+	vt->pen = vt->save_pen;
+	vt->g[0] = vt->save_g[0];
+	vt->g[1] = vt->save_g[1];
+	vt->gl = vt->save_gl;
+	vt->origin = vt->save_origin;
+	vt->x = (vt->save_x < vt->cols) ? vt->save_x : vt->cols - 1;
+	vt->y = (vt->save_y < vt->rows) ? vt->save_y : vt->rows - 1;
+	vt->wrap = 0;
+}
+
+//	Power-on state: a blank screen, default attributes, tab stops every 8 columns
+void vt_reset(vt_screen_t *vt) {
+	int x, y;
+	
+	memset(&vt->pen, 0, sizeof(vt->pen));
+	vt->pen.ch = ' ';
+	vt->x = vt->y = vt->wrap = 0;
+	vt->stop = 0;
+	vt->sbot = vt->rows - 1;
+	vt->autowrap = vt->cursor_on = 1;
+	vt->origin = 0;
+	vt->g[0] = vt->g[1] = vt->gl = 0;
+	vt->u8need = 0;
+	vt->last_ch = ' ';
+	for (x = 0; x < vt->cols; x++) {
+		vt->tabs[x] = (x && !(x % VT_TAB_WIDTH));
+	}
+	for (y = 0; y < vt->rows; y++) {
+		vt_erase(vt, y, 0, vt->cols - 1);
+	}
+	vt_save(vt);
+}
+
+//	Allocate a port's screen, and open its snapshot file: '-U snap=<file>[.<port>]', or next to
+//	the '-o' output file as '<output>.screen'
+vt_screen_t *vt_new(cmd_options_t *opt, int port, int nports, ev_timer_t *frame, arena_t *arena) {
+	vt_screen_t *vt = arena_alloc(arena, vt_size(opt), ARENA_ALIGN);
+	size_t cells = (size_t)opt->val_U_cols * opt->val_U_rows, i;
+	char name[4096];
+	
+	if (!vt) {
+		fprintf(stderr, "%sError%s: Couldn't allocate screen\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET);
+		return NULL;
+	}
+	vt->cols = opt->val_U_cols;
+	vt->rows = opt->val_U_rows;
+	vt->top = 1 + port * (vt->rows + 1);
+	vt->frame = frame;
+	vt->cells = (vt_cell_t *)(vt + 1);
+	vt->shown = vt->cells + cells;
+	vt_reset(vt);
+	
+	//	Our terminal starts out blank, like the screen
+	for (i = 0; i < cells; i++) {
+		vt->shown[i] = vt->cells[i];
+	}
+	memset(vt->dmin, 0xff, sizeof(vt->dmin));
+	memset(vt->dmax, 0, sizeof(vt->dmax));
+	vt->cur_x = vt->cur_y = -1;
+	if (opt->val_U_on_len) {
+		kmp_init(&vt->trigger, opt->val_U_on, opt->val_U_on_len);
+	}
+	
+	if (opt->val_U_snap && nports > 1) {
+		snprintf(name, sizeof(name), "%s.%d", opt->val_U_snap, port);
+	} else if (opt->val_U_snap) {
+		snprintf(name, sizeof(name), "%s", opt->val_U_snap);
+	} else if (opt->opt_o && nports > 1) {
+		snprintf(name, sizeof(name), "%s.%d.screen", opt->val_o, port);
+	} else if (opt->opt_o) {
+		snprintf(name, sizeof(name), "%s.screen", opt->val_o);
+	} else {
+		return vt;
+	}
+	if (!(vt->snap = fopen(name, "w"))) {
+		fprintf(stderr, "%sError%s: Couldn't open snapshot file '%s': %s\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET,
+			name, strerror(errno));
+		return NULL;
+	}
+	return vt;
+}
+
+//	Write a code point at the cursor, wrapping first if the last one filled the line
+void vt_put(vt_screen_t *vt, uint32_t cp) {
+	vt_cell_t *cell;
+	
+	if (vt->g[vt->gl] && cp >= 0x5f && cp <= 0x7e) {
+		cp = vt_graphics[cp - 0x5f];
+	}
+	if (vt->wrap) {
+		vt->x = 0;
+		vt_linefeed(vt);
+	}
+	cell = &vt->cells[vt->y * vt->cols + vt->x];
+	*cell = vt->pen;
+	cell->ch = cp;
+	vt_damage(vt, vt->y, vt->x, vt->x);
+	vt->last_ch = cp;
+	if (vt->x < vt->cols - 1) {
+		vt->x++;
+	} else {
+		vt->wrap = vt->autowrap;
+	}
+}
+
+//	Write a run of printable ASCII, a row segment at a time
+void vt_print_run(vt_screen_t *vt, const uint8_t *s, int n) {
+	vt_cell_t cell = vt->pen, *row;
+	int i, k;
+	
+	while (n) {
+		if (vt->wrap) {
+			vt->x = 0;
+			vt_linefeed(vt);
+		}
+		k = vt->cols - vt->x;
+		if (k > n) {
+			k = n;
+		}
+		row = vt->cells + vt->y * vt->cols + vt->x;
+		for (i = 0; i < k; i++) {
+			cell.ch = s[i];
+			row[i] = cell;
+		}
+		vt_damage(vt, vt->y, vt->x, vt->x + k - 1);
+		vt->last_ch = s[k - 1];
+		s += k;
+		n -= k;
+		vt->x += k;
+		if (vt->x == vt->cols) {
+			vt->x = vt->cols - 1;
+			if (vt->autowrap) {
+				vt->wrap = 1;
+			} else if (n) {
+				//	Without autowrap, the rest of the run overwrites the last column
+				s += n - 1;
+				n = 1;
+			}
+		}
+	}
+}
+
+//	Assemble UTF-8 sequences, invalid ones are shown as U+FFFD
+void vt_print(vt_screen_t *vt, uint8_t c) {
+	if (vt->u8need) {
+		if ((c & 0xc0) == 0x80) {
+			vt->u8cp = vt->u8cp << 6 | (c & 0x3f);
+			if (!--vt->u8need) {
+				vt_put(vt, (vt->u8cp > 0x10ffff || (vt->u8cp >= 0xd800 && vt->u8cp < 0xe000)) ?
+					0xfffd : vt->u8cp);
+			}
+			return;
+		}
+		vt->u8need = 0;
+		vt_put(vt, 0xfffd);
+	}
+	if (c < 0x80) {
+		vt_put(vt, c);
+	} else if (c >= 0xc2 && c <= 0xdf) {
+		vt->u8cp = c & 0x1f;
+		vt->u8need = 1;
+	} else if (c >= 0xe0 && c <= 0xef) {
+		vt->u8cp = c & 0x0f;
+		vt->u8need = 2;
+	} else if (c >= 0xf0 && c <= 0xf4) {
+		vt->u8cp = c & 0x07;
+		vt->u8need = 3;
+	} else {
+		vt_put(vt, 0xfffd);
+	}
+}
+
+void vt_execute(vt_screen_t *vt, uint8_t c) {
+	vt->u8need = 0;
+	switch (c) {
+		case '\b':
+			if (vt->x > 0) {
+				vt->x--;
+			}
+			vt->wrap = 0;
+			break;
+		case '\t':
+			vt_tab(vt, 1);
+			break;
+		case '\n':
+		case '\v':
+		case '\f':
+			vt_linefeed(vt);
+			break;
+		case '\r':
+			vt->x = 0;
+			vt->wrap = 0;
+			break;
+		case 0x0e:
+			vt->gl = 1;
+			break;
+		case 0x0f:
+			vt->gl = 0;
+			break;
+	}
+}
+
+//	Numeric parameter 'i', or 'def' when it is missing or 0
+static inline int vt_param(vt_screen_t *vt, int i, int def) {
+	return (i < vt->nparams && vt->params[i]) ? vt->params[i] : def;
+}
+
+void vt_esc_dispatch(vt_screen_t *vt, uint8_t c) {
+	int x, y;
+	
+	//	Designate G0 or G1 as line drawing ('0') or ASCII
+	if (vt->ninter == 1 && (vt->inter[0] == '(' || vt->inter[0] == ')')) {
+		vt->g[vt->inter[0] == ')'] = (c == '0');
+		return;
+	}
+	//	Screen alignment pattern
+	if (vt->ninter == 1 && vt->inter[0] == '#' && c == '8') {
+		for (y = 0; y < vt->rows; y++) {
+			for (x = 0; x < vt->cols; x++) {
+				vt->cells[y * vt->cols + x] = vt->pen;
+				vt->cells[y * vt->cols + x].ch = 'E';
+			}
+			vt_damage(vt, y, 0, vt->cols - 1);
+		}
+		return;
+	}
+	if (vt->ninter) {
+		return;
+	}
+	switch (c) {
+		case '7':
+			vt_save(vt);
+			break;
+		case '8':
+			vt_restore(vt);
+			break;
+		case 'D':
+			vt_linefeed(vt);
+			break;
+		case 'E':
+			vt->x = 0;
+			vt_linefeed(vt);
+			break;
+		case 'M':
+			if (vt->y == vt->stop) {
+				vt_scroll(vt, vt->stop, vt->sbot, -1);
+			} else if (vt->y > 0) {
+				vt->y--;
+			}
+			vt->wrap = 0;
+			break;
+		case 'H':
+			vt->tabs[vt->x] = 1;
+			break;
+		case 'c':
+			vt_reset(vt);
+			break;
+	}
+}
+
+//	Color of an extended SGR 38/48 parameter (256 colors, or RGB mapped to the 6x6x6 cube),
+//	advancing 'i' past it, or -1
+int vt_sgr_color(vt_screen_t *vt, int *i) {
+	int r, g, b;
+	if (*i + 2 < vt->nparams && vt->params[*i + 1] == 5) {
+		*i += 2;
+		return (vt->params[*i] > 255) ? 255 : vt->params[*i];
+	}
+	if (*i + 4 < vt->nparams && vt->params[*i + 1] == 2) {
+		r = (vt->params[*i + 2] > 255) ? 5 : (vt->params[*i + 2] * 5 + 127) / 255;
+		g = (vt->params[*i + 3] > 255) ? 5 : (vt->params[*i + 3] * 5 + 127) / 255;
+		b = (vt->params[*i + 4] > 255) ? 5 : (vt->params[*i + 4] * 5 + 127) / 255;
+		*i += 4;
+		return 16 + 36 * r + 6 * g + b;
+	}
+	*i = vt->nparams;
+	return -1;
+}
+
+//	Select graphic rendition
+void vt_sgr(vt_screen_t *vt) {
+	vt_cell_t *p = &vt->pen;
+	int i, v, color;
+	
+	for (i = 0; i < ((vt->nparams) ? vt->nparams : 1); i++) {
+		v = (i < vt->nparams) ? vt->params[i] : 0;
+		if (v == 0) {
+			p->attr = p->fg = p->bg = 0;
+		} else if (v == 1) {
+			p->attr |= VT_ATTR_BOLD;
+		} else if (v == 4) {
+			p->attr |= VT_ATTR_UNDERLINE;
+		} else if (v == 5) {
+			p->attr |= VT_ATTR_BLINK;
+		} else if (v == 7) {
+			p->attr |= VT_ATTR_REVERSE;
+		} else if (v == 22) {
+			p->attr &= ~VT_ATTR_BOLD;
+		} else if (v == 24) {
+			p->attr &= ~VT_ATTR_UNDERLINE;
+		} else if (v == 25) {
+			p->attr &= ~VT_ATTR_BLINK;
+		} else if (v == 27) {
+			p->attr &= ~VT_ATTR_REVERSE;
+		} else if ((v >= 30 && v <= 37) || (v >= 90 && v <= 97)) {
+			p->fg = (uint8_t)((v < 90) ? v - 30 : v - 90 + 8);
+			p->attr |= VT_ATTR_FG;
+		} else if ((v >= 40 && v <= 47) || (v >= 100 && v <= 107)) {
+			p->bg = (uint8_t)((v < 100) ? v - 40 : v - 100 + 8);
+			p->attr |= VT_ATTR_BG;
+		} else if (v == 38 || v == 48) {
+			color = vt_sgr_color(vt, &i);
+			if (color >= 0 && v == 38) {
+				p->fg = (uint8_t)color;
+				p->attr |= VT_ATTR_FG;
+			} else if (color >= 0) {
+				p->bg = (uint8_t)color;
+				p->attr |= VT_ATTR_BG;
+			}
+		} else if (v == 39) {
+			p->attr &= ~VT_ATTR_FG;
+			p->fg = 0;
+		} else if (v == 49) {
+			p->attr &= ~VT_ATTR_BG;
+			p->bg = 0;
+		}
+	}
+}
+
+//	Set or reset DEC private modes
+void vt_mode(vt_screen_t *vt, int on) {
+	int i, y;
+	
+	for (i = 0; i < vt->nparams; i++) {
+		switch (vt->params[i]) {
+			case 6:
+				vt->origin = (uint8_t)on;
+				vt_goto(vt, 0, 0);
+				break;
+			case 7:
+				vt->autowrap = (uint8_t)on;
+				break;
+			case 25:
+				vt->cursor_on = (uint8_t)on;
+				break;
+			case 47:
+			case 1047:
+			case 1049:
+				//	The alternate screen is not kept, switching clears the screen
+				if (vt->params[i] == 1049 && on) {
+					vt_save(vt);
+				}
+				for (y = 0; y < vt->rows; y++) {
+					vt_erase(vt, y, 0, vt->cols - 1);
+				}
+				if (vt->params[i] == 1049 && !on) {
+					vt_restore(vt);
+				}
+				break;
+		}
+	}
+}
+
+void vt_csi_dispatch(vt_screen_t *vt, uint8_t c) {
+	vt_cell_t *row = vt->cells + vt->y * vt->cols;
+	int n = vt_param(vt, 0, 1), mode = vt_param(vt, 0, 0), top, bot, y;
+	
+	if (vt->ninter == 1 && vt->inter[0] == '?' && (c == 'h' || c == 'l')) {
+		vt_mode(vt, c == 'h');
+		return;
+	}
+	if (vt->ninter) {
+		//	Other private and intermediate sequences don't change the screen
+		return;
+	}
+	switch (c) {
+		case '@':
+			n = (n > vt->cols - vt->x) ? vt->cols - vt->x : n;
+			memmove(row + vt->x + n, row + vt->x, (size_t)(vt->cols - vt->x - n) * sizeof(vt_cell_t));
+			vt_erase(vt, vt->y, vt->x, vt->x + n - 1);
+			vt_damage(vt, vt->y, vt->x, vt->cols - 1);
+			break;
+		case 'P':
+			n = (n > vt->cols - vt->x) ? vt->cols - vt->x : n;
+			memmove(row + vt->x, row + vt->x + n, (size_t)(vt->cols - vt->x - n) * sizeof(vt_cell_t));
+			vt_erase(vt, vt->y, vt->cols - n, vt->cols - 1);
+			vt_damage(vt, vt->y, vt->x, vt->cols - 1);
+			break;
+		case 'A':
+		case 'F':
+			top = (vt->y >= vt->stop) ? vt->stop : 0;
+			vt->y = (vt->y - n < top) ? top : vt->y - n;
+			vt->x = (c == 'F') ? 0 : vt->x;
+			vt->wrap = 0;
+			break;
+		case 'B':
+		case 'e':
+		case 'E':
+			bot = (vt->y <= vt->sbot) ? vt->sbot : vt->rows - 1;
+			vt->y = (vt->y + n > bot) ? bot : vt->y + n;
+			vt->x = (c == 'E') ? 0 : vt->x;
+			vt->wrap = 0;
+			break;
+		case 'C':
+		case 'a':
+			vt->x = (vt->x + n >= vt->cols) ? vt->cols - 1 : vt->x + n;
+			vt->wrap = 0;
+			break;
+		case 'D':
+			vt->x = (vt->x - n < 0) ? 0 : vt->x - n;
+			vt->wrap = 0;
+			break;
+		case 'G':
+		case '`':
+			vt->x = (n > vt->cols) ? vt->cols - 1 : n - 1;
+			vt->wrap = 0;
+			break;
+		case 'd':
+			vt_goto(vt, vt->x, n - 1);
+			break;
+		case 'H':
+		case 'f':
+			vt_goto(vt, vt_param(vt, 1, 1) - 1, n - 1);
+			break;
+		case 'I':
+			vt_tab(vt, n);
+			break;
+		case 'Z':
+			vt_tab(vt, -n);
+			break;
+		case 'J':
+			for (y = (mode == 1) ? 0 : (mode == 0) ? vt->y + 1 : 0;
+				y < ((mode == 1) ? vt->y : vt->rows); y++) {
+				vt_erase(vt, y, 0, vt->cols - 1);
+			}
+			if (mode == 0) {
+				vt_erase(vt, vt->y, vt->x, vt->cols - 1);
+			} else if (mode == 1) {
+				vt_erase(vt, vt->y, 0, vt->x);
+			}
+			break;
+		case 'K':
+			vt_erase(vt, vt->y, (mode == 0) ? vt->x : 0, (mode == 1) ? vt->x : vt->cols - 1);
+			break;
+		case 'L':
+		case 'M':
+			if (vt->y >= vt->stop && vt->y <= vt->sbot) {
+				vt_scroll(vt, vt->y, vt->sbot, (c == 'M') ? n : -n);
+				vt->x = 0;
+				vt->wrap = 0;
+			}
+			break;
+		case 'S':
+			vt_scroll(vt, vt->stop, vt->sbot, n);
+			break;
+		case 'T':
+			if (vt->nparams <= 1) {
+				vt_scroll(vt, vt->stop, vt->sbot, -n);
+			}
+			break;
+		case 'X':
+			vt_erase(vt, vt->y, vt->x, vt->x + n - 1);
+			break;
+		case 'b':
+			for (n = (n > vt->cols * vt->rows) ? vt->cols * vt->rows : n; n > 0; n--) {
+				vt_put(vt, vt->last_ch);
+			}
+			break;
+		case 'g':
+			if (mode == 0) {
+				vt->tabs[vt->x] = 0;
+			} else if (mode == 3) {
+				memset(vt->tabs, 0, sizeof(vt->tabs));
+			}
+			break;
+		case 'm':
+			vt_sgr(vt);
+			break;
+		case 'r':
+			top = vt_param(vt, 0, 1) - 1;
+			bot = vt_param(vt, 1, vt->rows) - 1;
+			bot = (bot >= vt->rows) ? vt->rows - 1 : bot;
+			if (top < bot) {
+				vt->stop = top;
+				vt->sbot = bot;
+				vt_goto(vt, 0, 0);
+			}
+			break;
+		case 's':
+			vt_save(vt);
+			break;
+		case 'u':
+			vt_restore(vt);
+			break;
+	}
+}
+
+void vt_snapshot(app_context_t *app, cmd_options_t *opt, const char *why);
+
+//	Run a chunk through the parser, runs of printable ASCII in the ground state skip the table
+void vt_feed(app_context_t *app, cmd_options_t *opt, const uint8_t *buf, int len) {
+	vt_screen_t *vt = app->vt;
+	uint64_t damage = vt->damage;
+	struct timespec ts;
+	uint8_t c, e;
+	int i, j;
+	
+	for (i = 0; i < len; i++) {
+		c = buf[i];
+		if (c >= 0x20 && c < 0x7f && vt->state == VT_GROUND && !vt->u8need && !vt->g[vt->gl]) {
+			for (j = i + 1; j < len && buf[j] >= 0x20 && buf[j] < 0x7f; j++);
+			vt_print_run(vt, buf + i, j - i);
+			i = j - 1;
+			continue;
+		}
+		e = vt_table[vt->state][c];
+		switch (e & 0x0f) {
+			case VT_PRINT:
+				vt_print(vt, c);
+				break;
+			case VT_EXECUTE:
+				vt_execute(vt, c);
+				break;
+			case VT_CLEAR:
+				vt->nparams = vt->ninter = 0;
+				vt->params[0] = 0;
+				vt->u8need = 0;
+				break;
+			case VT_COLLECT:
+				if (vt->ninter < sizeof(vt->inter)) {
+					vt->inter[vt->ninter] = c;
+				}
+				vt->ninter++;
+				break;
+			case VT_PARAM:
+				if (!vt->nparams) {
+					vt->nparams = 1;
+					vt->params[0] = 0;
+				}
+				if (c == ';') {
+					if (vt->nparams < VT_MAX_PARAMS) {
+						vt->params[vt->nparams++] = 0;
+					}
+				} else if (vt->params[vt->nparams - 1] < VT_MAX_PARAM) {
+					vt->params[vt->nparams - 1] = vt->params[vt->nparams - 1] * 10 + (c - '0');
+				}
+				break;
+			case VT_ESC_DISPATCH:
+				vt_esc_dispatch(vt, c);
+				vt->sequences++;
+				break;
+			case VT_CSI_DISPATCH:
+				vt_csi_dispatch(vt, c);
+				vt->sequences++;
+				break;
+		}
+		vt->state = e >> 4;
+	}
+	vt->bytes += len;
+	
+	//	Snapshot triggers are matched in the received bytes
+	for (i = 0; vt->trigger.len && i < len; i++) {
+		vt->trig_pos = kmp_step(&vt->trigger, vt->trig_pos, buf[i]);
+		vt->pending |= (vt->trig_pos == vt->trigger.len);
+	}
+	if (vt->damage != damage) {
+		clock_real(&ts);
+		vt->changed_ns = (int64_t)ts.tv_sec * NANOSECONDS_PER_SECOND + ts.tv_nsec;
+		vt->changed = 1;
+	}
+	
+	//	Draw the next frame after a frame time, so redraw bursts share one
+	if (!vt->frame->deadline) {
+		timer_arm(vt->frame, clock_mono_ns() + NANOSECONDS_PER_SECOND / VT_FPS,
+			NANOSECONDS_PER_SECOND / VT_FPS / IDLE_SLACK_DIVISOR);
+	}
+	
+	//	Without '-g', a triggered snapshot is taken once the chunk is processed, with it, once
+	//	the port is idle and the screen has settled
+	if (vt->pending && !opt->opt_g) {
+		vt_snapshot(app, opt, "match");
+	}
+}
+
+//	Encode a code point as UTF-8, returns the length
+static inline int vt_utf8(char *p, uint32_t cp) {
+	if (cp < 0x80) {
+		p[0] = (char)cp;
+		return 1;
+	}
+	if (cp < 0x800) {
+		p[0] = (char)(0xc0 | cp >> 6);
+		p[1] = (char)(0x80 | (cp & 0x3f));
+		return 2;
+	}
+	if (cp < 0x10000) {
+		p[0] = (char)(0xe0 | cp >> 12);
+		p[1] = (char)(0x80 | (cp >> 6 & 0x3f));
+		p[2] = (char)(0x80 | (cp & 0x3f));
+		return 3;
+	}
+	p[0] = (char)(0xf0 | cp >> 18);
+	p[1] = (char)(0x80 | (cp >> 12 & 0x3f));
+	p[2] = (char)(0x80 | (cp >> 6 & 0x3f));
+	p[3] = (char)(0x80 | (cp & 0x3f));
+	return 4;
+}
+
+//	SGR sequence for a drawn cell, colors and other attributes only with '-c', reverse video
+//	(which menus use to show the selection) and the cursor always
+int vt_style(char *p, const vt_cell_t *c, cmd_options_t *opt) {
+	int n = sprintf(p, "\033[0");
+	
+	if (opt->opt_c) {
+		n += sprintf(p + n, "%s%s%s", (c->attr & VT_ATTR_BOLD) ? ";1" : "",
+			(c->attr & VT_ATTR_UNDERLINE) ? ";4" : "", (c->attr & VT_ATTR_BLINK) ? ";5" : "");
+		if (c->attr & VT_ATTR_FG) {
+			n += (c->fg < 8) ? sprintf(p + n, ";%d", 30 + c->fg) :
+				(c->fg < 16) ? sprintf(p + n, ";%d", 90 + c->fg - 8) : sprintf(p + n, ";38;5;%d", c->fg);
+		}
+		if (c->attr & VT_ATTR_BG) {
+			n += (c->bg < 8) ? sprintf(p + n, ";%d", 40 + c->bg) :
+				(c->bg < 16) ? sprintf(p + n, ";%d", 100 + c->bg - 8) : sprintf(p + n, ";48;5;%d", c->bg);
+		}
+	}
+	if (!(c->attr & VT_ATTR_REVERSE) != !(c->attr & VT_ATTR_CURSOR)) {
+		n += sprintf(p + n, ";7");
+	}
+	p[n++] = 'm';
+	return n;
+}
+
+//	Draw the damaged spans of the screen into the port's band of the terminal. Cells are compared
+//	with those drawn before, so a device redrawing the same content costs no output
+void vt_render(app_context_t *app, cmd_options_t *opt) {
+	vt_screen_t *vt = app->vt;
+	char line[VT_LINE_SIZE];
+	vt_cell_t c, *shown, style;
+	int x, y, next, n, have_style = 0;
+	uint64_t cells = vt->cells_drawn;
+	
+	if (!vt->titled) {
+		n = snprintf(line, sizeof(line), "\033[%d;1H%.*s: %dx%d\033[K", vt->top, VT_TITLE_MAX, app->path,
+			vt->cols, vt->rows);
+		out_write(&app->out, line, n);
+		vt->titled = 1;
+	}
+	
+	//	The cursor is drawn as a reverse video cell, moving it damages both cells
+	if (vt->cur_x != vt->x || vt->cur_y != vt->y || vt->cur_on != vt->cursor_on) {
+		if (vt->cur_x >= 0) {
+			vt_damage(vt, vt->cur_y, vt->cur_x, vt->cur_x);
+		}
+		vt_damage(vt, vt->y, vt->x, vt->x);
+		vt->cur_x = vt->x;
+		vt->cur_y = vt->y;
+		vt->cur_on = vt->cursor_on;
+	}
+	
+	for (y = 0; y < vt->rows; y++) {
+		if (vt->dmin[y] > vt->dmax[y]) {
+			continue;
+		}
+		n = 0;
+		next = -1;
+		for (x = vt->dmin[y]; x <= vt->dmax[y]; x++) {
+			c = vt->cells[y * vt->cols + x];
+			if (vt->cursor_on && x == vt->x && y == vt->y) {
+				c.attr |= VT_ATTR_CURSOR;
+			}
+			shown = &vt->shown[y * vt->cols + x];
+			if (!memcmp(&c, shown, sizeof(vt_cell_t))) {
+				continue;
+			}
+			if (x != next) {
+				n += sprintf(line + n, "\033[%d;%dH", vt->top + 1 + y, x + 1);
+			}
+			if (!have_style || c.attr != style.attr || c.fg != style.fg || c.bg != style.bg) {
+				n += vt_style(line + n, &c, opt);
+				style = c;
+				have_style = 1;
+			}
+			n += vt_utf8(line + n, c.ch);
+			*shown = c;
+			next = x + 1;
+			vt->cells_drawn++;
+			if (n > VT_LINE_SIZE - VT_CELL_MAX) {
+				out_write(&app->out, line, n);
+				n = 0;
+			}
+		}
+		out_write(&app->out, line, n);
+		vt->dmin[y] = 0xffff;
+		vt->dmax[y] = 0;
+	}
+	if (have_style) {
+		out_write(&app->out, ESC_COLOR_RESET, sizeof(ESC_COLOR_RESET) - 1);
+	}
+	vt->frames += (vt->cells_drawn != cells);
+	out_flush(&app->out);
+}
+
+//	Write the screen text to the snapshot file, after a header line with the time of the last
+//	change, the port, the trigger and the cursor position
+void vt_snapshot(app_context_t *app, cmd_options_t *opt, const char *why) {
+	vt_screen_t *vt = app->vt;
+	char line[VT_MAX_COLS * 4 + 1];
+	struct timespec ts;
+	int x, y, n, end;
+	
+	vt->pending = 0;
+	if (!vt->snap) {
+		return;
+	}
+	if (!vt->changed_ns) {
+		clock_real(&ts);
+		vt->changed_ns = (int64_t)ts.tv_sec * NANOSECONDS_PER_SECOND + ts.tv_nsec;
+	}
+	fprintf(vt->snap, "--- %lld %s %s %dx%d cursor %d,%d\n", (long long)vt->changed_ns, app->path, why,
+		vt->cols, vt->rows, vt->y + 1, vt->x + 1);
+	for (y = 0; y < vt->rows; y++) {
+		for (end = vt->cols; end > 0 && vt->cells[y * vt->cols + end - 1].ch == ' '; end--);
+		for (x = n = 0; x < end; x++) {
+			n += vt_utf8(line + n, vt->cells[y * vt->cols + x].ch);
+		}
+		line[n++] = '\n';
+		fwrite(line, 1, n, vt->snap);
+	}
+	fflush(vt->snap);
+	vt->snapshots++;
+	vt->changed = 0;
+}
+
+//	Idle gap, the screen has settled: take a triggered snapshot, or with 'idle' one of every change
+void vt_finish(app_context_t *app, cmd_options_t *opt) {
+	vt_screen_t *vt = app->vt;
+	if (vt->pending) {
+		vt_snapshot(app, opt, "match");
+	} else if (opt->val_U_idle && vt->changed) {
+		vt_snapshot(app, opt, "idle");
+	}
+}
+
+//	Draw the final screen and snapshot it if it changed since the last snapshot
+void vt_close(app_context_t *app, cmd_options_t *opt) {
+	vt_screen_t *vt = app->vt;
+	if (opt->opt_U) {
+		vt_render(app, opt);
+	}
+	if (vt->changed) {
+		vt_snapshot(app, opt, "exit");
+	}
+	if (vt->snap) {
+		fclose(vt->snap);
+		vt->snap = NULL;
+	}
+}
+
+//	Frame timer, armed by received data, draws what changed on every screen
+void vt_timer(void *arg, cmd_options_t *opt) {
+	session_t *ses = (session_t *)arg;
+	app_context_t *app;
+	int i;
+	
+	if (!opt->opt_U) {
+		return;
+	}
+	for (i = 0; i < ses->nports; i++) {
+		app = &ses->ports[i];
+		if (app->vt && app->state == PORT_READY) {
+			vt_render(app, opt);
+		}
+	}
+	fflush(stderr);
+}
+
+//	Clear the terminal and hide its cursor, the emulated cursor is drawn in the screens
+void vt_start(session_t *ses, cmd_options_t *opt) {
+	fprintf(stderr, ESC_CLEAR_OUTPUT "\033[?25l");
+	ses->drawing = 1;
+}
+
+//	Move below the screens, show the cursor again and print the screen statistics
+void vt_end(session_t *ses, cmd_options_t *opt) {
+	vt_screen_t *vt;
+	int i, bottom = 0;
+	
+	for (i = 0; i < ses->nports; i++) {
+		if ((vt = ses->ports[i].vt) && vt->top + vt->rows > bottom) {
+			bottom = vt->top + vt->rows;
+		}
+	}
+	if (!ses->drawing || !bottom) {
+		return;
+	}
+	fprintf(stderr, "\033[%d;1H\033[?25h\n", bottom + 1);
+	for (i = 0; i < ses->nports; i++) {
+		if ((vt = ses->ports[i].vt)) {
+			fprintf(stderr, "Screen (%s): %llu bytes, %llu sequences, %llu frames, %llu cells drawn, %u snapshots\n",
+				ses->ports[i].path, (unsigned long long)vt->bytes, (unsigned long long)vt->sequences,
+				(unsigned long long)vt->frames, (unsigned long long)vt->cells_drawn, vt->snapshots);
+		}
+	}
+}
+
+#else
+
+//	Screen emulation excluded from this build
+void vt_table_init(void) {
+}
+
+int vt_parse(cmd_options_t *opt, const char *spec) {
+	return 0;
+}
+
+size_t vt_size(cmd_options_t *opt) {
+	return 0;
+}
+
+vt_screen_t *vt_new(cmd_options_t *opt, int port, int nports, ev_timer_t *frame, arena_t *arena) {
+	return NULL;
+}
+
+void vt_feed(app_context_t *app, cmd_options_t *opt, const uint8_t *buf, int len) {
+}
+
+void vt_snapshot(app_context_t *app, cmd_options_t *opt, const char *why) {
+}
+
+void vt_finish(app_context_t *app, cmd_options_t *opt) {
+}
+
+void vt_close(app_context_t *app, cmd_options_t *opt) {
+}
+
+void vt_timer(void *arg, cmd_options_t *opt) {
+}
+
+void vt_start(session_t *ses, cmd_options_t *opt) {
+}
+
+void vt_end(session_t *ses, cmd_options_t *opt) {
+}
+
+#endif	/* FEATURE_VT */
+
+//	Set up the output stage selected by options, replacing any current one
+//	The new stage is built before the old one is released, so a failure leaves it in place
+int config_output(app_context_t *app, cmd_options_t *opt) {
+	fmt_program_t *fmt = NULL;
+	re_match_t *re = NULL;
+	int kind = EXPORT_NONE;
+	
+	//	Look up the export encoding
+	if (opt->opt_f) {
+		kind = export_lookup(opt->val_f);
+		if (!kind) {
+			fprintf(stderr,
+				"%sError%s: Unknown export encoding '-f' '%s'\n",
+				ESC_COLOR_MAGENTA,
+				ESC_COLOR_RESET,
+				opt->val_f
+			);
+			return -1;
+		}
+	}
+	
+	//	Compile the user format string, or the built-in raw output format
+	if (!opt->val_w) {
+		opt->val_w = DEF_COLUMN_WIDTH;
+	}
+	if (!opt->opt_m && !opt->opt_a && !opt->opt_f && !opt->opt_l && !opt->opt_G && !opt->opt_N && !opt->opt_U) {
+		fmt = (opt->opt_e) ? fmt_compile(opt->val_e) : fmt_compile_builtin(opt);
+		if (!fmt) {
+			return -1;
+		}
+	}
+	
+	//	Compile the regex for ASCII output
+	if (opt->opt_a && opt->opt_E) {
+		re = re_match_new(opt->val_E);
+		if (!re) {
+			fmt_free(fmt);
+			return -1;
+		}
+	}
+	
+	//	Finish the partial line of the current output stage and swap
+	re_finish(app, opt);
+	export_finish(app, opt);
+	fmt_free(app->fmt);
+	re_match_free(app->re);
+	app->fmt = fmt;
+	app->re = re;
+	app->exp.kind = kind;
+	app->exp.frame = opt->opt_F;
+	app->exp.len = 0;
+	return 0;
+}
+
+#if FEATURE_METRICS
+//	Write a Prometheus label value, escaping backslashes and quotes
+void metrics_label(FILE *f, const char *s) {
+	for (; *s; s++) {
+		if (*s == '\\' || *s == '"') {
+			fputc('\\', f);
+		}
+		fputc(*s, f);
+	}
+}
+
+//	Write one metric sample per port
+void metrics_ports(FILE *f, session_t *ses, const char *name, const char *type,
+	const char *help, double (*value)(app_context_t *)) {
+	int i;
+	fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+	for (i = 0; i < ses->nports; i++) {
+		fprintf(f, "%s{port=\"", name);
+		metrics_label(f, ses->ports[i].path);
+		fprintf(f, "\"} %.9g\n", value(&ses->ports[i]));
+	}
+}
+
+double metric_config_seconds(app_context_t *app) {
+	return (double)app->config_ns / (double)NANOSECONDS_PER_SECOND;
+}
+
+double metric_up(app_context_t *app) {
+	return (app->state == PORT_READY) ? 1 : 0;
+}
+
+double metric_bytes(app_context_t *app) {
+	return (double)app->offset;
+}
+
+double metric_journal_lines(app_context_t *app) {
+	return (app->journal) ? (double)app->journal->ports[app->journal_port].lines : 0;
+}
+
+double metric_journal_dropped(app_context_t *app) {
+	return (app->journal) ? (double)app->journal->ports[app->journal_port].dropped : 0;
+}
+
+double metric_compare_units(app_context_t *app) {
+	return (app->compare) ? (double)app->compare->side[app->compare_side].units : 0;
+}
+
+double metric_compare_unmatched(app_context_t *app) {
+	return (app->compare) ? (double)app->compare->side[app->compare_side].unmatched : 0;
+}
+
+double metric_compare_losses(app_context_t *app) {
+	return (app->compare) ? (double)app->compare->side[app->compare_side].losses : 0;
+}
+
+double metric_flow_seconds(app_context_t *app) {
+	flow_state_t *f = &app->flow;
+	return (double)(f->ns + ((f->throttled) ? clock_mono_ns() - f->since : 0)) / NANOSECONDS_PER_SECOND;
+}
+
+double metric_flow_throttles(app_context_t *app) {
+	return (double)app->flow.throttles;
+}
+
+//	Link comparison counts, and the latency of B relative to A over matched units
+void metrics_compare(FILE *f, session_t *ses) {
+	compare_t *c = ses->compare;
+	
+	metrics_ports(f, ses, "ttydump_compare_units_total", "counter",
+		"Units (chunks or lines) cut from the link", metric_compare_units);
+	metrics_ports(f, ses, "ttydump_compare_unmatched_total", "counter",
+		"Units with no counterpart on the other link", metric_compare_unmatched);
+	metrics_ports(f, ses, "ttydump_compare_losses_total", "counter",
+		"Runs of units seen only on this link", metric_compare_losses);
+	fprintf(f, "# HELP ttydump_compare_matched_total Units seen on both links\n"
+		"# TYPE ttydump_compare_matched_total counter\n"
+		"ttydump_compare_matched_total %llu\n"
+		"# HELP ttydump_compare_divergences_total Runs of units which differ between the links\n"
+		"# TYPE ttydump_compare_divergences_total counter\n"
+		"ttydump_compare_divergences_total %llu\n",
+		(unsigned long long)c->matched, (unsigned long long)c->divergences);
+	if (c->matched) {
+		fprintf(f, "# HELP ttydump_compare_latency_seconds Arrival time on B less arrival time on A of matched units\n"
+			"# TYPE ttydump_compare_latency_seconds gauge\n"
+			"ttydump_compare_latency_seconds{stat=\"last\"} %.9g\n"
+			"ttydump_compare_latency_seconds{stat=\"mean\"} %.9g\n"
+			"ttydump_compare_latency_seconds{stat=\"min\"} %.9g\n"
+			"ttydump_compare_latency_seconds{stat=\"max\"} %.9g\n",
+			(double)c->lat_last / NANOSECONDS_PER_SECOND, c->lat_mean / NANOSECONDS_PER_SECOND,
+			(double)c->lat_min / NANOSECONDS_PER_SECOND, (double)c->lat_max / NANOSECONDS_PER_SECOND);
+	}
+}
+
+//	Write the port and stage labels of a boot stage sample, without the closing brace
+void metrics_stage_labels(FILE *f, app_context_t *app, int stage) {
+	fputs("{port=\"", f);
+	metrics_label(f, app->path);
+	fputs("\",stage=\"", f);
+	metrics_label(f, (stage < app->boot->count) ? app->boot->names[stage] : "total");
+	fputc('"', f);
+}
+
+//	Boot counts and per-stage duration quantiles of ports with a boot profiler
+void metrics_boot(FILE *f, session_t *ses) {
+	static const double quantiles[] = { 0.5, 0.9, 0.99 };
+	app_context_t *app;
+	boot_profile_t *b;
+	int i, k, q;
+	
+	fprintf(f, "# HELP ttydump_boots_total Boots seen by the '-B' profiler, by result\n"
+		"# TYPE ttydump_boots_total counter\n");
+	for (i = 0; i < ses->nports; i++) {
+		app = &ses->ports[i];
+		if (!(b = app->boot)) {
+			continue;
+		}
+		fputs("ttydump_boots_total{port=\"", f);
+		metrics_label(f, app->path);
+		fprintf(f, "\",result=\"complete\"} %u\nttydump_boots_total{port=\"", b->complete);
+		metrics_label(f, app->path);
+		fprintf(f, "\",result=\"incomplete\"} %u\n", b->boots - b->complete);
+	}
+	fprintf(f, "# HELP ttydump_boot_stage_seconds Time from the previous milestone (or boot start) to a milestone\n"
+		"# TYPE ttydump_boot_stage_seconds summary\n");
+	for (i = 0; i < ses->nports; i++) {
+		app = &ses->ports[i];
+		if (!(b = app->boot) || !b->complete) {
+			continue;
+		}
+		for (k = 0; k <= b->count; k++) {
+			for (q = 0; q < 3; q++) {
+				fputs("ttydump_boot_stage_seconds", f);
+				metrics_stage_labels(f, app, k);
+				fprintf(f, ",quantile=\"%g\"} %.9g\n", quantiles[q],
+					(double)boot_percentile(b, k, quantiles[q] * 100) / NANOSECONDS_PER_SECOND);
+			}
+			fputs("ttydump_boot_stage_seconds_sum", f);
+			metrics_stage_labels(f, app, k);
+			fprintf(f, "} %.9g\n", (double)b->sum[k] / NANOSECONDS_PER_SECOND);
+			fputs("ttydump_boot_stage_seconds_count", f);
+			metrics_stage_labels(f, app, k);
+			fprintf(f, "} %u\n", b->complete);
+		}
+	}
+}
+
+double metric_clock_frames(app_context_t *app) {
+	return (app->clock) ? (double)app->clock->frames : 0;
+}
+
+double metric_clock_drift(app_context_t *app) {
+	return (app->clock) ? clock_drift_ppm(app->clock) : 0;
+}
+
+double metric_clock_floor(app_context_t *app) {
+	return (app->clock) ? clock_floor(app->clock) : 0;
+}
+
+//	Device clock estimates, with the latency above the floor as a histogram
+void metrics_clock(FILE *f, session_t *ses) {
+	app_context_t *app;
+	uint64_t n;
+	int i, k;
+	
+	metrics_ports(f, ses, "ttydump_clock_frames_total", "counter",
+		"Frames with a device clock field", metric_clock_frames);
+	metrics_ports(f, ses, "ttydump_clock_drift_ppm", "gauge",
+		"Device clock drift against the host clock", metric_clock_drift);
+	metrics_ports(f, ses, "ttydump_clock_latency_floor_seconds", "gauge",
+		"Lowest host minus device time, the minimum transport latency for device epoch times",
+		metric_clock_floor);
+	fprintf(f, "# HELP ttydump_clock_latency_seconds Transport latency above the floor\n"
+		"# TYPE ttydump_clock_latency_seconds histogram\n");
+	for (i = 0; i < ses->nports; i++) {
+		app = &ses->ports[i];
+		if (!app->clock) {
+			continue;
+		}
+		for (k = 0, n = 0; k <= CLOCK_BUCKETS; k++) {
+			n += app->clock->buckets[k];
+			fputs("ttydump_clock_latency_seconds_bucket{port=\"", f);
+			metrics_label(f, app->path);
+			if (k < CLOCK_BUCKETS) {
+				fprintf(f, "\",le=\"%g\"} %llu\n", clock_bounds[k], (unsigned long long)n);
+			} else {
+				fprintf(f, "\",le=\"+Inf\"} %llu\n", (unsigned long long)n);
+			}
+		}
+		fputs("ttydump_clock_latency_seconds_sum{port=\"", f);
+		metrics_label(f, app->path);
+		fprintf(f, "\"} %.9g\nttydump_clock_latency_seconds_count{port=\"", app->clock->latency_sum);
+		metrics_label(f, app->path);
+		fprintf(f, "\"} %llu\n", (unsigned long long)app->clock->latency_count);
+	}
+}
+
+//	Write one sample per port and enabled anomaly detector, 'which' selects the value
+void metrics_detectors(FILE *f, session_t *ses, cmd_options_t *opt, const char *name,
+	const char *type, const char *help, int which) {
+	ewma_detector_t *d;
+	int i, k;
+	
+	fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+	for (i = 0; i < ses->nports; i++) {
+		for (k = 0; k < ANOMALY_DETECTORS && ses->ports[i].anomaly; k++) {
+			if (!opt->val_A_z[k]) {
+				continue;
+			}
+			d = &ses->ports[i].anomaly->det[k];
+			fprintf(f, "%s{port=\"", name);
+			metrics_label(f, ses->ports[i].path);
+			fprintf(f, "\",detector=\"%s\"} %.9g\n", anomaly_names[k],
+				(which == 0) ? (double)d->alerts : (which == 1) ? d->mean : sqrt(d->var));
+		}
+	}
+}
+
+//	Write one RS-485 per-address sample for every port and address seen
+void metrics_rs485_nodes(FILE *f, session_t *ses, const char *name, const char *type,
+	const char *help, int which) {
+	rs485_node_t *node;
+	int i, a;
+	
+	fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+	for (i = 0; i < ses->nports; i++) {
+		if (!ses->ports[i].rs485) {
+			continue;
+		}
+		for (a = 0; a < RS485_ADDRESSES; a++) {
+			node = &ses->ports[i].rs485->nodes[a];
+			if (!node->requests || (which == 3 && !node->responses)) {
+				continue;
+			}
+			fprintf(f, "%s{port=\"", name);
+			metrics_label(f, ses->ports[i].path);
+			fprintf(f, "\",address=\"0x%02x\"} %.9g\n", a,
+				(which == 0) ? (double)node->requests : (which == 1) ? (double)node->responses :
+				(which == 2) ? (double)(node->req_bytes + node->resp_bytes) : node->mean / 1e3);
+		}
+	}
+}
+
+//	RS-485 traffic and mean turnaround per address
+void metrics_rs485(FILE *f, session_t *ses) {
+	metrics_rs485_nodes(f, ses, "ttydump_rs485_requests_total", "counter",
+		"Address bytes sent to the node", 0);
+	metrics_rs485_nodes(f, ses, "ttydump_rs485_responses_total", "counter",
+		"Responses from the node", 1);
+	metrics_rs485_nodes(f, ses, "ttydump_rs485_bytes_total", "counter",
+		"Data bytes of requests to and responses from the node", 2);
+	metrics_rs485_nodes(f, ses, "ttydump_rs485_turnaround_seconds", "gauge",
+		"Mean time from the end of a request to the start of the node's response", 3);
+}
+
+//	Alert counts and current estimates of the anomaly detectors enabled by '-A'
+void metrics_anomaly(FILE *f, session_t *ses, cmd_options_t *opt) {
+	metrics_detectors(f, ses, opt, "ttydump_anomaly_alerts_total", "counter",
+		"Observations which left an anomaly detector's bounds", 0);
+	metrics_detectors(f, ses, opt, "ttydump_anomaly_mean", "gauge",
+		"EWMA mean of an anomaly detector's observations (s, bytes/s or errors/s)", 1);
+	metrics_detectors(f, ses, opt, "ttydump_anomaly_stddev", "gauge",
+		"EWMA standard deviation of an anomaly detector's observations", 2);
+}
+
+//	Write metrics to the '-M' textfile, replacing it atomically
+int metrics_write(session_t *ses, cmd_options_t *opt) {
+	char tmp[4096];
+	FILE *f;
+	
+	if (!opt->opt_M) {
+		return 0;
+	}
+	snprintf(tmp, sizeof(tmp), "%s.tmp", opt->val_M);
+	f = fopen(tmp, "w");
+	if (!f) {
+		fprintf(stderr, "%sError%s: Couldn't write metrics file '%s': %s\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET,
+			tmp, strerror(errno));
+		return -1;
+	}
+	metrics_ports(f, ses, "ttydump_port_up", "gauge",
+		"Whether the port is open and being read", metric_up);
+	metrics_ports(f, ses, "ttydump_port_config_seconds", "gauge",
+		"Time taken to open and configure the port", metric_config_seconds);
+	metrics_ports(f, ses, "ttydump_port_bytes_total", "counter",
+		"Bytes received from the port", metric_bytes);
+	fprintf(f, "# HELP ttydump_wakeups_total Main loop wakeups, by cause\n"
+		"# TYPE ttydump_wakeups_total counter\n"
+		"ttydump_wakeups_total{cause=\"io\"} %llu\n"
+		"ttydump_wakeups_total{cause=\"timer\"} %llu\n",
+		(unsigned long long)(ses->wakeups - ses->timer_wakeups),
+		(unsigned long long)ses->timer_wakeups);
+	if (opt->opt_B) {
+		metrics_boot(f, ses);
+	}
+	if (opt->opt_D) {
+		metrics_clock(f, ses);
+	}
+	if (opt->opt_A) {
+		metrics_anomaly(f, ses, opt);
+	}
+	if (opt->opt_J) {
+		metrics_ports(f, ses, "ttydump_journal_lines_total", "counter",
+			"Lines framed for the journal or syslog sink", metric_journal_lines);
+		metrics_ports(f, ses, "ttydump_journal_dropped_total", "counter",
+			"Lines dropped while the journal or syslog daemon was not keeping up", metric_journal_dropped);
+	}
+	if (opt->opt_K && ses->compare) {
+		metrics_compare(f, ses);
+	}
+	if (opt->opt_N) {
+		metrics_rs485(f, ses);
+	}
+	if (opt->opt_H) {
+		metrics_ports(f, ses, "ttydump_flow_throttled_seconds_total", "counter",
+			"Time the sender was throttled by '-H' flow control", metric_flow_seconds);
+		metrics_ports(f, ses, "ttydump_flow_throttles_total", "counter",
+			"Times the backlog passed the high watermark and the sender was throttled", metric_flow_throttles);
+	}
+	fclose(f);
+	if (rename(tmp, opt->val_M)) {
+		fprintf(stderr, "%sError%s: Couldn't replace metrics file '%s': %s\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET,
+			opt->val_M, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+#else
+
+//	Metrics excluded from this build
+int metrics_write(session_t *ses, cmd_options_t *opt) {
+	return 0;
+}
+
+#endif	/* FEATURE_METRICS */
+
+#if FEATURE_CONTROL
+//	Parse an on/off control argument
+int control_flag(const char *arg) {
+	if (!arg) {
+		return -1;
+	}
+	if (!strcmp(arg, "on") || !strcmp(arg, "1")) {
+		return 1;
+	}
+	if (!strcmp(arg, "off") || !strcmp(arg, "0")) {
+		return 0;
+	}
+	return -1;
+}
+
+//	Change the tty baud rate once queued output has drained, without flushing input
+int config_baud(app_context_t *app, cmd_options_t *opt, uint32_t rate) {
+	struct termios tty;
+	int speed = convert_baud_rate(rate);
+	
+	if (!speed) {
+		fprintf(stderr, "%sError%s: Unsupported baud rate %u\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET,
+			rate);
+		return -1;
+	}
+	if (opt->opt_r) {
+		fprintf(stderr, "%sError%s: Baud rate does not apply to '-r' (Replay filename)\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET);
+		return -1;
+	}
+	if (app->state != PORT_READY) {
+		return 0;
+	}
+	if (tcgetattr(app->tty, &tty)) {
+		fprintf(stderr, "%s: Error: tcgetattr: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+	cfsetospeed(&tty, speed);
+	cfsetispeed(&tty, speed);
+	if (tcsetattr(app->tty, TCSADRAIN, &tty)) {
+		fprintf(stderr, "%s: Error: tcsetattr: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+	opt->val_b = speed;
+	opt->val_rate = rate;
+	app->rx_size = rx_read_size(rate);
+	return 0;
+}
+
+//	Apply a single control command between chunks
+//	Output settings are applied to a copy of the options and only kept if the new output stage builds
+void control_command(session_t *ses, cmd_options_t *opt, char *line) {
+	cmd_options_t next = *opt;
+	int i;
+	char *cmd, *arg, *rest;
+	char *val_e = NULL, *val_f = NULL, *val_E = NULL;
+	uint8_t *flag = NULL;
+	long width;
+	int on;
+	
+	//	Split into command, first argument and remainder of the line
+	cmd = strtok_r(line, " \t\r", &rest);
+	if (!cmd || *cmd == '#') {
+		return;
+	}
+	while (*rest == ' ' || *rest == '\t') {
+		rest++;
+	}
+	arg = (*rest) ? rest : NULL;
+	
+	if (!strcmp(cmd, "mode") && arg) {
+		next.opt_a = next.opt_m = next.opt_e = next.opt_f = next.opt_l = next.opt_G = next.opt_U = 0;
+		if (!strcmp(arg, "ascii")) {
+			next.opt_a = 1;
+		} else if (!strcmp(arg, "midi")) {
+			next.opt_m = 1;
+		} else if (!strcmp(arg, "hex")) {
+			next.opt_d = 0;
+		} else if (!strcmp(arg, "dec")) {
+			next.opt_d = 1;
+		} else {
+			goto invalid;
+		}
+	} else if (!strcmp(cmd, "format") && arg) {
+		next.opt_a = next.opt_m = next.opt_f = next.opt_l = next.opt_G = next.opt_U = 0;
+		next.opt_e = 1;
+		next.val_e = val_e = strdup(arg);
+	} else if (!strcmp(cmd, "export") && arg) {
+		next.opt_a = next.opt_m = next.opt_e = next.opt_l = next.opt_G = next.opt_U = 0;
+		next.opt_f = 1;
+		next.val_f = val_f = strdup(arg);
+		//	Optional 'frame' argument after the encoding name
+		rest = strpbrk(val_f, " \t");
+		next.opt_F = 0;
+		if (rest) {
+			*rest++ = '\0';
+			rest += strspn(rest, " \t");
+			if (strcmp(rest, "frame")) {
+				goto invalid;
+			}
+			next.opt_F = 1;
+		}
+	} else if (!strcmp(cmd, "regex")) {
+		//	Without a pattern, highlighting and filtering are turned off
+		next.opt_E = (arg != NULL);
+		if (arg) {
+			next.val_E = val_E = strdup(arg);
+		}
+	} else if (!strcmp(cmd, "width") && arg) {
+		width = strtol(arg, NULL, 10);
+		if (width < MIN_COLUMN_WIDTH || width > MAX_COLUMN_WIDTH) {
+			goto invalid;
+		}
+		next.opt_w = 1;
+		next.val_w = (uint8_t)width;
+	} else if (!strcmp(cmd, "baud") && arg) {
+		for (i = 0; i < ses->nports; i++) {
+			if (config_baud(&ses->ports[i], opt, (uint32_t)strtoul(arg, NULL, 10))) {
+				return;
+			}
+		}
+		fprintf(stderr, "\nControl: baud %s\n", arg);
+		return;
+	} else if (!strcmp(cmd, "metrics") && !arg) {
+		metrics_write(ses, opt);
+		return;
+	} else if (!strcmp(cmd, "snapshot") && !arg) {
+		for (i = 0; i < ses->nports; i++) {
+			if (ses->ports[i].vt) {
+				vt_snapshot(&ses->ports[i], opt, "control");
+			}
+		}
+		return;
+	} else {
+		//	On/off switches
+		if (!strcmp(cmd, "decimal")) flag = &next.opt_d;
+		else if (!strcmp(cmd, "zero")) flag = &next.opt_z;
+		else if (!strcmp(cmd, "color")) flag = &next.opt_c;
+		else if (!strcmp(cmd, "single")) flag = &next.opt_x;
+		else if (!strcmp(cmd, "timestamp")) flag = &next.opt_t;
+		else if (!strcmp(cmd, "delta-ns")) flag = &next.opt_n;
+		else if (!strcmp(cmd, "delta-sec")) flag = &next.opt_s;
+		else if (!strcmp(cmd, "filter")) flag = &next.opt_L;
+		on = control_flag(arg);
+		if (!flag || on < 0) {
+			goto invalid;
+		}
+		*flag = (uint8_t)on;
+	}
+	
+	//	Swap in the new output stage, keeping the current one on failure
+	for (i = 0; i < ses->nports; i++) {
+		if (config_output(&ses->ports[i], &next) && i == 0) {
+			free(val_e);
+			free(val_f);
+			free(val_E);
+			return;
+		}
+	}
+	if (val_e) {
+		free(opt->val_e);
+	}
+	if (val_f) {
+		free(opt->val_f);
+	}
+	if (val_E) {
+		free(opt->val_E);
+	}
+	*opt = next;
+	fprintf(stderr, "\nControl: %s%s%s\n", cmd, (arg) ? " " : "", (arg) ? arg : "");
+	return;
+	
+	invalid:
+	free(val_e);
+	free(val_f);
+	free(val_E);
+	fprintf(stderr, "\n%sError%s: Invalid control command '%s'\n",
+		ESC_COLOR_MAGENTA,
+		ESC_COLOR_RESET,
+		cmd);
+}
+
+//	Create (if needed) and open the control FIFO
+int control_open(session_t *ses, cmd_options_t *opt) {
+	control_t *ctl = &ses->ctl;
+	ctl->fd = -1;
+	if (!opt->opt_C) {
+		return 0;
+	}
+	if (mkfifo(opt->val_C, 0600) == 0) {
+		ctl->created = 1;
+	} else if (errno != EEXIST) {
+		fprintf(stderr, "%sError%s: Couldn't create control FIFO '%s': %s\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET,
+			opt->val_C, strerror(errno));
+		return -1;
+	}
+	//	Opened read/write so that writers closing the FIFO never signal end of file
+	ctl->fd = open(opt->val_C, O_RDWR | O_NONBLOCK);
+	if (ctl->fd < 0) {
+		fprintf(stderr, "%sError%s: Couldn't open control FIFO '%s': %s\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET,
+			opt->val_C, strerror(errno));
+		return -1;
+	}
+	fprintf(stderr, "Listening for control commands on %s\n", opt->val_C);
+	return 0;
+}
+
+//	Close and remove the control FIFO
+void control_close(session_t *ses, cmd_options_t *opt) {
+	control_t *ctl = &ses->ctl;
+	if (ctl->fd >= 0) {
+		close(ctl->fd);
+		ctl->fd = -1;
+	}
+	if (ctl->created) {
+		unlink(opt->val_C);
+	}
+}
+
+//	Read pending control input and apply each complete line
+void control_read(session_t *ses, cmd_options_t *opt) {
+	control_t *ctl = &ses->ctl;
+	int i;
+	char *line, *nl;
+	ssize_t len;
+	
+	while ((len = read(ctl->fd, ctl->line + ctl->len, CONTROL_LINE_SIZE - 1 - ctl->len)) > 0) {
+		ctl->len += len;
+		ctl->line[ctl->len] = '\0';
+		line = ctl->line;
+		while ((nl = strchr(line, '\n'))) {
+			*nl = '\0';
+			for (i = 0; i < ses->nports; i++) {
+				out_flush(&ses->ports[i].out);
+			}
+			control_command(ses, opt, line);
+			line = nl + 1;
+		}
+		//	Keep the partial line, discard lines that overflow the buffer
+		ctl->len -= line - ctl->line;
+		memmove(ctl->line, line, ctl->len);
+		if (ctl->len == CONTROL_LINE_SIZE - 1) {
+			ctl->len = 0;
+		}
+	}
+	fflush(stderr);
+}
+
+#else
+
+//	Control FIFO excluded from this build
+int control_open(session_t *ses, cmd_options_t *opt) {
+	ses->ctl.fd = -1;
+	return 0;
+}
+
+void control_close(session_t *ses, cmd_options_t *opt) {
+}
+
+void control_read(session_t *ses, cmd_options_t *opt) {
+}
+
+#endif	/* FEATURE_CONTROL */
+
+//	Little-endian field helpers for the capture header
+void put_le(uint8_t *p, uint64_t v, int n) {
+	int i;
+	for (i = 0; i < n; i++) {
+		p[i] = (uint8_t)(v >> (8 * i));
+	}
+}
+
+uint64_t get_le(const uint8_t *p, int n) {
+	uint64_t v = 0;
+	int i;
+	for (i = n - 1; i >= 0; i--) {
+		v = (v << 8) | p[i];
+	}
+	return v;
+}
+
+#if FEATURE_CAPTURE
+//	Start a timestamped capture, writing its header to the output file
+//	Header: magic, version, flags, reserved, char time (ns), resolution (ns), start time (ns)
+int capture_start(app_context_t *app, cmd_options_t *opt) {
+	capture_state_t *cap = &app->cap_out;
+	uint8_t header[CAPTURE_HEADER_SIZE];
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_REALTIME, &ts);
+	memset(cap, 0, sizeof(capture_state_t));
+	cap->char_ns = char_time_ns(opt->val_rate);
+	cap->res_ns = CAPTURE_RESOLUTION_NS;
+	cap->start_ns = ts.tv_sec * NANOSECONDS_PER_SECOND + ts.tv_nsec;
+	cap->last = cap->start_ns / cap->res_ns;
+	cap->nominal = (cap->char_ns + cap->res_ns / 2) / cap->res_ns;
+	
+	memset(header, 0, sizeof(header));
+	memcpy(header, CAPTURE_MAGIC, 4);
+	header[4] = CAPTURE_VERSION;
+	header[5] = CAPTURE_FLAG_INTERPOLATED;
+	put_le(header + 8, cap->char_ns, 4);
+	put_le(header + 12, cap->res_ns, 4);
+	put_le(header + 16, (uint64_t)cap->start_ns, 8);
+	if (fwrite(header, sizeof(header), 1, app->fd) != 1) {
+		fprintf(stderr, "%sError%s: Couldn't write capture header to '%s': %s\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET,
+			opt->val_o, strerror(errno));
+		return -1;
+	}
+	cap->bytes_out = sizeof(header);
+	return 0;
+}
+
+//	Append a received chunk to a timestamped capture
+//	read() only reports when the chunk arrived, so earlier bytes are interpolated back at the
+//	current character time; each byte is followed by the zigzag varint of its arrival delta
+//	minus the nominal character time, one byte for back-to-back characters
+void capture_write(app_context_t *app, cmd_options_t *opt, const uint8_t *buf, int len) {
+	static uint8_t rec[RX_BUFFER_SIZE * CAPTURE_MAX_RECORD];
+	capture_state_t *cap = &app->cap_out;
+	struct timespec ts;
+	int64_t now, t, residual;
+	uint64_t zz;
+	uint32_t char_ns = char_time_ns(opt->val_rate);
+	size_t n = 0;
+	int i;
+	
+	clock_gettime(CLOCK_REALTIME, &ts);
+	now = ts.tv_sec * NANOSECONDS_PER_SECOND + ts.tv_nsec;
+	for (i = 0; i < len; i++) {
+		t = (now - (int64_t)(len - 1 - i) * char_ns) / cap->res_ns;
+		if (t < cap->last) {
+			t = cap->last;
+		}
+		residual = (t - cap->last) - (int64_t)cap->nominal;
+		cap->last = t;
+		
+		rec[n++] = buf[i];
+		zz = ((uint64_t)residual << 1) ^ (uint64_t)(residual >> 63);
+		while (zz >= 0x80) {
+			rec[n++] = (uint8_t)(zz | 0x80);
+			zz >>= 7;
+		}
+		rec[n++] = (uint8_t)zz;
+		
+		//	Flush records from replayed chunks larger than the tty read size
+		if (n > sizeof(rec) - CAPTURE_MAX_RECORD) {
+			fwrite(rec, sizeof(uint8_t), n, app->fd);
+			cap->bytes_out += n;
+			n = 0;
+		}
+	}
+	fwrite(rec, sizeof(uint8_t), n, app->fd);
+	cap->bytes_out += n;
+	cap->bytes_in += len;
+}
+
+//	Print timestamped capture storage statistics
+void capture_report(app_context_t *app) {
+	capture_state_t *cap = &app->cap_out;
+	if (cap->bytes_in) {
+		fprintf(stderr, "Capture: %llu bytes, %llu bytes written (%.2f timestamp bytes per byte)\n",
+			(unsigned long long)cap->bytes_in,
+			(unsigned long long)cap->bytes_out,
+			(double)(cap->bytes_out - CAPTURE_HEADER_SIZE - cap->bytes_in) / (double)cap->bytes_in);
+	}
+}
+
+//	Check for and parse a timestamped capture header at the start of a replay file
+//	Returns 1 for a timestamped capture, 0 for a raw capture (rewound to the start)
+int capture_detect(app_context_t *app, cmd_options_t *opt) {
+	capture_state_t *cap = &app->cap_in;
+	uint8_t header[CAPTURE_HEADER_SIZE];
+	ssize_t len;
+	
+	memset(cap, 0, sizeof(capture_state_t));
+	len = read(app->tty, header, sizeof(header));
+	if (len != sizeof(header) || memcmp(header, CAPTURE_MAGIC, 4)) {
+		lseek(app->tty, 0, SEEK_SET);
+		return 0;
+	}
+	if (header[4] != CAPTURE_VERSION) {
+		fprintf(stderr, "%sError%s: Unsupported capture version %d in '%s'\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET,
+			header[4], opt->val_r);
+		return -1;
+	}
+	cap->char_ns = (uint32_t)get_le(header + 8, 4);
+	cap->res_ns = (uint32_t)get_le(header + 12, 4);
+	cap->start_ns = (int64_t)get_le(header + 16, 8);
+	if (!cap->res_ns) {
+		fprintf(stderr, "%sError%s: Invalid capture header in '%s'\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET,
+			opt->val_r);
+		return -1;
+	}
+	cap->last = cap->start_ns / cap->res_ns;
+	cap->nominal = (cap->char_ns + cap->res_ns / 2) / cap->res_ns;
+	cap->active = 1;
+	fprintf(stderr, "Replaying timestamped capture (%u ns per character)\n", cap->char_ns);
+	return 1;
+}
+
+#else
+
+//	Timestamped captures excluded from this build
+int capture_start(app_context_t *app, cmd_options_t *opt) {
+	return -1;
+}
+
+void capture_write(app_context_t *app, cmd_options_t *opt, const uint8_t *buf, int len) {
+}
+
+void capture_report(app_context_t *app) {
+}
+
+int capture_detect(app_context_t *app, cmd_options_t *opt) {
+	return 0;
+}
+
+#endif	/* FEATURE_CAPTURE */
+
+#if FEATURE_LOG
+//	Multi-port log, records from all ports are appended to one aligned buffer, which is written
+//	at its aligned file offset once full, or in part (to be rewritten when full) by the flush timer
+void log_write_buffer(log_writer_t *w, size_t len) {
+	ssize_t n = pwrite(w->fd, w->buf, len, (off_t)w->base);
+	w->writes++;
+	if (n != (ssize_t)len && !w->failed) {
+		fprintf(stderr, "%sError%s: Couldn't write log file '%s': %s\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET,
+			w->path, (n < 0) ? strerror(errno) : "Short write");
+		w->failed = 1;
+	}
+	if (len == LOG_BUFFER_SIZE) {
+		w->base += LOG_BUFFER_SIZE;
+		w->len = 0;
+	}
+}
+
+//	Append bytes to the log buffer, writing it out each time it fills
+void log_put(log_writer_t *w, const uint8_t *data, size_t len) {
+	size_t n;
+	while (len) {
+		n = LOG_BUFFER_SIZE - w->len;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(w->buf + w->len, data, n);
+		w->len += n;
+		data += n;
+		len -= n;
+		if (w->len == LOG_BUFFER_SIZE) {
+			log_write_buffer(w, LOG_BUFFER_SIZE);
+		}
+	}
+}
+
+//	Create the '-O' log and write its header
+log_writer_t *log_open(session_t *ses, cmd_options_t *opt) {
+	log_writer_t *w = calloc(1, sizeof(log_writer_t));
+	uint8_t header[LOG_HEADER_SIZE];
+	struct timespec ts;
+	size_t n;
+	int i;
+	
+	if (!w || !(w->buf = arena_alloc(&ses->arena, LOG_BUFFER_SIZE, LOG_ALIGN))) {
+		fprintf(stderr, "%sError%s: Couldn't allocate log buffer\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET);
+		free(w);
+		return NULL;
+	}
+	fprintf(stderr, "Opening log file %s...\n", opt->val_O);
+	w->fd = open(opt->val_O, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (w->fd < 0) {
+		fprintf(stderr, "%sError%s: Couldn't open log file '%s': %s\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET,
+			opt->val_O, strerror(errno));
+		free(w);
+		return NULL;
+	}
+	w->path = opt->val_O;
+	w->t0 = clock_mono_ns();
+	clock_gettime(CLOCK_REALTIME, &ts);
+	
+	//	Header, followed by the length-prefixed path of each port
+	memset(header, 0, sizeof(header));
+	memcpy(header, LOG_MAGIC, 4);
+	header[4] = LOG_VERSION;
+	header[6] = (uint8_t)ses->nports;
+	put_le(header + 8, LOG_SEGMENT_SIZE, 4);
+	put_le(header + 16, (uint64_t)ts.tv_sec * NANOSECONDS_PER_SECOND + ts.tv_nsec, 8);
+	log_put(w, header, sizeof(header));
+	for (i = 0; i < ses->nports; i++) {
+		n = strlen(ses->ports[i].path);
+		put_le(header, n, 2);
+		log_put(w, header, 2);
+		log_put(w, (const uint8_t *)ses->ports[i].path, n);
+	}
+	return w;
+}
+
+//	Make room for the index entry of segment 'seg', returns 0 (and drops the index) on failure
+int log_index_grow(log_writer_t *w, uint64_t seg) {
+	uint64_t *grown;
+	size_t cap;
+	
+	if (seg >= w->cap) {
+		cap = (w->cap) ? w->cap * 2 : 64;
+		while (cap <= seg) {
+			cap *= 2;
+		}
+		grown = realloc(w->index, cap * 2 * sizeof(uint64_t));
+		if (!grown) {
+			//	Without a complete index, readers fall back to reading every record
+			fprintf(stderr, "%sError%s: Couldn't grow log index, '%s' will have none\n",
+				ESC_COLOR_MAGENTA,
+				ESC_COLOR_RESET,
+				w->path);
+			w->noindex = 1;
+			return 0;
+		}
+		w->index = grown;
+		w->cap = cap;
+	}
+	while (w->nsegs <= seg) {
+		w->index[2 * w->nsegs] = LOG_NO_RECORD;
+		w->index[2 * w->nsegs + 1] = 0;
+		w->nsegs++;
+	}
+	return 1;
+}
+
+//	Append a chunk received by 'port' at 't' (ns since the log was opened) as one or more records
+//	Each segment's index entry has the offset of the first record starting in it, and a mask of
+//	the ports with records starting in it
+void log_append(log_writer_t *w, int port, int64_t t, const uint8_t *data, int len) {
+	uint8_t header[LOG_RECORD_HEADER];
+	uint64_t at, seg;
+	int n;
+	
+	while (len > 0) {
+		n = (len > LOG_MAX_RECORD) ? LOG_MAX_RECORD : len;
+		at = w->base + w->len;
+		seg = at / LOG_SEGMENT_SIZE;
+		if (!w->noindex && log_index_grow(w, seg)) {
+			if (w->index[2 * seg] == LOG_NO_RECORD) {
+				w->index[2 * seg] = at;
+			}
+			w->index[2 * seg + 1] |= (uint64_t)1 << port;
+		}
+		
+		header[0] = (uint8_t)port;
+		header[1] = 0;
+		put_le(header + 2, (uint64_t)n, 2);
+		put_le(header + 4, (uint64_t)t, 8);
+		log_put(w, header, sizeof(header));
+		log_put(w, data, n);
+		w->records++;
+		w->bytes += n;
+		data += n;
+		len -= n;
+	}
+	
+	//	Bound what a crash can lose, without writing more than once per interval
+	if (!w->timer.deadline && w->len) {
+		timer_arm(&w->timer, clock_mono_ns() + (int64_t)LOG_FLUSH_MS * 1000000,
+			(int64_t)LOG_FLUSH_MS * 1000000 / IDLE_SLACK_DIVISOR);
+	}
+}
+
+//	Log a processed chunk, timed by its last byte
+void log_chunk(app_context_t *app, cmd_options_t *opt, const uint8_t *buf, int len) {
+	int64_t step, t = chunk_time(app, opt, len, &step) + (int64_t)(len - 1) * step;
+	t -= (app->cap_in.active) ? app->cap_in.start_ns : app->log->t0;
+	log_append(app->log, app->log_port, t, buf, len);
+}
+
+//	Flush timer, writes the partial buffer, which stays in memory to be completed
+void log_timer(void *arg, cmd_options_t *opt) {
+	log_writer_t *w = (log_writer_t *)arg;
+	if (w->len) {
+		log_write_buffer(w, w->len);
+	}
+}
+
+//	Append the segment index and trailer, write the rest of the buffer and close the log
+void log_close(log_writer_t *w) {
+	uint8_t trailer[LOG_TRAILER_SIZE], entry[16];
+	uint64_t at = w->base + w->len;
+	uint32_t i;
+	
+	for (i = 0; i < w->nsegs && !w->noindex; i++) {
+		put_le(entry, w->index[2 * i], 8);
+		put_le(entry + 8, w->index[2 * i + 1], 8);
+		log_put(w, entry, sizeof(entry));
+	}
+	if (!w->noindex) {
+		memcpy(trailer, LOG_INDEX_MAGIC, 4);
+		put_le(trailer + 4, w->nsegs, 4);
+		put_le(trailer + 8, at, 8);
+		log_put(w, trailer, sizeof(trailer));
+	}
+	if (w->len) {
+		log_write_buffer(w, w->len);
+	}
+	close(w->fd);
+	fprintf(stderr, "Log (%s): %llu records, %llu data bytes, %llu file bytes in %llu writes\n",
+		w->path, (unsigned long long)w->records, (unsigned long long)w->bytes,
+		(unsigned long long)(w->base + w->len), (unsigned long long)w->writes);
+	free(w->index);
+	free(w);
+}
+
+#else
+
+//	Multi-port log excluded from this build
+log_writer_t *log_open(session_t *ses, cmd_options_t *opt) {
+	return NULL;
+}
+
+void log_chunk(app_context_t *app, cmd_options_t *opt, const uint8_t *buf, int len) {
+}
+
+void log_timer(void *arg, cmd_options_t *opt) {
+}
+
+void log_close(log_writer_t *w) {
+}
+
+#endif	/* FEATURE_LOG */
+
+#if FEATURE_JOURNAL
+//	Parse a '-J' sink, 'journal' or 'syslog', with an optional ':<socket>' path
+int journal_parse(cmd_options_t *opt, const char *spec) {
+	const char *path = strchr(spec, ':');
+	size_t n = (path) ? (size_t)(path - spec) : strlen(spec);
+	
+	if (n == 7 && !strncmp(spec, "journal", n)) {
+		opt->val_J_syslog = 0;
+		path = (path) ? path + 1 : JOURNAL_SOCKET;
+	} else if (n == 6 && !strncmp(spec, "syslog", n)) {
+		opt->val_J_syslog = 1;
+		path = (path) ? path + 1 : SYSLOG_SOCKET;
+	} else {
+		return -1;
+	}
+	if (!*path || strlen(path) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+		return -1;
+	}
+	free(opt->val_J);
+	opt->val_J = strdup(path);
+	return 0;
+}
+
+//	Open a non-blocking datagram socket connected to the journal or syslog daemon, so it polls
+//	writable once the daemon's queue has room, and build the constant part of each port's messages
+journal_t *journal_open(session_t *ses, cmd_options_t *opt) {
+	journal_t *j = arena_alloc(&ses->arena, sizeof(journal_t), ARENA_ALIGN);
+	struct timespec real;
+	int i, pid = (int)getpid();
+	
+	if (!j || !(j->ports = arena_alloc(&ses->arena, ses->nports * sizeof(journal_port_t), ARENA_ALIGN))) {
+		fprintf(stderr, "%sError%s: Couldn't allocate journal sink\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET);
+		return NULL;
+	}
+	j->path = opt->val_J;
+	j->syslog = opt->val_J_syslog;
+	j->wait = opt->opt_r;
+	j->addr.sun_family = AF_UNIX;
+	strncpy(j->addr.sun_path, j->path, sizeof(j->addr.sun_path) - 1);
+	j->fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (j->fd < 0 || fcntl(j->fd, F_SETFL, O_NONBLOCK) ||
+		connect(j->fd, (struct sockaddr *)&j->addr, sizeof(j->addr))) {
+		fprintf(stderr, "%sError%s: Couldn't connect to %s socket '%s': %s\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET,
+			(j->syslog) ? "syslog" : "journal", j->path, strerror(errno));
+		if (j->fd >= 0) {
+			close(j->fd);
+		}
+		return NULL;
+	}
+	
+	//	Live arrival times are monotonic, sent as realtime
+	clock_gettime(CLOCK_REALTIME, &real);
+	j->real_offset = real.tv_sec * NANOSECONDS_PER_SECOND + real.tv_nsec - clock_mono_ns();
+	
+	for (i = 0; i < ses->nports; i++) {
+		if (j->syslog) {
+			snprintf(j->ports[i].prefix, JOURNAL_PREFIX_MAX, "%s[%d]: %s ",
+				JOURNAL_IDENTIFIER, pid, ses->ports[i].path);
+		} else {
+			snprintf(j->ports[i].prefix, JOURNAL_PREFIX_MAX,
+				"PRIORITY=%d\nSYSLOG_IDENTIFIER=%s\nSYSLOG_PID=%d\nTTYDUMP_PORT=%s\nMESSAGE=",
+				JOURNAL_PRIORITY, JOURNAL_IDENTIFIER, pid, ses->ports[i].path);
+		}
+		j->ports[i].prefix_len = (int)strlen(j->ports[i].prefix);
+	}
+	fprintf(stderr, "Forwarding lines to %s socket %s\n", (j->syslog) ? "syslog" : "journal", j->path);
+	return j;
+}
+
+//	Send up to 'n' messages in one call where possible, returns the number sent or -1
+int journal_send(journal_t *j, struct mmsghdr *hdr, int n) {
+#ifdef __linux__
+	return sendmmsg(j->fd, hdr, n, MSG_DONTWAIT);
+#else
+	int i;
+	for (i = 0; i < n; i++) {
+		if (sendmsg(j->fd, &hdr[i].msg_hdr, MSG_DONTWAIT) < 0) {
+			return (i) ? i : -1;
+		}
+	}
+	return n;
+#endif	/* __linux__ */
+}
+
+//	Send the queued messages, oldest first. When the daemon's queue is full, they stay queued
+//	until the socket polls writable, so the reader never waits on the daemon. Messages it
+//	refuses are dropped, after reconnecting once in case it has been restarted
+void journal_flush(journal_t *j) {
+	struct mmsghdr hdr[JOURNAL_BATCH];
+	struct iovec iov[JOURNAL_BATCH][3];
+	struct pollfd pfd = { j->fd, POLLOUT, 0 };
+	journal_port_t *p;
+	int i, k, n, sent;
+	
+	while (j->n) {
+		n = (j->n < JOURNAL_BATCH) ? j->n : JOURNAL_BATCH;
+		memset(hdr, 0, sizeof(hdr[0]) * n);
+		for (i = 0; i < n; i++) {
+			k = (j->first + i) % JOURNAL_QUEUE;
+			p = &j->ports[j->port[k]];
+			iov[i][0].iov_base = j->msg[k];
+			iov[i][0].iov_len = j->head[k];
+			iov[i][1].iov_base = p->prefix;
+			iov[i][1].iov_len = p->prefix_len;
+			iov[i][2].iov_base = j->msg[k] + j->head[k];
+			iov[i][2].iov_len = j->len[k] - j->head[k];
+			hdr[i].msg_hdr.msg_iov = iov[i];
+			hdr[i].msg_hdr.msg_iovlen = 3;
+		}
+		sent = journal_send(j, hdr, n);
+		j->calls++;
+		if (sent < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+				//	A replay has no sender to keep up with, so it waits until the daemon has room
+				if (j->wait && poll(&pfd, 1, JOURNAL_CLOSE_MS) > 0) {
+					continue;
+				}
+				j->blocked = 1;
+				break;
+			}
+			if ((errno == ECONNREFUSED || errno == ENOTCONN) && !j->retried) {
+				j->retried = 1;
+				if (!connect(j->fd, (struct sockaddr *)&j->addr, sizeof(j->addr))) {
+					continue;
+				}
+			}
+			
+			//	The daemon is gone or refused the message, drop it and carry on
+			if (!j->failed) {
+				fprintf(stderr, "%sError%s: Couldn't send to %s socket '%s': %s\n",
+					ESC_COLOR_MAGENTA,
+					ESC_COLOR_RESET,
+					(j->syslog) ? "syslog" : "journal", j->path, strerror(errno));
+				j->failed = 1;
+			}
+			j->ports[j->port[j->first]].dropped++;
+			sent = 1;
+		} else {
+			j->sent += sent;
+			j->retried = 0;
+		}
+		j->first = (j->first + sent) % JOURNAL_QUEUE;
+		j->n -= sent;
+	}
+	if (j->n && !j->blocked && !j->timer.deadline) {
+		timer_arm(&j->timer, clock_mono_ns() + (int64_t)JOURNAL_FLUSH_MS * 1000000,
+			(int64_t)JOURNAL_FLUSH_MS * 1000000 / IDLE_SLACK_DIVISOR);
+	}
+}
+
+//	Queue a port's completed line, with its arrival time as a field. Lines are sent once a batch
+//	has been queued, or by the flush timer, and dropped (and counted) while the queue is full
+void journal_line_end(journal_t *j, int port) {
+	journal_port_t *p = &j->ports[port];
+	int64_t us = p->t / 1000;
+	time_t sec = (time_t)(us / 1000000);
+	struct tm tm;
+	char *m;
+	int k, h = 0;
+	
+	p->open = 0;
+	while (p->len && p->line[p->len - 1] == '\r') {
+		p->len--;
+	}
+	if (!p->len) {
+		return;
+	}
+	p->lines++;
+	if (j->n == JOURNAL_QUEUE && !j->blocked) {
+		journal_flush(j);
+	}
+	if (j->n == JOURNAL_QUEUE) {
+		p->dropped++;
+		p->len = 0;
+		return;
+	}
+	k = (j->first + j->n) % JOURNAL_QUEUE;
+	m = j->msg[k];
+	if (j->syslog) {
+		//	RFC 3164 header, as sent by syslog(3), and the exact arrival time ahead of the line
+		localtime_r(&sec, &tm);
+		h = snprintf(m, JOURNAL_HEAD_MAX, "<%d>", JOURNAL_FACILITY * 8 + JOURNAL_PRIORITY);
+		h += (int)strftime(m + h, JOURNAL_HEAD_MAX - h, "%b %e %H:%M:%S ", &tm);
+		j->head[k] = h;
+		h += snprintf(m + h, JOURNAL_HEAD_MAX - h, "%lld.%06d: ", (long long)sec, (int)(us % 1000000));
+	} else {
+		h = snprintf(m, JOURNAL_HEAD_MAX, "TTYDUMP_ARRIVAL_USEC=%lld\n", (long long)us);
+		j->head[k] = h;
+	}
+	memcpy(m + h, p->line, p->len);
+	h += p->len;
+	if (!j->syslog) {
+		m[h++] = '\n';
+	}
+	j->len[k] = h;
+	j->port[k] = (uint8_t)port;
+	j->n++;
+	p->len = 0;
+	
+	if (j->n >= JOURNAL_BATCH && !j->blocked) {
+		journal_flush(j);
+	} else if (!j->timer.deadline) {
+		timer_arm(&j->timer, clock_mono_ns() + (int64_t)JOURNAL_FLUSH_MS * 1000000,
+			(int64_t)JOURNAL_FLUSH_MS * 1000000 / IDLE_SLACK_DIVISOR);
+	}
+}
+
+//	Frame a received chunk into lines, each timed by its first byte. Lines longer than
+//	JOURNAL_LINE_MAX are split
+void journal_feed(app_context_t *app, cmd_options_t *opt, const uint8_t *buf, int len) {
+	journal_port_t *p = &app->journal->ports[app->journal_port];
+	int64_t step, t = chunk_time(app, opt, len, &step);
+	const uint8_t *nl;
+	int i = 0, n, end;
+	
+	if (!app->cap_in.active) {
+		t += app->journal->real_offset;
+	}
+	while (i < len) {
+		if (!p->open) {
+			p->open = 1;
+			p->t = t + (int64_t)i * step;
+		}
+		nl = memchr(buf + i, '\n', len - i);
+		end = (nl) ? (int)(nl - buf) : len;
+		n = end - i;
+		if (n >= JOURNAL_LINE_MAX - p->len) {
+			n = JOURNAL_LINE_MAX - p->len;
+			end = i + n;
+			nl = NULL;
+		}
+		memcpy(p->line + p->len, buf + i, n);
+		p->len += n;
+		i = end + (nl != NULL);
+		if (nl || p->len == JOURNAL_LINE_MAX) {
+			journal_line_end(app->journal, app->journal_port);
+		}
+	}
+}
+
+//	Send a port's partial line, when it goes idle or is closed
+void journal_finish(app_context_t *app) {
+	if (app->journal && app->journal->ports[app->journal_port].open) {
+		journal_line_end(app->journal, app->journal_port);
+	}
+}
+
+//	Flush timer, sends what has been queued since the last batch
+void journal_timer(void *arg, cmd_options_t *opt) {
+	journal_flush((journal_t *)arg);
+}
+
+//	The socket polled writable after the daemon's queue was full, send what has been queued
+//	Until then, lines which find the queue full are dropped without a send call
+void journal_ready(journal_t *j) {
+	j->blocked = 0;
+	journal_flush(j);
+}
+
+//	Send the rest of the queue, waiting briefly for the daemon, and close the socket
+//	The per-port counts are kept for the final metrics
+void journal_close(journal_t *j, session_t *ses) {
+	struct pollfd pfd = { j->fd, POLLOUT, 0 };
+	uint64_t lines = 0, dropped = 0;
+	int i;
+	
+	timer_cancel(&j->timer);
+	journal_ready(j);
+	while (j->n && poll(&pfd, 1, JOURNAL_CLOSE_MS) > 0) {
+		journal_ready(j);
+	}
+	for (; j->n; j->n--, j->first = (j->first + 1) % JOURNAL_QUEUE) {
+		j->ports[j->port[j->first]].dropped++;
+	}
+	for (i = 0; i < ses->nports; i++) {
+		lines += j->ports[i].lines;
+		dropped += j->ports[i].dropped;
+	}
+	close(j->fd);
+	j->fd = -1;
+	fprintf(stderr, "%s (%s): %llu lines, %llu sent in %llu calls, %llu dropped\n",
+		(j->syslog) ? "Syslog" : "Journal", j->path, (unsigned long long)lines,
+		(unsigned long long)j->sent, (unsigned long long)j->calls, (unsigned long long)dropped);
+}
+
+#else
+
+//	Journal and syslog forwarding excluded from this build
+int journal_parse(cmd_options_t *opt, const char *spec) {
+	return 0;
+}
+
+journal_t *journal_open(session_t *ses, cmd_options_t *opt) {
+	return NULL;
+}
+
+void journal_feed(app_context_t *app, cmd_options_t *opt, const uint8_t *buf, int len) {
+}
+
+void journal_finish(app_context_t *app) {
+}
+
+void journal_timer(void *arg, cmd_options_t *opt) {
+}
+
+void journal_ready(journal_t *j) {
+}
+
+void journal_close(journal_t *j, session_t *ses) {
+}
+
+#endif	/* FEATURE_JOURNAL */
+
+#if FEATURE_COMPARE
+//	Gear table of the content-defined chunker, random words from a fixed splitmix64 sequence
+uint64_t compare_gear[256];
+
+//	Parse a '-K' comparison, 'chunks' or 'lines' with an optional ',<window ms>'
+int compare_parse(cmd_options_t *opt, const char *spec) {
+	const char *w = strchr(spec, ',');
+	size_t n = (w) ? (size_t)(w - spec) : strlen(spec);
+	long ms = COMPARE_DEF_WINDOW_MS;
+	char *end;
+	
+	if (n == 6 && !strncmp(spec, "chunks", n)) {
+		opt->val_K = COMPARE_CHUNKS;
+	} else if (n == 5 && !strncmp(spec, "lines", n)) {
+		opt->val_K = COMPARE_LINES;
+	} else {
+		return -1;
+	}
+	if (w) {
+		ms = strtol(w + 1, &end, 10);
+		if (end == w + 1 || *end || ms < 1 || ms > COMPARE_MAX_WINDOW_MS) {
+			return -1;
+		}
+	}
+	opt->val_K_window = (uint32_t)ms;
+	return 0;
+}
+
+//	Set up the comparison of the first (A) and second (B) port
+compare_t *compare_new(session_t *ses) {
+	compare_t *c = arena_alloc(&ses->arena, sizeof(compare_t), ARENA_ALIGN);
+	uint64_t x = 0, z;
+	int i;
+	
+	if (!c) {
+		fprintf(stderr, "%sError%s: Couldn't allocate link comparison\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET);
+		return NULL;
+	}
+	for (i = 0; i < 256; i++) {
+		z = (x += 0x9e3779b97f4a7c15ull);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		compare_gear[i] = z ^ (z >> 31);
+	}
+	for (i = 0; i < 2; i++) {
+		c->side[i].fp = FNV_OFFSET;
+		c->path[i] = ses->ports[i].path;
+		c->out[i] = &ses->ports[i].out;
+	}
+	c->lat_min = INT64_MAX;
+	c->lat_max = INT64_MIN;
+	return c;
+}
+
+//	Drop the oldest n[0] pending units of A and n[1] of B, which have no counterpart on the
+//	other link, and report them as a loss (one link only) or a divergence (both links)
+void compare_gap(compare_t *c, cmd_options_t *opt, const int *n) {
+	compare_side_t *s;
+	uint64_t bytes[2] = { 0, 0 };
+	int x, k;
+	
+	for (x = 0; x < 2; x++) {
+		s = &c->side[x];
+		for (k = 0; k < n[x]; k++) {
+			bytes[x] += s->pending[(s->first + k) % COMPARE_PENDING].len;
+		}
+		s->first = (s->first + n[x]) % COMPARE_PENDING;
+		s->n -= n[x];
+		s->unmatched += n[x];
+		s->unmatched_bytes += bytes[x];
+	}
+	out_flush(c->out[0]);
+	out_flush(c->out[1]);
+	if (n[0] && n[1]) {
+		c->divergences++;
+		fprintf(stderr, "\n%sDivergence%s: %d units (%llu bytes) on %s and %d units (%llu bytes) on %s differ\n",
+			(opt->opt_c) ? ESC_COLOR_YELLOW : "", (opt->opt_c) ? ESC_COLOR_RESET : "",
+			n[0], (unsigned long long)bytes[0], c->path[0],
+			n[1], (unsigned long long)bytes[1], c->path[1]);
+	} else {
+		x = (n[1] != 0);
+		c->side[x].losses++;
+		fprintf(stderr, "\n%sLoss%s: %d units (%llu bytes) only on %s, missing on %s\n",
+			(opt->opt_c) ? ESC_COLOR_YELLOW : "", (opt->opt_c) ? ESC_COLOR_RESET : "",
+			n[x], (unsigned long long)bytes[x], c->path[x], c->path[!x]);
+	}
+}
+
+//	Give up on units still pending on either link after the window, checked by the report
+//	timer so that a link which went silent is reported once a second rather than per unit
+void compare_expire(compare_t *c, cmd_options_t *opt, int64_t now) {
+	int64_t limit = now - (int64_t)opt->val_K_window * 1000000;
+	compare_side_t *s;
+	int x, n[2];
+	
+	for (x = 0; x < 2; x++) {
+		s = &c->side[x];
+		for (n[x] = 0; n[x] < s->n && s->pending[(s->first + n[x]) % COMPARE_PENDING].t < limit; n[x]++);
+	}
+	if (n[0] || n[1]) {
+		compare_gap(c, opt, n);
+	}
+}
+
+//	Match a unit cut from link x against the units pending on the other link, oldest first
+//	Both links carry the same stream, so units pending before a match on either one are
+//	missing from the other
+void compare_unit(compare_t *c, cmd_options_t *opt, int x, const compare_unit_t *u) {
+	compare_side_t *s = &c->side[x], *o = &c->side[!x];
+	compare_unit_t *m = NULL;
+	int64_t lat;
+	int i, n[2];
+	
+	s->units++;
+	for (i = 0; i < o->n; i++) {
+		m = &o->pending[(o->first + i) % COMPARE_PENDING];
+		if (m->fp == u->fp && m->len == u->len) {
+			break;
+		}
+	}
+	if (i == o->n) {
+		//	Wait for the other link, the oldest pending units give way when the ring is full
+		if (s->n == COMPARE_PENDING) {
+			n[x] = COMPARE_PENDING / 4;
+			n[!x] = 0;
+			compare_gap(c, opt, n);
+		}
+		s->pending[(s->first + s->n++) % COMPARE_PENDING] = *u;
+		return;
+	}
+	lat = (x) ? u->t - m->t : m->t - u->t;
+	n[x] = s->n;
+	n[!x] = i;
+	if (n[0] || n[1]) {
+		compare_gap(c, opt, n);
+	}
+	o->first = (o->first + 1) % COMPARE_PENDING;
+	o->n--;
+	
+	//	Latency of B relative to A
+	c->matched++;
+	c->lat_last = lat;
+	c->lat_mean += ((double)lat - c->lat_mean) / (double)c->matched;
+	if (lat < c->lat_min) {
+		c->lat_min = lat;
+	}
+	if (lat > c->lat_max) {
+		c->lat_max = lat;
+	}
+}
+
+//	Cut a chunk into units, at line ends or at content-defined boundaries where the top bits
+//	of a gear hash over the last 64 bytes are zero, so both links cut identical data alike
+void compare_feed(app_context_t *app, cmd_options_t *opt, const uint8_t *buf, int len) {
+	compare_t *c = app->compare;
+	compare_side_t *s = &c->side[app->compare_side];
+	compare_unit_t u;
+	int64_t step, t = chunk_time(app, opt, len, &step);
+	int i, cut;
+	
+	for (i = 0; i < len; i++) {
+		s->fp = (s->fp ^ buf[i]) * FNV_PRIME;
+		s->len++;
+		if (opt->val_K == COMPARE_LINES) {
+			cut = (buf[i] == '\n' || s->len == COMPARE_MAX_LINE);
+		} else {
+			s->h = (s->h << 1) + compare_gear[buf[i]];
+			cut = ((s->len >= COMPARE_MIN_CHUNK && !(s->h & COMPARE_CHUNK_MASK)) ||
+				s->len == COMPARE_MAX_CHUNK);
+		}
+		if (cut) {
+			u.fp = s->fp;
+			u.len = s->len;
+			u.t = t + (int64_t)i * step;
+			compare_unit(c, opt, app->compare_side, &u);
+			s->fp = FNV_OFFSET;
+			s->len = 0;
+		}
+	}
+	
+	//	Start the report timer again if both links had gone quiet
+	if (!c->timer.deadline) {
+		timer_arm(&c->timer, clock_mono_ns() + (int64_t)COMPARE_REPORT_MS * 1000000,
+			(int64_t)COMPARE_REPORT_MS * 1000000 / IDLE_SLACK_DIVISOR);
+	}
+}
+
+//	Report timer, expires units while a link is silent and shows the latency once a second
+//	It stops once everything is matched or expired and reported, compare_feed() restarts it
+void compare_timer(void *arg, cmd_options_t *opt) {
+	compare_t *c = (compare_t *)arg;
+	
+	compare_expire(c, opt, clock_mono_ns());
+	if (c->matched != c->reported) {
+		out_flush(c->out[0]);
+		out_flush(c->out[1]);
+		fprintf(stderr, "\n%sCompare%s: %llu matched (+%llu), latency B-A %+.3f ms, mean %+.3f ms, "
+			"unmatched %llu on A, %llu on B, %llu divergences\n",
+			(opt->opt_c) ? ESC_COLOR_GREEN : "", (opt->opt_c) ? ESC_COLOR_RESET : "",
+			(unsigned long long)c->matched, (unsigned long long)(c->matched - c->reported),
+			(double)c->lat_last / 1e6, c->lat_mean / 1e6,
+			(unsigned long long)c->side[0].unmatched, (unsigned long long)c->side[1].unmatched,
+			(unsigned long long)c->divergences);
+		c->reported = c->matched;
+	}
+	fflush(stderr);
+	if (c->side[0].n || c->side[1].n) {
+		timer_arm(&c->timer, clock_mono_ns() + (int64_t)COMPARE_REPORT_MS * 1000000,
+			(int64_t)COMPARE_REPORT_MS * 1000000 / IDLE_SLACK_DIVISOR);
+	}
+}
+
+//	Report the comparison, units still pending at exit are not counted as unmatched
+void compare_close(compare_t *c) {
+	compare_side_t *s;
+	int x;
+	
+	timer_cancel(&c->timer);
+	fprintf(stderr, "Compare (A %s, B %s): %llu matched, %llu divergences\n",
+		c->path[0], c->path[1],
+		(unsigned long long)c->matched, (unsigned long long)c->divergences);
+	if (c->matched) {
+		fprintf(stderr, "  Latency B-A: mean %+.3f ms, min %+.3f ms, max %+.3f ms\n",
+			c->lat_mean / 1e6, (double)c->lat_min / 1e6, (double)c->lat_max / 1e6);
+	}
+	fprintf(stderr, "  %-4s %12s %12s %14s %8s %8s\n", "Link", "Units", "Unmatched", "Bytes", "Losses", "Pending");
+	for (x = 0; x < 2; x++) {
+		s = &c->side[x];
+		fprintf(stderr, "  %-4s %12llu %12llu %14llu %8llu %8d\n", (x) ? "B" : "A",
+			(unsigned long long)s->units, (unsigned long long)s->unmatched,
+			(unsigned long long)s->unmatched_bytes, (unsigned long long)s->losses, s->n);
+	}
+}
+
+#else
+
+//	Link comparison excluded from this build
+int compare_parse(cmd_options_t *opt, const char *spec) {
+	return 0;
+}
+
+compare_t *compare_new(session_t *ses) {
+	return NULL;
+}
+
+void compare_feed(app_context_t *app, cmd_options_t *opt, const uint8_t *buf, int len) {
+}
+
+void compare_timer(void *arg, cmd_options_t *opt) {
+}
+
+void compare_close(compare_t *c) {
+}
+
+#endif	/* FEATURE_COMPARE */
+
+#if FEATURE_FLOW
+//	Parse a '-H' flow control, 'rtscts' or 'xonxoff' with optional ',<high>,<low>' watermarks in
+//	percent of the backlog
+int flow_parse(cmd_options_t *opt, const char *spec) {
+	const char *w = strchr(spec, ',');
+	size_t n = (w) ? (size_t)(w - spec) : strlen(spec);
+	long high = FLOW_DEF_HIGH, low = FLOW_DEF_LOW;
+	char *end;
+	
+	if (n == 6 && !strncmp(spec, "rtscts", n)) {
+		opt->val_H = FLOW_RTSCTS;
+	} else if (n == 7 && !strncmp(spec, "xonxoff", n)) {
+		opt->val_H = FLOW_XONXOFF;
+	} else {
+		return -1;
+	}
+	if (w) {
+		high = strtol(w + 1, &end, 10);
+		if (end == w + 1 || *end != ',') {
+			return -1;
+		}
+		w = end;
+		low = strtol(w + 1, &end, 10);
+		if (end == w + 1 || *end) {
+			return -1;
+		}
+	}
+	if (high < 1 || high > 100 || low < 0 || low >= high) {
+		return -1;
+	}
+	opt->val_H_high = (uint8_t)high;
+	opt->val_H_low = (uint8_t)low;
+	return 0;
+}
+
+//	Enable the driver's flow control, which throttles the sender once its buffer is all but full
+void flow_config(struct termios *tty, cmd_options_t *opt) {
+	if (opt->val_H == FLOW_XONXOFF) {
+		tty->c_iflag |= IXOFF;
+		tty->c_cc[VSTART] = 0x11;
+		tty->c_cc[VSTOP] = 0x13;
+#ifdef CRTSCTS
+	} else {
+		tty->c_cflag |= CRTSCTS;
+#endif	/* CRTSCTS */
+	}
+}
+
+//	Backlog of a port in percent, the larger of the unread input in the tty buffer and the
+//	lines queued for the '-J' sink
+int flow_backlog(app_context_t *app) {
+	int n = 0, level;
+	
+	if (ioctl(app->tty, FIONREAD, &n)) {
+		n = 0;
+	}
+	level = (int)((int64_t)n * 100 / FLOW_INPUT_SIZE);
+	if (app->journal && app->journal->n * 100 / JOURNAL_QUEUE > level) {
+		level = app->journal->n * 100 / JOURNAL_QUEUE;
+	}
+	return (level > 100) ? 100 : level;
+}
+
+//	Throttle (deassert RTS or send XOFF) or resume (assert RTS or send XON) the sender
+void flow_set(app_context_t *app, cmd_options_t *opt, uint8_t throttle) {
+	flow_state_t *f = &app->flow;
+	int64_t now = clock_mono_ns();
+	int bits = TIOCM_RTS, rc;
+	
+	if (opt->val_H == FLOW_RTSCTS) {
+		rc = ioctl(app->tty, (throttle) ? TIOCMBIC : TIOCMBIS, &bits);
+	} else {
+		rc = tcflow(app->tty, (throttle) ? TCIOFF : TCION);
+	}
+	if (rc) {
+		out_flush(&app->out);
+		fprintf(stderr, "\n%sError%s: Couldn't %s the sender on %s: %s\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET,
+			(throttle) ? "throttle" : "resume", app->path, strerror(errno));
+		f->failed = 1;
+		return;
+	}
+	if (throttle) {
+		f->throttles++;
+		f->since = now;
+	} else {
+		f->ns += now - f->since;
+	}
+	f->throttled = throttle;
+}
+
+//	Throttle a port whose backlog reached the high watermark, resume it at the low one, and check
+//	throttled ports again shortly, as they may have nothing to read until they are resumed
+void flow_check(session_t *ses, app_context_t *app, cmd_options_t *opt) {
+	flow_state_t *f = &app->flow;
+	int level;
+	
+	if (f->failed || app->state != PORT_READY) {
+		return;
+	}
+	level = flow_backlog(app);
+	if (level > f->peak) {
+		f->peak = (uint8_t)level;
+	}
+	if (!f->throttled && level >= opt->val_H_high) {
+		flow_set(app, opt, 1);
+	} else if (f->throttled && level <= opt->val_H_low) {
+		flow_set(app, opt, 0);
+	}
+	if (f->throttled && !ses->flow.deadline) {
+		timer_arm(&ses->flow, clock_mono_ns() + (int64_t)FLOW_CHECK_MS * 1000000,
+			(int64_t)FLOW_CHECK_MS * 1000000 / IDLE_SLACK_DIVISOR);
+	}
+}
+
+//	Check timer, runs while any port is throttled
+void flow_timer(void *arg, cmd_options_t *opt) {
+	session_t *ses = (session_t *)arg;
+	int i;
+	
+	for (i = 0; i < ses->nports; i++) {
+		if (ses->ports[i].flow.throttled) {
+			flow_check(ses, &ses->ports[i], opt);
+		}
+	}
+}
+
+//	Resume the sender, so the device is not left stopped, and report the time it was throttled
+void flow_finish(app_context_t *app, cmd_options_t *opt) {
+	flow_state_t *f = &app->flow;
+	
+	if (f->throttled) {
+		flow_set(app, opt, 0);
+	}
+	fprintf(stderr, "Flow control (%s): throttled %u times for %.3f s, peak backlog %d%%\n",
+		app->path, f->throttles, (double)f->ns / NANOSECONDS_PER_SECOND, f->peak);
+}
+
+#else
+
+//	Flow control excluded from this build
+int flow_parse(cmd_options_t *opt, const char *spec) {
+	return 0;
+}
+
+void flow_config(struct termios *tty, cmd_options_t *opt) {
+}
+
+void flow_check(session_t *ses, app_context_t *app, cmd_options_t *opt) {
+}
+
+void flow_timer(void *arg, cmd_options_t *opt) {
+}
+
+void flow_finish(app_context_t *app, cmd_options_t *opt) {
+}
+
+#endif	/* FEATURE_FLOW */
+
+#if FEATURE_INDEX
+//	Bit positions of a 4-gram in a filter of (1 << log_bits) bits, by double hashing
+//	Positions are taken modulo a power of two, so they stay valid when the filter is folded
+static inline void index_positions(uint32_t gram, uint8_t log_bits, uint32_t *pos) {
+	uint64_t h = (uint64_t)gram * 0x9e3779b97f4a7c15ull;
+	uint32_t h1, h2, mask = ((uint32_t)1 << log_bits) - 1;
+	int i;
+	h ^= h >> 29;
+	h *= 0xbf58476d1ce4e5b9ull;
+	h ^= h >> 32;
+	h1 = (uint32_t)(h >> 32);
+	h2 = (uint32_t)h | 1;
+	for (i = 0; i < INDEX_HASHES; i++) {
+		pos[i] = (h1 + (uint32_t)i * h2) & mask;
+	}
+}
+
+//	Start an index for a capture file, written next to it as '<path>.idx' by index_finish()
+//	The filter of a port's index is taken from the session arena, others from the heap
+ngram_index_t *index_new(const char *path, arena_t *arena) {
+	ngram_index_t *ix = (arena) ? arena_alloc(arena, sizeof(ngram_index_t), ARENA_ALIGN) :
+		calloc(1, sizeof(ngram_index_t));
+	if (!ix || !(ix->path = strdup(path))) {
+		fprintf(stderr, "%sError%s: Couldn't allocate index for '%s'\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET,
+			path);
+		if (!arena) {
+			free(ix);
+		}
+		return NULL;
+	}
+	ix->log_bits = INDEX_MAX_LOG_BITS;
+	ix->in_arena = (arena != NULL);
+	return ix;
+}
+
+void index_free(ngram_index_t *ix) {
+	if (ix) {
+		free(ix->path);
+		if (!ix->in_arena) {
+			free(ix);
+		}
+	}
+}
+
+//	Add the 4-grams of a chunk of data bytes, continuing the last 4-gram of the previous chunk
+void index_add(ngram_index_t *ix, const uint8_t *buf, size_t len) {
+	uint32_t pos[INDEX_HASHES];
+	size_t i;
+	int k;
+	for (i = 0; i < len; i++) {
+		ix->gram = (ix->gram << 8) | buf[i];
+		if (++ix->len >= INDEX_GRAM) {
+			index_positions(ix->gram, ix->log_bits, pos);
+			for (k = 0; k < INDEX_HASHES; k++) {
+				ix->bits[pos[k] >> 3] |= (uint8_t)(1 << (pos[k] & 7));
+			}
+		}
+	}
+}
+
+//	Number of bits set in the first 'n' bytes of a filter, with the upper half OR-ed in if 'fold'
+uint64_t index_popcount(const uint8_t *bits, size_t n, int fold) {
+	uint64_t count = 0, a, b = 0;
+	size_t i;
+	for (i = 0; i < n; i += 8) {
+		memcpy(&a, bits + i, 8);
+		if (fold) {
+			memcpy(&b, bits + n + i, 8);
+		}
+		count += __builtin_popcountll(a | b);
+	}
+	return count;
+}
+
+//	Halve the filter while it stays sparse enough, then write the index file
+//	Header: magic, version, gram length, hash count, log2 of the filter bits, data bytes, capture size
+int index_finish(ngram_index_t *ix) {
+	uint8_t header[INDEX_HEADER_SIZE];
+	char name[4096];
+	struct stat st;
+	size_t half, i;
+	FILE *f;
+	
+	while (ix->log_bits > INDEX_MIN_LOG_BITS) {
+		half = (size_t)1 << (ix->log_bits - 4);
+		if (index_popcount(ix->bits, half, 1) * 100 > (uint64_t)half * 8 * INDEX_MAX_FILL) {
+			break;
+		}
+		for (i = 0; i < half; i++) {
+			ix->bits[i] |= ix->bits[half + i];
+		}
+		ix->log_bits--;
+	}
+	
+	memset(header, 0, sizeof(header));
+	memcpy(header, INDEX_MAGIC, 4);
+	header[4] = INDEX_VERSION;
+	header[5] = INDEX_GRAM;
+	header[6] = INDEX_HASHES;
+	header[7] = ix->log_bits;
+	put_le(header + 8, ix->len, 8);
+	put_le(header + 16, (stat(ix->path, &st)) ? 0 : (uint64_t)st.st_size, 8);
+	snprintf(name, sizeof(name), "%s.idx", ix->path);
+	f = fopen(name, "wb");
+	if (!f || fwrite(header, sizeof(header), 1, f) != 1 ||
+		fwrite(ix->bits, (size_t)1 << (ix->log_bits - 3), 1, f) != 1 || fclose(f)) {
+		fprintf(stderr, "%sError%s: Couldn't write index '%s': %s\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET,
+			name, strerror(errno));
+		if (f) {
+			fclose(f);
+		}
+		return -1;
+	}
+	return 0;
+}
+
+//	Extract the data bytes of a capture file chunk, dropping timestamped capture arrival times
+//	'state' is -1 for a raw capture, otherwise 1 while inside an arrival time varint
+size_t index_capture_data(int *state, uint8_t *buf, size_t len) {
+	size_t i, n = 0;
+	if (*state < 0) {
+		return len;
+	}
+	for (i = 0; i < len; i++) {
+		if (!*state) {
+			buf[n++] = buf[i];
+			*state = 1;
+		} else if (!(buf[i] & 0x80)) {
+			*state = 0;
+		}
+	}
+	return n;
+}
+
+//	Open a capture file for reading its data bytes, skipping a timestamped capture header
+int index_open(const char *path, int *state) {
+	uint8_t header[CAPTURE_HEADER_SIZE];
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%sError%s: Couldn't open '%s': %s\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET,
+			path, strerror(errno));
+		return -1;
+	}
+	*state = -1;
+	if (read(fd, header, sizeof(header)) == sizeof(header) && !memcmp(header, CAPTURE_MAGIC, 4)) {
+		*state = 0;
+	} else {
+		lseek(fd, 0, SEEK_SET);
+	}
+	return fd;
+}
+
+//	'-I' without '-o': index existing capture files
+int index_files(cmd_options_t *opt) {
+	static uint8_t buf[REPLAY_BUFFER_SIZE];
+	ngram_index_t *ix;
+	ssize_t len;
+	int i, fd, state, rc = 0;
+	
+	for (i = 0; i < opt->nfiles; i++) {
+		fd = index_open(opt->val_files[i], &state);
+		if (fd < 0 || !(ix = index_new(opt->val_files[i], NULL))) {
+			rc = -1;
+			continue;
+		}
+		while ((len = read(fd, buf, sizeof(buf))) > 0) {
+			index_add(ix, buf, index_capture_data(&state, buf, len));
+		}
+		close(fd);
+		if (len < 0 || index_finish(ix)) {
+			rc = -1;
+		} else {
+			fprintf(stderr, "Indexed %s (%llu bytes, %d byte filter)\n", opt->val_files[i],
+				(unsigned long long)ix->len, 1 << (ix->log_bits - 3));
+		}
+		index_free(ix);
+	}
+	return rc;
+}
+
+//	Check a capture's index for the 4-grams of a query
+//	Returns 0 if the capture can't contain the query, 1 if it may, -1 without a current index
+int index_check(const char *path, const uint8_t *q, size_t n) {
+	static uint8_t bits[1 << (INDEX_MAX_LOG_BITS - 3)];
+	uint8_t header[INDEX_HEADER_SIZE];
+	uint32_t gram = 0, pos[INDEX_HASHES];
+	char name[4096];
+	struct stat st;
+	size_t i;
+	int k, rc = -1;
+	FILE *f;
+	
+	snprintf(name, sizeof(name), "%s.idx", path);
+	if (stat(path, &st) || !(f = fopen(name, "rb"))) {
+		return -1;
+	}
+	if (fread(header, sizeof(header), 1, f) == 1 && !memcmp(header, INDEX_MAGIC, 4) &&
+		header[4] == INDEX_VERSION && header[5] == INDEX_GRAM && header[6] == INDEX_HASHES &&
+		header[7] >= INDEX_MIN_LOG_BITS && header[7] <= INDEX_MAX_LOG_BITS &&
+		get_le(header + 16, 8) == (uint64_t)st.st_size &&
+		fread(bits, (size_t)1 << (header[7] - 3), 1, f) == 1) {
+		rc = 1;
+		for (i = 0; i < n && rc; i++) {
+			gram = (gram << 8) | q[i];
+			if (i + 1 < INDEX_GRAM) {
+				continue;
+			}
+			index_positions(gram, header[7], pos);
+			for (k = 0; k < INDEX_HASHES; k++) {
+				if (!(bits[pos[k] >> 3] & (1 << (pos[k] & 7)))) {
+					rc = 0;
+				}
+			}
+		}
+	}
+	fclose(f);
+	return rc;
+}
+
+//	Find the first occurrence of 'q' (n >= 2 bytes) in 'buf'
+//	SSE2 compares the first and last query byte at 16 candidate positions at once
+const uint8_t *index_search(const uint8_t *buf, size_t len, const uint8_t *q, size_t n) {
+	const uint8_t *p, *end = buf + len;
+	size_t i = 0;
+#if defined(__SSE2__)
+	const __m128i first = _mm_set1_epi8((char)q[0]);
+	const __m128i last = _mm_set1_epi8((char)q[n - 1]);
+	unsigned mask;
+	int bit;
+	for (; i + n - 1 + 16 <= len; i += 16) {
+		mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(
+			_mm_cmpeq_epi8(first, _mm_loadu_si128((const __m128i *)(buf + i))),
+			_mm_cmpeq_epi8(last, _mm_loadu_si128((const __m128i *)(buf + i + n - 1)))));
+		while (mask) {
+			bit = __builtin_ctz(mask);
+			if (!memcmp(buf + i + bit + 1, q + 1, n - 2)) {
+				return buf + i + bit;
+			}
+			mask &= mask - 1;
+		}
+	}
+#endif	/* __SSE2__ */
+	for (p = buf + i; (size_t)(end - p) >= n; p++) {
+		p = memchr(p, q[0], end - p - n + 1);
+		if (!p || !memcmp(p, q, n)) {
+			return p;
+		}
+	}
+	return NULL;
+}
+
+//	Count occurrences of a query in the data bytes of a capture file, -1 on error
+//	The last n - 1 bytes of each read are kept, so matches across reads are found
+int64_t index_scan(const char *path, const uint8_t *q, size_t n, uint64_t *first) {
+	static uint8_t buf[INDEX_QUERY_MAX + REPLAY_BUFFER_SIZE];
+	const uint8_t *p;
+	uint64_t base = 0;
+	size_t keep = 0, len;
+	ssize_t rd;
+	int64_t count = 0;
+	int fd, state;
+	
+	if ((fd = index_open(path, &state)) < 0) {
+		return -1;
+	}
+	while ((rd = read(fd, buf + keep, REPLAY_BUFFER_SIZE)) > 0) {
+		len = keep + index_capture_data(&state, buf + keep, rd);
+		for (p = buf; (p = (n == 1) ? memchr(p, q[0], buf + len - p) : index_search(p, buf + len - p, q, n)); p++) {
+			if (!count++) {
+				*first = base + (p - buf);
+			}
+		}
+		keep = (len < n - 1) ? len : n - 1;
+		memmove(buf, buf + len - keep, keep);
+		base += len - keep;
+	}
+	close(fd);
+	return (rd < 0) ? -1 : count;
+}
+
+//	'-Q': list the capture files containing a byte sequence
+//	Files whose index rules the sequence out are not opened at all
+int index_query(cmd_options_t *opt) {
+	uint8_t q[INDEX_QUERY_MAX];
+	uint64_t first = 0;
+	int64_t count;
+	size_t plen;
+	int i, n, check, searched = 0, skipped = 0, unindexed = 0, found = 0;
+	const char *path;
+	
+	n = parse_bytes(opt->val_Q, q, INDEX_QUERY_MAX);
+	if (n <= 0) {
+		fprintf(stderr, "%sError%s: Invalid query '-Q', (1-%d bytes)\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET,
+			INDEX_QUERY_MAX);
+		return -1;
+	}
+	for (i = 0; i < opt->nfiles; i++) {
+		path = opt->val_files[i];
+		plen = strlen(path);
+		if (plen > 4 && !strcmp(path + plen - 4, ".idx")) {
+			continue;
+		}
+		check = index_check(path, q, n);
+		if (!check) {
+			skipped++;
+			continue;
+		}
+		unindexed += (check < 0);
+		searched++;
+		count = index_scan(path, q, n, &first);
+		if (count > 0) {
+			found++;
+			printf("%s: %lld matches, first at offset %llu\n", path, (long long)count,
+				(unsigned long long)first);
+		}
+	}
+	fprintf(stderr, "Searched %d of %d files (%d ruled out by their index, %d without a current index), "
+		"%d with matches\n", searched, searched + skipped, skipped, unindexed, found);
+	return 0;
+}
+
+#else
+
+//	Capture indexing excluded from this build
+ngram_index_t *index_new(const char *path, arena_t *arena) {
+	return NULL;
+}
+
+void index_free(ngram_index_t *ix) {
+}
+
+void index_add(ngram_index_t *ix, const uint8_t *buf, size_t len) {
+}
+
+int index_finish(ngram_index_t *ix) {
+	return 0;
+}
+
+int index_files(cmd_options_t *opt) {
+	return -1;
+}
+
+int index_query(cmd_options_t *opt) {
+	return -1;
+}
+
+#endif	/* FEATURE_INDEX */
+
+//	Configure options
+int config_opt(int argc, char **argv, cmd_options_t *opt) {
+	int i;
+	
+	if (argc < 2) {
+		print_usage();
+		return -1;
+	}
+	
+	//	Initialize data structures
+	memset((void*)opt, 0, sizeof(cmd_options_t));
+	
+	//	Parse command line options
+	while ((i = getopt(argc, argv, "xcdztnsamhFTVLIp:M:b:o:w:e:f:r:C:g:E:B:Q:D:l:A:O:P:G:J:K:H:N:U:")) != -1) {
+		switch (i) {
+			case 'x':
+				opt->opt_x = 1;
+				break;
+			case 'c':
+				opt->opt_c = 1;
+				break;
+			case 'd':
+				opt->opt_d = 1;
+				break;
+			case 'z':
+				opt->opt_z = 1;
+				break;
+			case 't':
+				opt->opt_t = 1;
+				break;
+			case 'n':
+				opt->opt_n = 1;
+				break;
+			case 's':
+				opt->opt_s = 1;
+				break;
+			case 'a':
+				opt->opt_a = 1;
+				break;
+			case 'm':
+				opt->opt_m = 1;
+				break;
+			case 'h':
+				print_usage();
+				return 0;
+			case 'p':
+				if (opt->nports == MAX_PORTS) {
+					fprintf(stderr, "%sError%s: Too many '-p' (Device path) options, (max %d)\n",
+						ESC_COLOR_MAGENTA,
+						ESC_COLOR_RESET,
+						MAX_PORTS);
+					return -1;
+				}
+				opt->opt_p = 1;
+				opt->val_ports[opt->nports++] = strdup(optarg);
+				opt->val_p = opt->val_ports[0];
+				break;
+			case 'M':
+				opt->opt_M = 1;
+				opt->val_M = strdup(optarg);
+				break;
+			case 'b':
+				opt->opt_b = 1;
+				opt->val_b = (uint32_t) strtol(optarg, NULL, 10);
+				break;
+			case 'o':
+				opt->opt_o = 1;
+				opt->val_o = strdup(optarg);
+				break;
+			case 'w':
+				opt->opt_w = 1;
+				opt->val_w = (uint8_t) strtol(optarg, NULL, 10);
+				break;
+			case 'e':
+				opt->opt_e = 1;
+				opt->val_e = strdup(optarg);
+				break;
+			case 'f':
+				opt->opt_f = 1;
+				opt->val_f = strdup(optarg);
+				break;
+			case 'F':
+				opt->opt_F = 1;
+				break;
+			case 'T':
+				opt->opt_T = 1;
+				break;
+			case 'V':
+				opt->opt_V = 1;
+				break;
+			case 'r':
+				opt->opt_r = 1;
+				opt->val_r = strdup(optarg);
+				break;
+			case 'C':
+				opt->opt_C = 1;
+				opt->val_C = strdup(optarg);
+				break;
+			case 'E':
+				opt->opt_E = 1;
+				opt->val_E = strdup(optarg);
+				break;
+			case 'L':
+				opt->opt_L = 1;
+				break;
+			case 'I':
+				opt->opt_I = 1;
+				break;
+			case 'Q':
+				opt->opt_Q = 1;
+				opt->val_Q = strdup(optarg);
+				break;
+			case 'D':
+				opt->opt_D = 1;
+				if (clock_parse(opt, optarg)) {
+					fprintf(stderr, "%sError%s: Invalid device clock field '-D', ('<hz>[/1|2|4|8]:<prefix>', prefix 1-%d bytes)\n",
+						ESC_COLOR_MAGENTA,
+						ESC_COLOR_RESET,
+						KMP_MAX_LENGTH);
+					return -1;
+				}
+				break;
+			case 'l':
+				opt->opt_l = 1;
+				if (!strcmp(optarg, "auto")) {
+					opt->val_l = LIN_CHECKSUM_AUTO;
+				} else if (!strcmp(optarg, "classic")) {
+					opt->val_l = LIN_CHECKSUM_CLASSIC;
+				} else if (!strcmp(optarg, "enhanced")) {
+					opt->val_l = LIN_CHECKSUM_ENHANCED;
+				} else {
+					fprintf(stderr, "%sError%s: Invalid LIN checksum model '-l', (classic, enhanced or auto)\n",
+						ESC_COLOR_MAGENTA,
+						ESC_COLOR_RESET);
+					return -1;
+				}
+				break;
+			case 'N':
+				opt->opt_N = 1;
+				if (rs485_parse(opt, optarg)) {
+					fprintf(stderr, "%sError%s: Invalid RS-485 addresses '-N', ('all' or addresses 0-255, and 'demux=<prefix>')\n",
+						ESC_COLOR_MAGENTA,
+						ESC_COLOR_RESET);
+					return -1;
+				}
+				break;
+			case 'U':
+				opt->opt_U = 1;
+				if (vt_parse(opt, optarg)) {
+					fprintf(stderr, "%sError%s: Invalid screen '-U', ('<cols>x<rows>' up to %dx%d, 'snap=<file>', 'on=<string>' up to %d bytes, 'idle')\n",
+						ESC_COLOR_MAGENTA,
+						ESC_COLOR_RESET,
+						VT_MAX_COLS, VT_MAX_ROWS, KMP_MAX_LENGTH - 1);
+					return -1;
+				}
+				break;
+			case 'O':
+				opt->opt_O = 1;
+				opt->val_O = strdup(optarg);
+				break;
+			case 'P':
+				opt->opt_P = 1;
+				opt->val_P = (uint8_t) strtol(optarg, NULL, 10);
+				break;
+			case 'G':
+				opt->opt_G = 1;
+				if (plot_parse(opt, optarg)) {
+					fprintf(stderr, "%sError%s: Invalid plot fields '-G', ('all' or up to %d fields 1-%d, and '@<fps>' 1-%d)\n",
+						ESC_COLOR_MAGENTA,
+						ESC_COLOR_RESET,
+						PLOT_MAX_SERIES, PLOT_MAX_FIELDS, PLOT_MAX_FPS);
+					return -1;
+				}
+				break;
+			case 'J':
+				opt->opt_J = 1;
+				if (journal_parse(opt, optarg)) {
+					fprintf(stderr, "%sError%s: Invalid sink '-J', ('journal' or 'syslog', and ':<socket>')\n",
+						ESC_COLOR_MAGENTA,
+						ESC_COLOR_RESET);
+					return -1;
+				}
+				break;
+			case 'K':
+				opt->opt_K = 1;
+				if (compare_parse(opt, optarg)) {
+					fprintf(stderr, "%sError%s: Invalid comparison '-K', ('chunks' or 'lines', and ',<window ms>' 1-%d)\n",
+						ESC_COLOR_MAGENTA,
+						ESC_COLOR_RESET,
+						COMPARE_MAX_WINDOW_MS);
+					return -1;
+				}
+				break;
+			case 'H':
+				opt->opt_H = 1;
+				if (flow_parse(opt, optarg)) {
+					fprintf(stderr, "%sError%s: Invalid flow control '-H', ('rtscts' or 'xonxoff', and ',<high>,<low>' percent, low below high)\n",
+						ESC_COLOR_MAGENTA,
+						ESC_COLOR_RESET);
+					return -1;
+				}
+				break;
+			case 'A':
+				opt->opt_A = 1;
+				if (anomaly_parse(opt, optarg)) {
+					fprintf(stderr, "%sError%s: Invalid anomaly detection '-A', ('<z>' or 'gap|rate|errors=<z>', and 'capture=<prefix>')\n",
+						ESC_COLOR_MAGENTA,
+						ESC_COLOR_RESET);
+					return -1;
+				}
+				break;
+			case 'g':
+				opt->opt_g = 1;
+				opt->val_g = (uint32_t) strtol(optarg, NULL, 10);
+				break;
+			case 'B':
+				if (opt->nmilestones == BOOT_MAX_MILESTONES) {
+					fprintf(stderr, "%sError%s: Too many '-B' (Boot milestone) options, (max %d)\n",
+						ESC_COLOR_MAGENTA,
+						ESC_COLOR_RESET,
+						BOOT_MAX_MILESTONES);
+					return -1;
+				}
+				if (!*optarg || strlen(optarg) > BOOT_MAX_LENGTH) {
+					fprintf(stderr, "%sError%s: Invalid boot milestone '-B', (1-%d characters)\n",
+						ESC_COLOR_MAGENTA,
+						ESC_COLOR_RESET,
+						BOOT_MAX_LENGTH);
+					return -1;
+				}
+				opt->opt_B = 1;
+				opt->val_milestones[opt->nmilestones++] = strdup(optarg);
+				break;
+			case '?':
+				switch (optopt) {
+					case 'p':
+					case 'M':
+					case 'b':
+					case 'o':
+					case 'w':
+					case 'e':
+					case 'f':
+					case 'r':
+					case 'C':
+					case 'g':
+					case 'E':
+					case 'B':
+					case 'Q':
+					case 'D':
+					case 'l':
+					case 'A':
+					case 'O':
+					case 'P':
+					case 'G':
+					case 'J':
+					case 'K':
+					case 'H':
+					case 'N':
+					case 'U':
+						fprintf(stderr, "%sError%s: Option '%c' requires a value\n",
+							ESC_COLOR_MAGENTA,
+							ESC_COLOR_RESET,
+							optopt);
+						break;
+					default:
+						fprintf(stderr, "%sError%s: Unknown option '%c'\n",
+							ESC_COLOR_MAGENTA,
+							ESC_COLOR_RESET,
+							optopt);
+						break;
+				}
+				return -1;
+			default:
+				fprintf(stderr, "Error parsing command line options\n");
+				print_usage();
+				return -1;
+		}
+	}
+	
+	//	Capture files for '-I' and '-Q'
+	opt->val_files = argv + optind;
+	opt->nfiles = argc - optind;
+	
+	//	Check for required options
+	if ((opt->opt_Q || (opt->opt_I && !opt->opt_o)) && !opt->nfiles) {
+		fprintf(stderr,
+			"%sError%s: '-Q' (Query captures) and '-I' (Index captures) without '-o' require capture filenames\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET
+		);
+		print_usage();
+		return -1;
+	}
+	if (!opt->opt_p && !opt->opt_r && !opt->opt_Q && !(opt->opt_I && !opt->opt_o)) {
+		fprintf(stderr,
+			"%sError%s: '-p' (device path) or '-r' (replay filename) option required\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET
+		);
+		print_usage();
+		return -1;
+	}
+	
+	//	Check for options excluded from this build
+	i = feature_missing(opt);
+	if (i) {
+		fprintf(stderr,
+			"%sError%s: Option '%c' is not available in this build\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET,
+			i
+		);
+		return -1;
+	}
+	
+	//	Check for option conflicts
+	if (opt->opt_a && opt->opt_m) {
+		fprintf(stderr,
+			"%sError%s: '-a' (ASCII) and '-m' (MIDI) output formats are exclusive\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET
+		);
+		print_usage();
+		return -1;
+	}
+	
+	if (opt->opt_p && opt->opt_r) {
+		fprintf(stderr,
+			"%sError%s: '-p' (Device path) and '-r' (Replay filename) are exclusive\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET
+		);
+		print_usage();
+		return -1;
+	}
+	if (opt->opt_Q && (opt->opt_p || opt->opt_r || opt->opt_I)) {
+		fprintf(stderr,
+			"%sError%s: '-Q' (Query captures) and '-p', '-r' or '-I' are exclusive\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET
+		);
+		print_usage();
+		return -1;
+	}
+	if (opt->opt_f && (opt->opt_a || opt->opt_m || opt->opt_e)) {
+		fprintf(stderr,
+			"%sError%s: '-f' (Export encoding) and '-a', '-m' or '-e' output formats are exclusive\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET
+		);
+		print_usage();
+		return -1;
+	}
+	if (opt->opt_l && (opt->opt_a || opt->opt_m || opt->opt_e || opt->opt_f)) {
+		fprintf(stderr,
+			"%sError%s: '-l' (LIN) and '-a', '-m', '-e' or '-f' output formats are exclusive\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET
+		);
+		print_usage();
+		return -1;
+	}
+	if (opt->opt_N && (opt->opt_a || opt->opt_m || opt->opt_e || opt->opt_f || opt->opt_l)) {
+		fprintf(stderr,
+			"%sError%s: '-N' (RS-485) and '-a', '-m', '-e', '-f' or '-l' output formats are exclusive\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET
+		);
+		print_usage();
+		return -1;
+	}
+	if (opt->opt_G && (opt->opt_a || opt->opt_m || opt->opt_e || opt->opt_f || opt->opt_l || opt->opt_N)) {
+		fprintf(stderr,
+			"%sError%s: '-G' (Plot) and '-a', '-m', '-e', '-f', '-l' or '-N' output formats are exclusive\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET
+		);
+		print_usage();
+		return -1;
+	}
+	if (opt->opt_U && (opt->opt_a || opt->opt_m || opt->opt_e || opt->opt_f || opt->opt_l || opt->opt_N || opt->opt_G)) {
+		fprintf(stderr,
+			"%sError%s: '-U' (Screen) and '-a', '-m', '-e', '-f', '-l', '-N' or '-G' output formats are exclusive\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET
+		);
+		print_usage();
+		return -1;
+	}
+	if (opt->opt_K && opt->nports != 2) {
+		fprintf(stderr,
+			"%sError%s: '-K' (Compare links) requires exactly two '-p' ports\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET
+		);
+		print_usage();
+		return -1;
+	}
+	if (opt->opt_e && (opt->opt_a || opt->opt_m)) {
+		fprintf(stderr,
+			"%sError%s: '-e' (Format string) and '-a' (ASCII) or '-m' (MIDI) output formats are exclusive\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET
+		);
+		print_usage();
+		return -1;
+	}
+	
+	//	Check for superfluous options
+	if (opt->opt_m && opt->opt_w) {
+		fprintf(stderr,
+			"%sWarning%s: '-w' (Column width) does not apply to '-m' (MIDI) output option\n",
+			ESC_COLOR_YELLOW,
+			ESC_COLOR_RESET
+		);
+	}
+	if (!opt->opt_m && !opt->opt_a && !opt->opt_l && !opt->opt_G && !opt->opt_N && !opt->opt_U && opt->opt_c) {
+		fprintf(stderr,
+			"%sWarning%s: '-c' (Color output) requires '-m' (MIDI), '-a' (ASCII), '-l' (LIN), '-G' (Plot), '-N' (RS-485) or '-U' (Screen) option\n",
+			ESC_COLOR_YELLOW,
+			ESC_COLOR_RESET
+		);
+	}
+	if (opt->opt_e && (opt->opt_w || opt->opt_d || opt->opt_z ||
+		opt->opt_t || opt->opt_n || opt->opt_s)) {
+		fprintf(stderr,
+			"%sWarning%s: '-w', '-d', '-z', '-t', '-n' and '-s' do not apply to '-e' (Format string) option\n",
+			ESC_COLOR_YELLOW,
+			ESC_COLOR_RESET
+		);
+	}
+	if (opt->opt_F && !opt->opt_f) {
+		fprintf(stderr,
+			"%sWarning%s: '-F' (Export per frame) requires '-f' (Export encoding) option\n",
+			ESC_COLOR_YELLOW,
+			ESC_COLOR_RESET
+		);
+	}
+	if (opt->opt_T && !opt->opt_o) {
+		fprintf(stderr,
+			"%sWarning%s: '-T' (Timestamped capture) requires '-o' (Output filename) option\n",
+			ESC_COLOR_YELLOW,
+			ESC_COLOR_RESET
+		);
+	}
+	if (opt->opt_E && !opt->opt_a) {
+		fprintf(stderr,
+			"%sWarning%s: '-E' (Regex) requires '-a' (ASCII) output format\n",
+			ESC_COLOR_YELLOW,
+			ESC_COLOR_RESET
+		);
+	}
+	if (opt->opt_L && !opt->opt_E) {
+		fprintf(stderr,
+			"%sWarning%s: '-L' (Matching lines only) requires '-E' (Regex) option\n",
+			ESC_COLOR_YELLOW,
+			ESC_COLOR_RESET
+		);
+	}
+	if (opt->opt_H && opt->opt_r) {
+		fprintf(stderr,
+			"%sWarning%s: '-H' (Flow control) does not apply to '-r' (Replay filename)\n",
+			ESC_COLOR_YELLOW,
+			ESC_COLOR_RESET
+		);
+	}
+	if (opt->opt_P && !opt->opt_r) {
+		fprintf(stderr,
+			"%sWarning%s: '-P' (Log port) requires '-r' (Replay filename) option\n",
+			ESC_COLOR_YELLOW,
+			ESC_COLOR_RESET
+		);
+	}
+	if (opt->opt_U && opt->val_U_idle && !opt->opt_g) {
+		fprintf(stderr,
+			"%sWarning%s: '-U idle' (Screen snapshots) requires '-g' (Idle gap) option\n",
+			ESC_COLOR_YELLOW,
+			ESC_COLOR_RESET
+		);
+	}
+	if (opt->opt_U && (opt->val_U_idle || opt->val_U_on_len) && !opt->val_U_snap && !opt->opt_o) {
+		fprintf(stderr,
+			"%sWarning%s: '-U' (Screen) snapshots require 'snap=<file>' or '-o' (Output filename) option\n",
+			ESC_COLOR_YELLOW,
+			ESC_COLOR_RESET
+		);
+	}
+	if (opt->opt_z && opt->opt_a) {
+		fprintf(stderr,
+			"%sWarning%s: '-z' (Zero-prefix) does not apply to '-a' (ASCII) option\n",
+			ESC_COLOR_YELLOW,
+			ESC_COLOR_RESET
+		);
+	}
+	
+	//	Set default output format if invoked without any display options
+	if (opt->opt_x | opt->opt_c | opt->opt_d | opt->opt_z | opt->opt_t |
+		opt->opt_n | opt->opt_s | opt->opt_a | opt->opt_m == 0) {
+		opt->opt_c = 1;
+	}
+	
+	//	Validate baud rate if specified, otherwise set default
+	if (opt->opt_b) {
+		opt->val_rate = opt->val_b;
+		opt->val_b = convert_baud_rate(opt->val_b);
+		if (!opt->val_b) {
+			fprintf(stderr,
+				"%sError%s: Unsupported baud rate '-b'\n",
+				ESC_COLOR_MAGENTA,
+				ESC_COLOR_RESET
+			);
+			print_usage();
+			return -1;
+		}
+	} else {
+		opt->val_rate = DEF_BAUD_RATE;
+		opt->val_b = convert_baud_rate(DEF_BAUD_RATE);
+	}
+	
+	//	Validate idle gap if specified
+	if (opt->opt_g && (opt->val_g < 1 || opt->val_g > MAX_IDLE_GAP_MS)) {
+		fprintf(stderr,
+			"%sError%s: Idle gap '-g' out of range (%d-%d ms)\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET,
+			1, MAX_IDLE_GAP_MS
+		);
+		print_usage();
+		return -1;
+	}
+	
+	//	LIN frames end when the bus goes idle, after a few character times by default
+	if (opt->opt_l && !opt->opt_g) {
+		opt->opt_g = opt->val_g_default = 1;
+		opt->val_g = (uint32_t)(((int64_t)char_time_ns(opt->val_rate) * LIN_IDLE_CHARS + 999999) / 1000000);
+	}
+	
+	//	As do RS-485 segments, the last one is shown once the bus is idle
+	if (opt->opt_N && !opt->opt_g) {
+		opt->opt_g = opt->val_g_default = 1;
+		opt->val_g = (uint32_t)(((int64_t)char_time_ns(opt->val_rate) * RS485_IDLE_CHARS + 999999) / 1000000);
+	}
+	
+	//	Set default column width for raw and ASCII output
+	if (!opt->opt_m) {
+		if (opt->opt_w) {
+			if (opt->val_w < MIN_COLUMN_WIDTH || opt->val_w > MAX_COLUMN_WIDTH) {
+				fprintf(stderr,
+					"%sError%s: Invalid raw output width '-w', (%d-%d)\n",
+					ESC_COLOR_MAGENTA,
+					ESC_COLOR_RESET,
+					MIN_COLUMN_WIDTH,
+					MAX_COLUMN_WIDTH
+				);
+				print_usage();
+				return -1;
+			}
+		} else {
+			opt->val_w = DEF_COLUMN_WIDTH;
+		}
+	}
+	
+	return 0;
+}
+
+//	Configure tty
+int config_tty(app_context_t *app, cmd_options_t *opt) {
+	struct termios tty;
+	int rc;
+	
+	//	Open device file descriptor
+	fprintf(stderr, "Opening device %s...\n", app->path);
+	app->tty = open(app->path, O_RDONLY | O_NOCTTY | O_SYNC);
+	if (app->tty < 0) {
+		fprintf(stderr, "%sError%s: Opening device %s (%d): %s\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET,
+			app->path, errno, strerror(errno));
+		return EXIT_UNLOCKED;
+	}
+	
+	//	Apply exclusive, non-blocking advisory lock on tty once obtained
+	rc = flock(app->tty, LOCK_EX | LOCK_NB);
+	if (rc) {
+		fprintf(stderr, "%sError%s: Couldn't obtain exclusive lock on '%s': %s\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET,
+			app->path, strerror(errno));
+		return EXIT_UNLOCKED;
+	}
+	app->locked = 1;
+	
+	//	Check tty attributes
+	rc = tcgetattr(app->tty, &tty);
+	if (rc) {
+		fprintf(stderr, "%s: Error: tcgetattr: %s\n", __func__, strerror(errno));
+		return EXIT_LOCKED;
+	}
+	
+	//	Initialize struct and set tty baud rate
+	cfmakeraw(&tty);
+	cfsetospeed(&tty, opt->val_b);
+	cfsetispeed(&tty, opt->val_b);
+	
+	//	Configure tty
+	tty.c_cflag |= (
+		CREAD | CS8 | CLOCAL
+	);
+	
+	//	Mark BREAKs and framing errors in-band for the LIN decoder, as \377 \0 \0 and \377 \0 <byte>
+	if (opt->opt_l) {
+		tty.c_iflag &= ~(IGNBRK | BRKINT | IGNPAR | ISTRIP);
+		tty.c_iflag |= (INPCK | PARMRK);
+	}
+	
+	//	Receive the 9th bit as space parity, so address bytes (9th bit set) fail the parity check and
+	//	are marked in-band as \377 \0 <byte> for the RS-485 decoder
+	if (opt->opt_N) {
+#ifdef CMSPAR
+		tty.c_cflag |= (PARENB | CMSPAR);
+		tty.c_cflag &= ~PARODD;
+		tty.c_iflag &= ~(IGNBRK | BRKINT | IGNPAR | ISTRIP);
+		tty.c_iflag |= (INPCK | PARMRK);
+#else
+		fprintf(stderr, "%sError%s: '-N' (RS-485) requires mark/space parity (CMSPAR)\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET);
+		return EXIT_LOCKED;
+#endif	/* CMSPAR */
+	}
+	
+	//	Let the driver throttle the sender as well when its own buffer fills, while reading is blocked
+	if (opt->opt_H) {
+		flow_config(&tty, opt);
+	}
+	
+	//	Set to blocking single-character read()
+	tty.c_cc[VMIN] = 1;
+	tty.c_cc[VTIME] = 1;
+	
+	//	Write configured tty attributes
+	rc = tcsetattr(app->tty, TCSANOW, &tty);
+	if (rc) {
+		fprintf(stderr, "%s: Error: tcsetattr: %s\n", __func__, strerror(errno));
+		return EXIT_LOCKED;
+	}
+	
+	//	Flush tty
+	tcflush(app->tty, TCIOFLUSH);
+	return 0;
+}
+
+//	Open and configure one port, timing it on the monotonic clock
+void open_port(app_context_t *app, cmd_options_t *opt) {
+	struct timespec t0, t1, td;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	app->config_rc = config_tty(app, opt);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	timespec_sub(&t0, &t1, &td);
+	app->config_ns = td.tv_sec * NANOSECONDS_PER_SECOND + td.tv_nsec;
+}
+
+//	Report a configured port to the main loop through the notification pipe
+void open_port_notify(session_t *ses, int i) {
+	ssize_t rc;
+	do {
+		rc = write(ses->notify[1], &i, sizeof(i));
+	} while (rc < 0 && errno == EINTR);
+}
+
+#if FEATURE_THREADS
+//	Worker thread, takes the next unopened port until none are left
+void *open_worker(void *arg) {
+	session_t *ses = (session_t *)arg;
+	open_pool_t *pool = &ses->pool;
+	int i;
+	
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		i = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+		if (i >= ses->nports) {
+			break;
+		}
+		open_port(&ses->ports[i], pool->opt);
+		open_port_notify(ses, i);
+	}
+	return NULL;
+}
+#endif	/* FEATURE_THREADS */
+
+//	Start opening and configuring all ports, on a small thread pool when available
+//	Each port is handed to the main loop through the notification pipe as soon as it is ready
+int open_ports_start(session_t *ses, cmd_options_t *opt) {
+	int i;
+#if FEATURE_THREADS
+	open_pool_t *pool = &ses->pool;
+	sigset_t all, old;
+#endif	/* FEATURE_THREADS */
+	
+	if (pipe(ses->notify)) {
+		fprintf(stderr, "%sError%s: Couldn't create notification pipe: %s\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET,
+			strerror(errno));
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ses->start);
+	ses->pending = ses->nports;
+	for (i = 0; i < ses->nports; i++) {
+		ses->ports[i].state = PORT_OPENING;
+	}
+	
+#if FEATURE_THREADS
+	//	Workers block signals so that SIGINT always interrupts the main loop
+	pool->opt = opt;
+	pthread_mutex_init(&pool->lock, NULL);
+	pool->next = 0;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (pool->nthreads = 0; ses->nports > 1 && pool->nthreads < OPEN_POOL_THREADS &&
+		pool->nthreads < ses->nports; pool->nthreads++) {
+		if (pthread_create(&pool->threads[pool->nthreads], NULL, open_worker, ses)) {
+			break;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (pool->nthreads) {
+		return 0;
+	}
+#endif	/* FEATURE_THREADS */
+	
+	//	Single port, or no threads, configure in turn
+	for (i = 0; i < ses->nports; i++) {
+		open_port(&ses->ports[i], opt);
+		open_port_notify(ses, i);
+	}
+	return 0;
+}
+
+//	Wait for the pool and release the notification pipe once all ports are configured
+void open_ports_finish(session_t *ses) {
+#if FEATURE_THREADS
+	int i;
+	for (i = 0; i < ses->pool.nthreads; i++) {
+		pthread_join(ses->pool.threads[i], NULL);
+	}
+	ses->pool.nthreads = 0;
+#endif	/* FEATURE_THREADS */
+	if (ses->notify[0] >= 0) {
+		close(ses->notify[0]);
+		close(ses->notify[1]);
+		ses->notify[0] = ses->notify[1] = -1;
+	}
+}
+
+//	Process a received chunk in the active output format
+void process_chunk(app_context_t *app, cmd_options_t *opt, uint8_t *buffer, int len) {
+	static app_context_t *last = NULL;
+	uint8_t *p;
+	int64_t step;
+	int count;
+	
+	//	A timestamped replay moves the virtual clock to the chunk's first byte, firing the timers
+	//	due before it, and then to its last byte, like a live read returning the chunk
+	if (vclock.active) {
+		clock_advance(chunk_time(app, opt, len, &step));
+		timer_cancel(&app->idle);
+		clock_advance(app->cap_in.time_ns);
+	}
+	
+	//	Mark which port the output belongs to when several ports are interleaved, drawn plots and
+	//	screens are titled instead
+	if (opt->nports > 1 && last != app && !opt->opt_G && !opt->opt_U) {
+		fprintf(stderr, "\n==> %s <==\n", app->path);
+		last = app;
+	}
+	
+	if (app->exp.kind) {
+		//	Encode the chunk with the selected export encoding
+		export_run(app, opt, buffer, len);
+		out_flush(&app->out);
+	} else if (app->lin && opt->opt_l) {
+		//	Decode LIN frames, one line per frame
+		lin_feed(app, opt, buffer, len);
+		out_flush(&app->out);
+	} else if (app->rs485 && opt->opt_N) {
+		//	Decode RS-485 address bytes, one line per request or response
+		rs485_feed(app, opt, buffer, len);
+		out_flush(&app->out);
+	} else if (app->plot && opt->opt_G) {
+		//	Collect numbers for the plot, which is drawn by the frame timer
+		plot_feed(app, opt, buffer, len);
+	} else if (app->vt && opt->opt_U) {
+		//	Update the emulated screen, which is drawn by the frame timer
+		vt_feed(app, opt, buffer, len);
+	} else if (app->fmt) {
+		//	Run the compiled format program over the whole chunk
+		fmt_run(app, buffer, len);
+		out_flush(&app->out);
+	} else if (app->re) {
+		//	Match the chunk against the regex, highlighting and filtering ASCII output
+		re_feed(app, opt, buffer, len);
+		out_flush(&app->out);
+	} else if (!opt->opt_m) {
+		//	ASCII output, plain characters are copied in bulk
+		print_ascii_run(buffer, len, app, opt);
+		out_flush(&app->out);
+	} else {
+		count = 0;
+		p = buffer;
+		while (1) {
+			
+			//	Print in MIDI output format
+			print_byte_midi(p, app, opt);
+			
+			//	Increment read pointer
+			p++;
+			
+			//	Determine if there are more bytes to process
+			if (++count == len) {
+				break;
+			}
+		}
+	}
+	
+	//	Time boot milestones once the chunk has been shown
+	if (app->boot) {
+		boot_feed(app, opt, buffer, len);
+	}
+	if (app->clock) {
+		clock_feed(app, opt, buffer, len);
+	}
+	if (app->anomaly) {
+		anomaly_feed(app, opt, buffer, len);
+	}
+	if (app->compare) {
+		compare_feed(app, opt, buffer, len);
+	}
+	
+	//	Optionally write binary or timestamped data to output file
+	if (opt->opt_o && app->fd) {
+		if (opt->opt_T) {
+			capture_write(app, opt, buffer, len);
+		} else {
+			fwrite((void*)buffer, sizeof(uint8_t), len, app->fd);
+		}
+		if (app->index) {
+			index_add(app->index, buffer, len);
+		}
+	}
+	if (app->log) {
+		log_chunk(app, opt, buffer, len);
+	}
+	if (app->journal) {
+		journal_feed(app, opt, buffer, len);
+	}
+	app->offset += len;
+	
+	//	Restart the idle gap timer, this only moves its deadline
+	if (opt->opt_g) {
+		timer_arm(&app->idle, clock_mono_ns() + (int64_t)opt->val_g * 1000000,
+			(int64_t)opt->val_g * 1000000 / IDLE_SLACK_DIVISOR);
+	}
+}
+
+//	Idle gap timer, ends the current output line so the next burst starts on a new one
+void port_idle(void *arg, cmd_options_t *opt) {
+	app_context_t *app = (app_context_t *)arg;
+	fmt_op_t *op;
+	
+	if (app->state != PORT_READY) {
+		return;
+	}
+	if (app->exp.kind) {
+		export_finish(app, opt);
+	} else if (app->lin && opt->opt_l) {
+		lin_finish(app, opt);
+	} else if (app->rs485 && opt->opt_N) {
+		rs485_finish(app, opt);
+	} else if (app->vt && opt->opt_U) {
+		vt_finish(app, opt);
+	} else if (app->fmt) {
+		//	Formats which start each cycle on a new line (like the built-in one) need no line break
+		if (app->fmt->active) {
+			app->fmt->active = 0;
+			app->fmt->acc_len = 0;
+			op = &app->fmt->ops[0];
+			if (op->kind != FMT_OP_TEXT || (op->text[0] != '\n' && op->text[0] != '\033')) {
+				out_write(&app->out, "\n", 1);
+			}
+			out_flush(&app->out);
+		}
+	} else if (!opt->opt_m) {
+		//	Make the next byte start a new line (with a timestamp if enabled)
+		re_finish(app, opt);
+		out_flush(&app->out);
+		app->ascii_last = 0xff;
+		app->ascii_count = 0;
+	}
+	journal_finish(app);
+	fflush(stderr);
+}
+
+#if FEATURE_CAPTURE
+//	Decode timestamped capture records, passing runs of back-to-back bytes on as chunks
+static uint8_t replay_chunk[REPLAY_BUFFER_SIZE];
+
+void capture_replay(app_context_t *app, cmd_options_t *opt, const uint8_t *in, int len) {
+	uint8_t *chunk = replay_chunk;
+	capture_state_t *cap = &app->cap_in;
+	int64_t residual;
+	int i;
+	
+	for (i = 0; i < len; i++) {
+		if (!cap->have_byte) {
+			cap->byte = in[i];
+			cap->have_byte = 1;
+			cap->acc = 0;
+			cap->shift = 0;
+			continue;
+		}
+		cap->acc |= (uint64_t)(in[i] & 0x7f) << cap->shift;
+		cap->shift += 7;
+		if (in[i] & 0x80) {
+			if (cap->shift > 63) {
+				//	Corrupt varint, resynchronize on the next byte
+				cap->have_byte = 0;
+			}
+			continue;
+		}
+		residual = (int64_t)(cap->acc >> 1) ^ -(int64_t)(cap->acc & 1);
+		cap->have_byte = 0;
+		
+		//	A gap of more than one idle character time starts a new chunk
+		if (cap->len && (residual > (int64_t)cap->nominal || cap->len == REPLAY_BUFFER_SIZE)) {
+			process_chunk(app, opt, chunk, cap->len);
+			cap->len = 0;
+		}
+		cap->last += cap->nominal + residual;
+		cap->time_ns = cap->last * cap->res_ns;
+		chunk[cap->len++] = cap->byte;
+	}
+}
+
+//	Pass on the last decoded chunk at the end of a timestamped replay
+void capture_replay_finish(app_context_t *app, cmd_options_t *opt) {
+	if (app->cap_in.len) {
+		process_chunk(app, opt, replay_chunk, app->cap_in.len);
+		app->cap_in.len = 0;
+	}
+}
+
+
+#else
+
+//	Timestamped replay excluded from this build
+void capture_replay(app_context_t *app, cmd_options_t *opt, const uint8_t *in, int len) {
+}
+
+void capture_replay_finish(app_context_t *app, cmd_options_t *opt) {
+}
+
+#endif	/* FEATURE_CAPTURE */
+
+#if FEATURE_LOG
+//	Records of the selected port are collected here before they are processed as one chunk
+static uint8_t log_record[LOG_MAX_RECORD];
+
+//	Detect a multi-port log, list its ports and load its segment index if it was closed cleanly
+int log_detect(app_context_t *app, cmd_options_t *opt) {
+	log_reader_t *r;
+	uint8_t header[LOG_HEADER_SIZE], trailer[LOG_TRAILER_SIZE];
+	char path[256];
+	struct stat st;
+	uint64_t at, *index;
+	uint32_t count, i;
+	size_t n;
+	ssize_t got;
+	int nports, k;
+	
+	if (read(app->tty, header, sizeof(header)) != sizeof(header) || memcmp(header, LOG_MAGIC, 4)) {
+		lseek(app->tty, 0, SEEK_SET);
+		return 0;
+	}
+	nports = header[6];
+	if (header[4] != LOG_VERSION || !get_le(header + 8, 4)) {
+		fprintf(stderr, "%sError%s: Unsupported log version %d in '%s'\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET,
+			header[4], opt->val_r);
+		return -1;
+	}
+	if (opt->val_P >= nports) {
+		fprintf(stderr, "%sError%s: Log port '-P' out of range, '%s' has %d ports\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET,
+			opt->val_r, nports);
+		return -1;
+	}
+	r = calloc(1, sizeof(log_reader_t));
+	if (!r) {
+		return -1;
+	}
+	r->port = opt->val_P;
+	r->seg_size = get_le(header + 8, 4);
+	r->start_ns = (int64_t)get_le(header + 16, 8);
+	r->pos = sizeof(header);
+	r->end = LOG_NO_RECORD;
+	r->seg_checked = LOG_NO_RECORD;
+	fprintf(stderr, "Replaying port %d of a %d-port log:\n", r->port, nports);
+	for (k = 0; k < nports; k++) {
+		if (read(app->tty, header, 2) != 2) {
+			break;
+		}
+		n = get_le(header, 2);
+		got = read(app->tty, path, (n < sizeof(path)) ? n : sizeof(path) - 1);
+		path[(got > 0) ? got : 0] = '\0';
+		fprintf(stderr, "  %c %d: %s\n", (k == r->port) ? '>' : ' ', k, path);
+		r->pos += 2 + n;
+		lseek(app->tty, (off_t)r->pos, SEEK_SET);
+	}
+	
+	//	The trailer points to the segment index, which also marks the end of the records
+	if (!fstat(app->tty, &st) && st.st_size >= (off_t)(r->pos + sizeof(trailer)) &&
+		pread(app->tty, trailer, sizeof(trailer), st.st_size - sizeof(trailer)) == sizeof(trailer) &&
+		!memcmp(trailer, LOG_INDEX_MAGIC, 4)) {
+		count = (uint32_t)get_le(trailer + 4, 4);
+		at = get_le(trailer + 8, 8);
+		index = malloc((size_t)count * 2 * sizeof(uint64_t) + 1);
+		if (index && at + (uint64_t)count * 16 + sizeof(trailer) == (uint64_t)st.st_size) {
+			for (i = 0; i < count; i++) {
+				if (pread(app->tty, trailer, 16, (off_t)(at + 16 * i)) != 16) {
+					break;
+				}
+				index[2 * i] = get_le(trailer, 8);
+				index[2 * i + 1] = get_le(trailer + 8, 8);
+			}
+			if (i == count) {
+				r->index = index;
+				r->nsegs = count;
+				r->end = at;
+				index = NULL;
+			}
+		}
+		free(index);
+	}
+	if (!r->index) {
+		fprintf(stderr, "No segment index (log not closed), reading all records\n");
+	}
+	
+	//	Records carry their arrival times, like a timestamped capture
+	app->log_in = r;
+	app->cap_in.active = 1;
+	app->cap_in.char_ns = char_time_ns(opt->val_rate);
+	app->cap_in.start_ns = r->start_ns;
+	return 1;
+}
+
+//	Decode log records, passing those of the selected port on as chunks
+//	At the first record boundary in each segment, segments without records of the port are skipped
+void log_replay(app_context_t *app, cmd_options_t *opt, const uint8_t *in, int len) {
+	log_reader_t *r = app->log_in;
+	uint64_t seg, next;
+	uint32_t j;
+	int i = 0, n;
+	
+	while (i < len && r->pos < r->end) {
+		if (r->hlen < LOG_RECORD_HEADER) {
+			seg = r->pos / r->seg_size;
+			if (!r->hlen && r->index && seg != r->seg_checked) {
+				r->seg_checked = seg;
+				if (seg < r->nsegs && !(r->index[2 * seg + 1] & ((uint64_t)1 << r->port))) {
+					for (j = (uint32_t)seg + 1; j < r->nsegs &&
+						!(r->index[2 * j + 1] & ((uint64_t)1 << r->port)); j++);
+					next = (j < r->nsegs) ? r->index[2 * j] : r->end;
+					r->skipped += next - r->pos;
+					r->pos = next;
+					lseek(app->tty, (off_t)next, SEEK_SET);
+					return;
+				}
+			}
+			r->header[r->hlen++] = in[i++];
+			r->pos++;
+			if (r->hlen == LOG_RECORD_HEADER) {
+				r->rport = r->header[0];
+				r->rlen = (uint32_t)get_le(r->header + 2, 2);
+				r->rtime = (int64_t)get_le(r->header + 4, 8);
+				r->got = 0;
+				r->hlen = (r->rlen) ? r->hlen : 0;
+			}
+			continue;
+		}
+		n = (int)(r->rlen - r->got);
+		if (n > len - i) {
+			n = len - i;
+		}
+		if (r->rport == r->port) {
+			memcpy(log_record + r->got, in + i, n);
+		}
+		r->got += n;
+		r->pos += n;
+		i += n;
+		if (r->got == r->rlen) {
+			r->hlen = 0;
+			if (r->rport == r->port) {
+				app->cap_in.time_ns = r->start_ns + r->rtime;
+				process_chunk(app, opt, log_record, r->rlen);
+			}
+		}
+	}
+}
+
+void log_report(app_context_t *app) {
+	if (app->log_in->skipped) {
+		fprintf(stderr, "Log index: skipped %llu bytes of other ports' records\n",
+			(unsigned long long)app->log_in->skipped);
+	}
+}
+
+void log_reader_free(log_reader_t *r) {
+	if (r) {
+		free(r->index);
+		free(r);
+	}
+}
+
+#else
+
+//	Multi-port log replay excluded from this build
+int log_detect(app_context_t *app, cmd_options_t *opt) {
+	return 0;
+}
+
+void log_replay(app_context_t *app, cmd_options_t *opt, const uint8_t *in, int len) {
+}
+
+void log_report(app_context_t *app) {
+}
+
+void log_reader_free(log_reader_t *r) {
+}
+
+#endif	/* FEATURE_LOG */
+
+//	Finish output, unlock and close a port and its output file
+void port_close(app_context_t *app, cmd_options_t *opt) {
+	if (app->state == PORT_CLOSED) {
+		return;
 	}
-	
-	//	Check for required options
-	if (!opt->opt_p) {
-		fprintf(stderr,
-			"%sError%s: '-p' (device path) option required\n",
-			ESC_COLOR_MAGENTA,
-			ESC_COLOR_RESET
-		);
-		print_usage();
-		return -1;
+	//	The last replayed chunk may first end an idle gap
+	capture_replay_finish(app, opt);
+	timer_cancel(&app->idle);
+	re_finish(app, opt);
+	export_finish(app, opt);
+	if (opt->opt_T && app->fd) {
+		capture_report(app);
 	}
-	
-	//	Check for option conflicts
-	if (opt->opt_a && opt->opt_m) {
-		fprintf(stderr,
-			"%sError%s: '-a' (ASCII) and '-m' (MIDI) output formats are exclusive\n",
-			ESC_COLOR_MAGENTA,
-			ESC_COLOR_RESET
-		);
-		print_usage();
-		return -1;
+	if (app->boot) {
+		boot_report(app);
+	}
+	if (app->clock) {
+		clock_report(app);
+	}
+	if (app->lin) {
+		lin_finish(app, opt);
+		lin_report(app);
+	}
+	if (app->rs485) {
+		rs485_finish(app, opt);
+		rs485_report(app);
+		rs485_close(app->rs485);
+	}
+	if (app->anomaly) {
+		timer_cancel(&app->anomaly->timer);
+		anomaly_report(app, opt);
+	}
+	if (app->log_in) {
+		log_report(app);
+	}
+	if (app->plot && opt->opt_G) {
+		plot_render(app, opt, -1);
+	}
+	if (app->vt) {
+		vt_close(app, opt);
+	}
+	journal_finish(app);
+	if (opt->opt_H && !opt->opt_r && app->state == PORT_READY) {
+		flow_finish(app, opt);
 	}
 	
-	//	Check for superfluous options
-	if (opt->opt_m && opt->opt_w) {
-		fprintf(stderr,
-			"%sWarning%s: '-w' (Column width) does not apply to '-m' (MIDI) output option\n",
-			ESC_COLOR_YELLOW,
-			ESC_COLOR_RESET
-		);
+	//	Remove advisory lock on tty file descriptor
+	if (app->locked) {
+		if (flock(app->tty, LOCK_UN)) {
+			fprintf(stderr, "Couldn't unlock '%s': %s\n",
+				app->path, strerror(errno));
+		}
+		app->locked = 0;
 	}
-	if (!opt->opt_m && !opt->opt_a && opt->opt_c) {
-		fprintf(stderr,
-			"%sWarning%s: '-c' (Color output) requires '-m' (MIDI) or '-a' (ASCII) option\n",
-			ESC_COLOR_YELLOW,
-			ESC_COLOR_RESET
-		);
+	
+	//	Close file descriptors
+	if (app->tty >= 0) {
+		close(app->tty);
+		app->tty = -1;
 	}
-	if (opt->opt_z && opt->opt_a) {
-		fprintf(stderr,
-			"%sWarning%s: '-z' (Zero-prefix) does not apply to '-a' (ASCII) option\n",
-			ESC_COLOR_YELLOW,
-			ESC_COLOR_RESET
-		);
+	if (app->fd) {
+		fclose(app->fd);
+		app->fd = NULL;
 	}
 	
-	//	Set default output format if invoked without any display options
-	if (opt->opt_x | opt->opt_c | opt->opt_d | opt->opt_z | opt->opt_t |
-		opt->opt_n | opt->opt_s | opt->opt_a | opt->opt_m == 0) {
-		opt->opt_c = 1;
+	//	Index the closed output file
+	if (app->index) {
+		index_finish(app->index);
+		index_free(app->index);
+		app->index = NULL;
 	}
+	app->state = PORT_CLOSED;
+}
+
+//	Collect a configured port from the notification pipe and start reading it
+void open_ports_collect(session_t *ses, cmd_options_t *opt) {
+	struct timespec now, td;
+	app_context_t *app;
+	int i, ready = 0;
 	
-	//	Validate baud rate if specified, otherwise set default
-	if (opt->opt_b) {
-		opt->val_b = convert_baud_rate(opt->val_b);
-		if (!opt->val_b) {
-			fprintf(stderr,
-				"%sError%s: Unsupported baud rate '-b'\n",
-				ESC_COLOR_MAGENTA,
-				ESC_COLOR_RESET
-			);
-			print_usage();
-			return -1;
-		}
+	if (read(ses->notify[0], &i, sizeof(i)) != sizeof(i) || i < 0 || i >= ses->nports) {
+		return;
+	}
+	app = &ses->ports[i];
+	ses->pending--;
+	if (app->config_rc) {
+		port_close(app, opt);
 	} else {
-		opt->val_b = convert_baud_rate(DEF_BAUD_RATE);
+		app->rx_size = rx_read_size(opt->val_rate);
+		app->state = PORT_READY;
+		fprintf(stderr, "Opened %s (configured in %.3f ms)\n", app->path,
+			(double)app->config_ns / 1e6);
 	}
 	
-	//	Set default column width for raw and ASCII output
-	if (!opt->opt_m) {
-		if (opt->opt_w) {
-			if (opt->val_w < MIN_COLUMN_WIDTH || opt->val_w > MAX_COLUMN_WIDTH) {
-				fprintf(stderr,
-					"%sError%s: Invalid raw output width '-w', (%d-%d)\n",
-					ESC_COLOR_MAGENTA,
-					ESC_COLOR_RESET,
-					MIN_COLUMN_WIDTH,
-					MAX_COLUMN_WIDTH
-				);
-				print_usage();
-				return -1;
-			}
+	//	Startup summary once the last port is done
+	if (!ses->pending) {
+		open_ports_finish(ses);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		timespec_sub(&ses->start, &now, &td);
+		for (i = 0; i < ses->nports; i++) {
+			ready += (ses->ports[i].state == PORT_READY);
+		}
+		if (ses->nports > 1) {
+			fprintf(stderr, "Configured %d of %d ports in %.3f ms\n",
+				ready, ses->nports, timespec_dec(&td) * 1e3);
+		}
+		metrics_write(ses, opt);
+	}
+	fflush(stderr);
+}
+
+//	Read and process a chunk from a port, returns -1 if interrupted
+int read_port(session_t *ses, cmd_options_t *opt, app_context_t *app, uint8_t *buffer) {
+	int len = read(app->tty, buffer, app->rx_size);
+	if (len > 0) {
+		if (app->log_in) {
+			log_replay(app, opt, buffer, len);
+		} else if (app->cap_in.active) {
+			capture_replay(app, opt, buffer, len);
 		} else {
-			opt->val_w = DEF_COLUMN_WIDTH;
+			process_chunk(app, opt, buffer, len);
+		}
+		if (opt->opt_H && !opt->opt_r) {
+			flow_check(ses, app, opt);
 		}
+	} else if (len < 0 && errno == EINTR) {
+		//	Exit on read() interrupt
+		fprintf(stderr, "\n");
+		return -1;
+	} else if (len < 0) {
+		fprintf(stderr, "Read error on %s: %s\n", app->path, strerror(errno));
+		port_close(app, opt);
+	} else if (opt->opt_r) {
+		//	End of replay file
+		port_close(app, opt);
+	} else {
+		fprintf(stderr, "Read timeout on %s\n", app->path);
+		port_close(app, opt);
+	}
+	fflush(stderr);
+	if (app->fd) {
+		fflush(app->fd);
 	}
-	
 	return 0;
 }
 
-//	Configure tty
-int config_tty(app_context_t *app, cmd_options_t *opt) {
-	struct termios tty;
-	int rc;
+//	Size of the large buffers main() and the features enabled by 'opt' allocate from the arena
+//	for 'nports' ports, so that they share one block
+size_t arena_estimate(cmd_options_t *opt, int nports) {
+	size_t port = sizeof(app_context_t) + ARENA_ALIGN, size = REPLAY_BUFFER_SIZE + ARENA_SLACK;
 	
-	//	Open device file descriptor
-	fprintf(stderr, "Opening device %s...\n", opt->val_p);
-	app->tty = open(opt->val_p, O_RDONLY | O_NOCTTY | O_SYNC);
-	if (app->tty < 0) {
-		fprintf(stderr, "%sError%s: Opening device %s (%d): %s\n",
-			ESC_COLOR_MAGENTA,
-			ESC_COLOR_RESET,
-			opt->val_p, errno, strerror(errno));
-		return EXIT_UNLOCKED;
+	if (opt->opt_B) {
+		port += sizeof(boot_profile_t);
 	}
-	fprintf(stderr, "Opened %s\n", opt->val_p);
-	
-	//	Apply exclusive, non-blocking advisory lock on tty once obtained
-	rc = flock(app->tty, LOCK_EX | LOCK_NB);
-	if (rc) {
-		fprintf(stderr, "%sError%s: Couldn't obtain exclusive lock on '%s': %s\n",
-			ESC_COLOR_MAGENTA,
-			ESC_COLOR_RESET,
-			opt->val_p, strerror(errno));
-		return EXIT_UNLOCKED;
+	if (opt->opt_A) {
+		port += sizeof(anomaly_t) + ((opt->val_A_capture) ? ANOMALY_RING_SIZE : 0);
 	}
-	
-	//	Check tty attributes
-	rc = tcgetattr(app->tty, &tty);
-	if (rc) {
-		fprintf(stderr, "%s: Error: tcgetattr: %s\n", __func__, strerror(errno));
-		return EXIT_LOCKED;
+	if (opt->opt_N) {
+		port += sizeof(rs485_decoder_t);
 	}
-	
-	//	Initialize struct and set tty baud rate
-	cfmakeraw(&tty);
-	cfsetospeed(&tty, opt->val_b);
-	cfsetispeed(&tty, opt->val_b);
-	
-	//	Configure tty
-	tty.c_cflag |= (
-		CREAD | CS8 | CLOCAL
-	);
-	
-	//	Set to blocking single-character read()
-	tty.c_cc[VMIN] = 1;
-	tty.c_cc[VTIME] = 1;
-	
-	//	Write configured tty attributes
-	rc = tcsetattr(app->tty, TCSANOW, &tty);
-	if (rc) {
-		fprintf(stderr, "%s: Error: tcsetattr: %s\n", __func__, strerror(errno));
-		return EXIT_LOCKED;
+	if (opt->opt_G) {
+		port += sizeof(plot_t);
 	}
-	
-	//	Flush tty
-	tcflush(app->tty, TCIOFLUSH);
-	return 0;
+	if (opt->opt_U) {
+		port += vt_size(opt);
+	}
+	if (opt->opt_I && opt->opt_o) {
+		port += sizeof(ngram_index_t);
+	}
+	if (opt->opt_J) {
+		port += sizeof(journal_port_t);
+		size += sizeof(journal_t);
+	}
+	if (opt->opt_O) {
+		size += LOG_BUFFER_SIZE + LOG_ALIGN;
+	}
+	if (opt->opt_K) {
+		size += sizeof(compare_t);
+	}
+	return size + port * nports;
+}
+
+//	SIGINT handler, only interrupts blocking calls in the main loop
+void handle_signal(int sig) {
 }
 
 int main(int argc, char **argv) {
-	int len, count, rc;
-	uint8_t *p, buffer[RX_BUFFER_SIZE];
-	app_context_t app;
+	int i, k, rc = 0, tag[MAX_PORTS + 3];
+	nfds_t nfds;
+	struct pollfd fds[MAX_PORTS + 3];
+	struct sigaction sa;
+	char name[4096];
+	uint8_t *buffer = NULL;
+	app_context_t *ports = NULL;
+	static session_t ses;
 	cmd_options_t opt;
 	
 	//	Allow SIGINT to interrupt main read() loop
-	sigaction(SIGINT, NULL, 0);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	
+	//	Initialize export, ASCII output and screen parser lookup tables
+	hex_pairs_init();
+	base64_pairs_init();
+	ascii_plain_init();
+	vt_table_init();
 	
 	//	Configure options
-	rc = config_opt(argc, argv, &app, &opt);
+	rc = config_opt(argc, argv, &opt);
 	if (rc) {
 		return rc;
 	}
@@ -650,93 +9567,349 @@ int main(int argc, char **argv) {
 	print_options(&opt);
 	#endif
 	
-	//	Open output file if option is specified
-	if (opt.opt_o && opt.val_o) {
-		fprintf(stderr, "Opening output file %s...\n", opt.val_o);
-		app.fd = fopen(opt.val_o, "wb");
-		if (!app.fd) {
+	//	Set up one context per port (or the replay file), in the arena with the other large buffers
+	ses.notify[0] = ses.notify[1] = -1;
+	ses.ctl.fd = -1;
+	k = (opt.opt_r) ? 1 : opt.nports;
+	if (arena_reserve(&ses.arena, arena_estimate(&opt, k)) ||
+		!(ports = arena_alloc(&ses.arena, k * sizeof(app_context_t), ARENA_ALIGN)) ||
+		!(buffer = arena_alloc(&ses.arena, REPLAY_BUFFER_SIZE, ARENA_ALIGN))) {
+		fprintf(stderr, "%sError%s: Couldn't allocate port contexts\n",
+			ESC_COLOR_MAGENTA,
+			ESC_COLOR_RESET);
+		rc = -1;
+		goto exit;
+	}
+	ses.ports = ports;
+	ses.nports = k;
+	for (i = 0; i < ses.nports; i++) {
+		ports[i].tty = -1;
+		ports[i].path = (opt.opt_r) ? opt.val_r : opt.val_ports[i];
+		timer_add(&ses, &ports[i].idle, port_idle, &ports[i]);
+	}
+	
+	//	Query or index capture files instead of reading ports
+	if (opt.opt_Q || (opt.opt_I && !opt.opt_o)) {
+		rc = (opt.opt_Q) ? index_query(&opt) : index_files(&opt);
+		goto exit;
+	}
+	
+	#ifdef __linux__
+	//	Allow the kernel to defer poll() timeouts slightly, to share wakeups with other processes
+	prctl(PR_SET_TIMERSLACK, TIMER_SLACK_NS, 0, 0, 0);
+	#endif
+	for (i = 0; i < ses.nports; i++) {
+		if (config_output(&ports[i], &opt)) {
+			print_usage();
+			rc = -1;
+			goto exit;
+		}
+		if (opt.opt_B && !(ports[i].boot = boot_new(&opt, &ses.arena))) {
+			rc = -1;
+			goto exit;
+		}
+		if (opt.opt_D && !(ports[i].clock = clock_new(&opt))) {
+			rc = -1;
+			goto exit;
+		}
+		if (opt.opt_l && !(ports[i].lin = lin_new())) {
+			rc = -1;
+			goto exit;
+		}
+		if (opt.opt_N && !(ports[i].rs485 = rs485_new(i, &ses.arena))) {
+			rc = -1;
+			goto exit;
+		}
+		if (opt.opt_A) {
+			if (!(ports[i].anomaly = anomaly_new(&opt, i, &ses.arena))) {
+				rc = -1;
+				goto exit;
+			}
+			timer_add(&ses, &ports[i].anomaly->timer, anomaly_timer, &ports[i]);
+		}
+		if (opt.opt_G && !(ports[i].plot = plot_new(&opt, i, ses.nports, &ses.frame, &ses.arena))) {
+			rc = -1;
+			goto exit;
+		}
+		if (opt.opt_U && !(ports[i].vt = vt_new(&opt, i, ses.nports, &ses.frame, &ses.arena))) {
+			rc = -1;
+			goto exit;
+		}
+	}
+	
+	//	Open output files if option is specified, suffixed with the port index for several ports
+	for (i = 0; opt.opt_o && opt.val_o && i < ses.nports; i++) {
+		if (ses.nports > 1) {
+			snprintf(name, sizeof(name), "%s.%d", opt.val_o, i);
+		} else {
+			snprintf(name, sizeof(name), "%s", opt.val_o);
+		}
+		fprintf(stderr, "Opening output file %s...\n", name);
+		ports[i].fd = fopen(name, "wb");
+		if (!ports[i].fd) {
 			fprintf(stderr, "%sError%s: Couldn't open output file '%s': %s\n",
 				ESC_COLOR_MAGENTA,
 				ESC_COLOR_RESET,
-				opt.val_o, strerror(errno));
-			return -1;
+				name, strerror(errno));
+			rc = -1;
+			goto exit;
+		}
+		fprintf(stderr, "Opened %s\n", name);
+		if (opt.opt_T && capture_start(&ports[i], &opt)) {
+			rc = -1;
+			goto exit;
+		}
+		if (opt.opt_I && !(ports[i].index = index_new(name, &ses.arena))) {
+			rc = -1;
+			goto exit;
+		}
+	}
+	
+	//	Open the log shared by all ports if option is specified
+	if (opt.opt_O) {
+		if (!(ses.log = log_open(&ses, &opt))) {
+			rc = -1;
+			goto exit;
+		}
+		timer_add(&ses, &ses.log->timer, log_timer, ses.log);
+		for (i = 0; i < ses.nports; i++) {
+			ports[i].log = ses.log;
+			ports[i].log_port = i;
+		}
+	}
+	
+	//	Open the journal or syslog sink shared by all ports if option is specified
+	if (opt.opt_J) {
+		if (!(ses.journal = journal_open(&ses, &opt))) {
+			rc = -1;
+			goto exit;
+		}
+		timer_add(&ses, &ses.journal->timer, journal_timer, ses.journal);
+		for (i = 0; i < ses.nports; i++) {
+			ports[i].journal = ses.journal;
+			ports[i].journal_port = i;
 		}
-		fprintf(stderr, "Opened %s\n", opt.val_o);
 	}
 	
-	//	Configure tty attributes
+	//	Check throttled ports until their backlog drains if option is specified
+	if (opt.opt_H) {
+		timer_add(&ses, &ses.flow, flow_timer, &ses);
+	}
+	
+	//	Compare the two ports as redundant links if option is specified
+	if (opt.opt_K) {
+		if (!(ses.compare = compare_new(&ses))) {
+			rc = -1;
+			goto exit;
+		}
+		timer_add(&ses, &ses.compare->timer, compare_timer, ses.compare);
+		for (i = 0; i < ses.nports; i++) {
+			ports[i].compare = ses.compare;
+			ports[i].compare_side = i;
+		}
+	}
+	
+	//	Open the replay file, or open and configure the ttys
 	fflush(stderr);
-	rc = config_tty(&app, &opt);
-	if (rc) {
-		switch (rc) {
-			case EXIT_UNLOCKED:
-				goto exit_unlocked;
-			default:
-				goto exit_locked;
+	if (opt.opt_r) {
+		ports[0].tty = open(opt.val_r, O_RDONLY);
+		if (ports[0].tty < 0) {
+			fprintf(stderr, "%sError%s: Couldn't open replay file '%s': %s\n",
+				ESC_COLOR_MAGENTA,
+				ESC_COLOR_RESET,
+				opt.val_r, strerror(errno));
+			goto exit;
+		}
+		k = capture_detect(&ports[0], &opt);
+		if (k < 0 || (!k && log_detect(&ports[0], &opt) < 0)) {
+			goto exit;
+		}
+		if (ports[0].cap_in.active) {
+			clock_start(&ses, &opt, ports[0].cap_in.start_ns);
+		} else if (opt.opt_g && !opt.val_g_default && !opt.opt_B) {
+			fprintf(stderr,
+				"%sWarning%s: '-g' (Idle gap) only applies to replays of timestamped captures\n",
+				ESC_COLOR_YELLOW,
+				ESC_COLOR_RESET
+			);
 		}
+		ports[0].rx_size = REPLAY_BUFFER_SIZE;
+		ports[0].state = PORT_READY;
+	} else if (open_ports_start(&ses, &opt)) {
+		goto exit;
+	}
+	
+	//	Open the control FIFO if option is specified
+	if (control_open(&ses, &opt)) {
+		goto exit;
+	}
+	
+	//	Draw plots at a fixed frame rate from here on
+	if (opt.opt_G) {
+		timer_add(&ses, &ses.frame, plot_timer, &ses);
+		plot_start(&ses, &opt);
+	}
+	
+	//	Emulated screens are drawn by a frame timer which received data arms
+	if (opt.opt_U) {
+		timer_add(&ses, &ses.frame, vt_timer, &ses);
+		vt_start(&ses, &opt);
 	}
 	
-	//	Read bytes from tty and write formatted output to stderr
+	//	Read bytes from ttys and write formatted output to stderr, page faults from here on are counted
+	ses.faults = minor_faults();
 	while (1) {
-		len = read(app.tty, buffer, sizeof(buffer) - 1);
-		if (len > 0) {
-			count = 0;
-			p = buffer;
-			while (1) {
-				
-				//	Print in specified output format
-				if (opt.opt_m) print_byte_midi(p, &app, &opt);
-				else if (opt.opt_a) print_byte_ascii(p, &app, &opt);
-				else print_byte_raw(p, &app, &opt);
-				
-				//	Optionally write binary data to output file
-				if (opt.opt_o && app.fd) {
-					fwrite((void*)p, sizeof(uint8_t), 1, app.fd);
-				}
-				
-				//	Increment read pointer
-				p++;
-				
-				//	Determine if there are more bytes to process
-				if (++count == len) {
-					break;
-				}
+		//	Wait for configured ports, input or control commands, which are applied between chunks
+		nfds = 0;
+		if (ses.pending) {
+			fds[nfds].fd = ses.notify[0];
+			tag[nfds++] = -1;
+		}
+		if (ses.ctl.fd >= 0) {
+			fds[nfds].fd = ses.ctl.fd;
+			tag[nfds++] = -2;
+		}
+		for (i = 0; i < ses.nports; i++) {
+			if (ports[i].state == PORT_READY) {
+				fds[nfds].fd = ports[i].tty;
+				tag[nfds++] = i;
 			}
-		} else if (len < 0 && errno == EINTR) {
-		//	Exit on read() interrupt
+		}
+		if (!ses.pending && (int)nfds == (ses.ctl.fd >= 0)) {
+			//	No ports left to read
+			break;
+		}
+		for (k = 0; k < (int)nfds; k++) {
+			fds[k].events = POLLIN;
+		}
+		if (ses.journal && ses.journal->blocked) {
+			fds[nfds].fd = ses.journal->fd;
+			fds[nfds].events = POLLOUT;
+			tag[nfds++] = -3;
+		}
+		
+		//	Sleep until input arrives or the next timer is due, without periodic wakeups
+		rc = poll(fds, nfds, timer_timeout(&ses));
+		if (rc >= 0) {
+			ses.wakeups++;
+			ses.timer_wakeups += (rc == 0);
+		}
+		if (rc < 0 && errno == EINTR) {
+			//	Exit on poll() interrupt
 			fprintf(stderr, "\n");
-			goto exit_locked;
-		} else if (len < 0) {
-			fprintf(stderr, "Read error: %s\n", strerror(errno));
-			return 0;
-		} else {
-			fprintf(stderr, "Read timeout\n");
-			return 0;
+			break;
+		} else if (rc < 0) {
+			fprintf(stderr, "Poll error: %s\n", strerror(errno));
+			break;
+		}
+		for (k = 0; k < (int)nfds; k++) {
+			if (!fds[k].revents) {
+				continue;
+			}
+			if (tag[k] == -1) {
+				open_ports_collect(&ses, &opt);
+			} else if (tag[k] == -2) {
+				control_read(&ses, &opt);
+			} else if (tag[k] == -3) {
+				journal_ready(ses.journal);
+			} else if (read_port(&ses, &opt, &ports[tag[k]], buffer)) {
+				goto exit;
+			}
+		}
+		timer_run(&ses, &opt);
+		
+		//	Update the metrics file as soon as an anomaly alert has been counted
+		if (anomaly_alerted(&ses)) {
+			metrics_write(&ses, &opt);
 		}
-		fflush(stderr);
-		fflush(app.fd);
 	}
 	
-	//	Remove advisory lock on tty file descriptor
-	exit_locked:
-	rc = flock(app.tty, LOCK_UN);
-	if (rc) {
-		fprintf(stderr, "Couldn't unlock '%s': %s\n",
-			opt.val_p, strerror(errno));
+	//	Fail if none of the requested ports could be configured
+	rc = opt.opt_r ? 0 : -1;
+	for (i = 0; i < ses.nports; i++) {
+		if (ports[i].state >= PORT_READY && !ports[i].config_rc) {
+			rc = 0;
+		}
 	}
 	
-	//	Close file descriptors
-	exit_unlocked:
-	close(app.tty);
-	fclose(app.fd);
+	//	Finish, unlock and close all ports
+	exit:
+	open_ports_finish(&ses);
+	for (i = 0; i < ses.nports; i++) {
+		port_close(&ports[i], &opt);
+	}
+	if (ses.log) {
+		log_close(ses.log);
+		ses.log = NULL;
+	}
+	if (ses.journal) {
+		journal_close(ses.journal, &ses);
+	}
+	if (ses.compare) {
+		compare_close(ses.compare);
+	}
+	plot_end(&ses, &opt);
+	vt_end(&ses, &opt);
+	metrics_write(&ses, &opt);
+	if (opt.opt_V) {
+		print_footprint(&ses);
+	}
+	control_close(&ses, &opt);
 	
 	//	Free implicitly allocated strings
-	if (opt.val_p) {
-		free(opt.val_p);
+	for (i = 0; i < opt.nports; i++) {
+		free(opt.val_ports[i]);
 	}
 	if (opt.val_o) {
 		free(opt.val_o);
 	}
+	if (opt.val_e) {
+		free(opt.val_e);
+	}
+	if (opt.val_f) {
+		free(opt.val_f);
+	}
+	if (opt.val_r) {
+		free(opt.val_r);
+	}
+	if (opt.val_C) {
+		free(opt.val_C);
+	}
+	if (opt.val_M) {
+		free(opt.val_M);
+	}
+	if (opt.val_E) {
+		free(opt.val_E);
+	}
+	if (opt.val_Q) {
+		free(opt.val_Q);
+	}
+	if (opt.val_A_capture) {
+		free(opt.val_A_capture);
+	}
+	if (opt.val_O) {
+		free(opt.val_O);
+	}
+	if (opt.val_J) {
+		free(opt.val_J);
+	}
+	if (opt.val_N_demux) {
+		free(opt.val_N_demux);
+	}
+	if (opt.val_U_snap) {
+		free(opt.val_U_snap);
+	}
+	for (i = 0; i < opt.nmilestones; i++) {
+		free(opt.val_milestones[i]);
+	}
+	for (i = 0; i < ses.nports; i++) {
+		fmt_free(ports[i].fmt);
+		re_match_free(ports[i].re);
+		free(ports[i].clock);
+		free(ports[i].lin);
+		log_reader_free(ports[i].log_in);
+	}
+	arena_free(&ses.arena);
 	
-	return 0;
+	return rc;
 }